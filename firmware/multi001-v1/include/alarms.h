@@ -0,0 +1,177 @@
+/*********************************************************************
+ * NAME
+ *   alarms.h - per-field threshold and rate-of-change alarms.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Evaluates alarm rules against fixed-point field values every time
+ *   a field is sampled, so that an excursion is detected at the
+ *   internal sample rate rather than at the (much slower) publication
+ *   rate.
+ *
+ *   A rule names the field it applies to and may specify a high limit,
+ *   a low limit and a maximum rate of change (in field units per
+ *   minute). Rate of change is measured across a sliding window of
+ *   ALARM_WINDOW_SAMPLES samples spread evenly over the rule's window
+ *   period, so a short spike cannot masquerade as a trend and a slow
+ *   sample rate does not hide one.
+ *
+ *   Each rule has one alarm condition at a time. A limit alarm clears
+ *   when the value returns inside the limit by the rule's hysteresis;
+ *   a rate alarm clears when the rate falls below half its limit.
+ *
+ *   Raising an alarm boosts the rule's field for ALARM_BOOST_DURATION,
+ *   during which callers should report every sample of that field
+ *   (see alarmBoosted()), ignoring any deadband or compression.
+ */
+
+#ifndef ALARMS_H
+#define ALARMS_H
+
+#include <Arduino.h>
+
+#define ALARM_WINDOW_SAMPLES 16
+#define ALARM_BOOST_DURATION 300000       // Milliseconds
+#define ALARM_DISABLED INT32_MIN          // Value for an unused limit
+
+enum ALARM_CONDITION { ALARM_NORMAL, ALARM_HIGH, ALARM_LOW, ALARM_RATE };
+
+const char *ALARM_CONDITION_NAMES[] = { "normal", "high", "low", "rate" };
+
+/**********************************************************************
+ * Structure describing an alarm rule. The first seven members are user
+ * configuration; the remainder is maintained by the module.
+ */
+struct ALARM_RULE {
+  const char *field;              // Name of the field the rule applies to
+  int scale;                      // Fixed-point units per field unit
+  int32_t high;                   // High limit or ALARM_DISABLED
+  int32_t low;                    // Low limit or ALARM_DISABLED
+  int32_t rate;                   // Rate limit per minute or ALARM_DISABLED
+  unsigned long window;           // Milliseconds over which rate is measured
+  int32_t hysteresis;             // Limit alarm clearing margin
+  ALARM_CONDITION condition;      // Current alarm condition
+  boolean changed;                // Condition changed since last collection
+  int32_t value;                  // Most recent value
+  int32_t currentRate;            // Most recent rate per minute
+  unsigned long boostUntil;       // Millis at which boost ends
+  int sampleCount;                // Samples in window
+  int sampleHead;                 // Index of next sample slot
+  int32_t values[ALARM_WINDOW_SAMPLES];
+  unsigned long times[ALARM_WINDOW_SAMPLES];
+};
+
+ALARM_RULE *alarmRuleTable = 0;
+int alarmRuleCount = 0;
+
+void alarmBegin(ALARM_RULE *rules, int count) {
+  alarmRuleTable = rules;
+  alarmRuleCount = count;
+  for (int i = 0; i < count; i++) {
+    rules[i].condition = ALARM_NORMAL;
+    rules[i].changed = false;
+    rules[i].currentRate = 0;
+    rules[i].boostUntil = 0UL;
+    rules[i].sampleCount = 0;
+    rules[i].sampleHead = 0;
+  }
+}
+
+/**********************************************************************
+ * Add a sample to <rule>'s window and return the rate of change per
+ * minute across the window (0 until the window is half full).
+ */
+int32_t alarmWindowRate(ALARM_RULE &rule, int32_t value, unsigned long now) {
+  int newest = ((rule.sampleHead + ALARM_WINDOW_SAMPLES - 1) % ALARM_WINDOW_SAMPLES);
+  int oldest;
+  unsigned long span;
+
+  if ((rule.sampleCount == 0) || ((now - rule.times[newest]) >= (rule.window / ALARM_WINDOW_SAMPLES))) {
+    rule.values[rule.sampleHead] = value;
+    rule.times[rule.sampleHead] = now;
+    rule.sampleHead = ((rule.sampleHead + 1) % ALARM_WINDOW_SAMPLES);
+    if (rule.sampleCount < ALARM_WINDOW_SAMPLES) rule.sampleCount++;
+  }
+  oldest = ((rule.sampleHead + ALARM_WINDOW_SAMPLES - rule.sampleCount) % ALARM_WINDOW_SAMPLES);
+  span = (now - rule.times[oldest]);
+  if (span < (rule.window / 2)) return(0);
+  return((int32_t) (((int64_t) (value - rule.values[oldest]) * 60000) / (int64_t) span));
+}
+
+/**********************************************************************
+ * Evaluate the rules for <field> against <value> sampled at <now>.
+ * Returns true if the condition of any rule changed.
+ */
+boolean alarmSample(const char *field, int32_t value, unsigned long now) {
+  boolean retval = false;
+
+  for (int i = 0; i < alarmRuleCount; i++) {
+    ALARM_RULE &rule = alarmRuleTable[i];
+    if (strcmp(rule.field, field) != 0) continue;
+
+    ALARM_CONDITION condition = rule.condition;
+    rule.value = value;
+    rule.currentRate = (rule.rate != ALARM_DISABLED)?alarmWindowRate(rule, value, now):0;
+
+    // Clear the current condition if it no longer applies.
+    switch (condition) {
+      case ALARM_HIGH: if (value < (rule.high - rule.hysteresis)) condition = ALARM_NORMAL; break;
+      case ALARM_LOW: if (value > (rule.low + rule.hysteresis)) condition = ALARM_NORMAL; break;
+      case ALARM_RATE: if (abs(rule.currentRate) < (rule.rate / 2)) condition = ALARM_NORMAL; break;
+      default: break;
+    }
+    // Raise a new condition, limits taking precedence over rate.
+    if ((condition == ALARM_NORMAL) || (condition == ALARM_RATE)) {
+      if ((rule.high != ALARM_DISABLED) && (value >= rule.high)) {
+        condition = ALARM_HIGH;
+      } else if ((rule.low != ALARM_DISABLED) && (value <= rule.low)) {
+        condition = ALARM_LOW;
+      } else if ((condition == ALARM_NORMAL) && (rule.rate != ALARM_DISABLED) && (abs(rule.currentRate) >= rule.rate)) {
+        condition = ALARM_RATE;
+      }
+    }
+
+    if (condition != rule.condition) {
+      if (condition != ALARM_NORMAL) rule.boostUntil = (now + ALARM_BOOST_DURATION);
+      rule.condition = condition;
+      rule.changed = true;
+      retval = true;
+    }
+  }
+  return(retval);
+}
+
+/**********************************************************************
+ * Return true if a rule for <field> is boosting it at <now>.
+ */
+boolean alarmBoosted(const char *field, unsigned long now) {
+  for (int i = 0; i < alarmRuleCount; i++) {
+    ALARM_RULE &rule = alarmRuleTable[i];
+    if ((rule.boostUntil) && ((long) (rule.boostUntil - now) > 0) && (strcmp(rule.field, field) == 0)) return(true);
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Return true if the condition of rule <index> has changed since it
+ * was last collected, leaving the flag set.
+ */
+boolean alarmPending(int index) {
+  return(alarmRuleTable[index].changed);
+}
+
+/**********************************************************************
+ * Return true if the condition of rule <index> has changed since it
+ * was last collected and clear the flag.
+ */
+boolean alarmCollect(int index) {
+  boolean retval = alarmRuleTable[index].changed;
+  alarmRuleTable[index].changed = false;
+  return(retval);
+}
+
+const char *alarmConditionName(ALARM_RULE &rule) {
+  return(ALARM_CONDITION_NAMES[rule.condition]);
+}
+
+#endif
@@ -0,0 +1,281 @@
+/*********************************************************************
+ * NAME
+ *   backfill.h - rate-limited replay of the flash log after an outage.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Streams the samples logged while the broker was unreachable (see
+ *   flash-log.h) once the connection returns, without flooding the
+ *   broker or holding up live traffic.
+ *
+ *   The module keeps a mark: the log clock time up to which every
+ *   sample is known to have been published. While the connection is
+ *   up and no backfill is running the mark follows the clock. When the
+ *   connection returns after an outage a backfill of the range from
+ *   the mark to the time of reconnection is started, working through
+ *   each logged field in turn. Reconnecting during a backfill causes a
+ *   further backfill, from the end of the first, to follow it.
+ *
+ *   Chunks are produced by backfillNextChunk() and the caller reports
+ *   the outcome of publishing each with backfillResult(), perhaps some
+ *   time later; no further chunk is produced until it has. The outcome
+ *   is usually known in a TCP callback, so backfillResult() only
+ *   records it: the flash is read and written by backfillNextChunk()
+ *   and backfillService(), which are called from loop(). The number
+ *   of samples per chunk adapts to the publish latency (the time the
+ *   broker took to take the chunk) and failure rate: it grows by one
+ *   after each quick publish and shrinks by a quarter after a slow
+ *   one, and a failed publish halves it and holds off
+ *   further chunks for a back off time that doubles with each
+ *   consecutive failure, the chunk then being sent again. Separately, a
+ *   token bucket holds the average rate to a ceiling in bytes per
+ *   second.
+ *
+ *   Progress (the mark and, during a backfill, its range, field and the
+ *   time of the last sample sent) is checkpointed to the file
+ *   BACKFILL_CHECKPOINT_FILE when the connection is lost, when a
+ *   backfill starts or ends and otherwise at most every
+ *   BACKFILL_SAVE_INTERVAL, so that an interrupted backfill resumes
+ *   where it stopped, even after a restart. Resuming from a checkpoint
+ *   may repeat a few samples; a consumer should key samples by field
+ *   and time.
+ *
+ *   Each chunk is a JSON object:
+ *
+ *     { "field": f, "scale": s, "t": t, "d": [...], "v": [...] }
+ *
+ *   with members as in a flash log query reply.
+ */
+
+#ifndef BACKFILL_H
+#define BACKFILL_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "flash-log.h"
+
+#define BACKFILL_CHECKPOINT_FILE FLASH_LOG_ROOT "/backfill"
+#define BACKFILL_MAGIC 0x4C464B42UL       // "BKFL"
+#define BACKFILL_MIN_VALUES 1             // Samples per chunk
+#define BACKFILL_MAX_VALUES FLASH_LOG_CHUNK_VALUES
+#define BACKFILL_LATENCY_TARGET 100000UL  // Microseconds per publish
+#define BACKFILL_INTERVAL 100UL           // Milliseconds between chunks
+#define BACKFILL_RETRY_MIN 1000UL         // Milliseconds
+#define BACKFILL_RETRY_MAX 60000UL        // Milliseconds
+#define BACKFILL_SAVE_INTERVAL 60000UL    // Milliseconds between checkpoints
+#define BACKFILL_IDLE_SAVE_INTERVAL 600000UL
+
+/**********************************************************************
+ * Progress, as checkpointed.
+ */
+struct BACKFILL_CHECKPOINT {
+  uint32_t magic;
+  uint32_t mark;                  // Samples up to here are published
+  uint32_t target;                // End of the backfill range
+  uint32_t sent;                  // Time of last sample sent in field
+  int32_t field;                  // Field being sent, or -1 if idle
+};
+
+/**********************************************************************
+ * State of the module. The first member is user configuration; the
+ * remainder is maintained by the module.
+ */
+struct BACKFILL {
+  unsigned long rateLimit;        // Bytes per second
+  BACKFILL_CHECKPOINT progress;
+  boolean connected;
+  boolean again;                  // Backfill again after this one
+  boolean dirty;                  // Progress not yet checkpointed
+  unsigned long saved;            // Millis of last checkpoint
+  int values;                     // Samples per chunk
+  unsigned long latency;          // Smoothed publish time (microseconds)
+  int failureRate;                // Smoothed, in thousandths
+  unsigned long retryInterval;
+  unsigned long holdUntil;        // Millis before which no chunk is sent
+  long tokens;                    // Bytes which may be sent now
+  unsigned long refilled;         // Millis of last token refill
+  uint32_t pending;               // Time of last sample in unconfirmed chunk
+  boolean awaiting;               // Outcome of last chunk not yet reported
+  boolean resend;                 // Last chunk failed and must be re-read
+};
+
+BACKFILL backfill = { 512UL };
+
+void backfillSave(unsigned long now) {
+  File file = LittleFS.open(BACKFILL_CHECKPOINT_FILE, "w");
+
+  if (file) {
+    file.write((const uint8_t *) &backfill.progress, sizeof(backfill.progress));
+    file.close();
+  }
+  backfill.dirty = false;
+  backfill.saved = now;
+}
+
+/**********************************************************************
+ * Position the backfill reader after the last sample sent from the
+ * current field, moving on to the next field (or finishing the
+ * backfill) if there is nothing left to send from it.
+ */
+void backfillSeek(unsigned long now) {
+  BACKFILL_CHECKPOINT &progress = backfill.progress;
+  FLASH_LOG_QUERY &query = flashLogQueries[FLASH_LOG_QUERY_BACKFILL];
+
+  backfill.resend = false;
+  while (progress.field >= 0) {
+    if (progress.field < flashLogCount) {
+      flashLogOpen(query, progress.field, (progress.sent + 1), progress.target);
+      if (flashLogPeek(query)) return;
+      progress.field++;
+      progress.sent = progress.mark;
+    } else {
+      // Finished: everything up to the target is now published.
+      progress.mark = progress.target;
+      progress.field = -1;
+      if (backfill.again) {
+        backfill.again = false;
+        progress.target = flashLogClock(now);
+        progress.sent = progress.mark;
+        progress.field = 0;
+      }
+      backfillSave(now);
+    }
+  }
+}
+
+/**********************************************************************
+ * Recover progress from the checkpoint file. Call after flashLogBegin()
+ * with the ceiling on backfill traffic in bytes per second.
+ */
+void backfillBegin(unsigned long rateLimit, unsigned long now) {
+  File file = LittleFS.open(BACKFILL_CHECKPOINT_FILE, "r");
+
+  backfill.rateLimit = rateLimit;
+  backfill.progress.field = -1;
+  backfill.progress.mark = flashLogClock(now);
+  if (file) {
+    BACKFILL_CHECKPOINT progress;
+    if ((file.read((uint8_t *) &progress, sizeof(progress)) == sizeof(progress)) && (progress.magic == BACKFILL_MAGIC)) backfill.progress = progress;
+    file.close();
+  }
+  backfill.progress.magic = BACKFILL_MAGIC;
+  backfill.connected = false;
+  backfill.again = false;
+  backfill.values = BACKFILL_MIN_VALUES;
+  backfill.latency = 0UL;
+  backfill.failureRate = 0;
+  backfill.retryInterval = BACKFILL_RETRY_MIN;
+  backfill.holdUntil = now;
+  backfill.tokens = 0;
+  backfill.refilled = now;
+  backfill.saved = now;
+  backfill.awaiting = false;
+  backfill.resend = false;
+}
+
+/**********************************************************************
+ * Called on every pass of loop() with the state of the broker
+ * connection. Starts a backfill when the connection returns and keeps
+ * the checkpoint up to date.
+ */
+void backfillService(boolean connected, unsigned long now) {
+  BACKFILL_CHECKPOINT &progress = backfill.progress;
+  uint32_t clock = flashLogClock(now);
+
+  if (connected != backfill.connected) {
+    backfill.connected = connected;
+    if (connected) {
+      if (progress.field >= 0) {
+        backfill.again = true;
+      } else if (progress.mark < clock) {
+        progress.target = clock;
+        progress.sent = progress.mark;
+        progress.field = 0;
+      }
+      if (progress.field >= 0) {
+        backfill.values = BACKFILL_MIN_VALUES;
+        backfill.retryInterval = BACKFILL_RETRY_MIN;
+        backfill.holdUntil = now;
+        backfillSeek(now);
+      }
+    }
+    backfillSave(now);
+    return;
+  }
+
+  if ((connected) && (progress.field < 0)) {
+    // Live publication covers everything from here on.
+    if (progress.mark != clock) { progress.mark = clock; backfill.dirty = true; }
+    if ((backfill.dirty) && ((now - backfill.saved) >= BACKFILL_IDLE_SAVE_INTERVAL)) backfillSave(now);
+  } else if ((backfill.dirty) && ((now - backfill.saved) >= BACKFILL_SAVE_INTERVAL)) {
+    backfillSave(now);
+  }
+}
+
+/**********************************************************************
+ * Returns true if a backfill is in progress.
+ */
+boolean backfillRunning() {
+  return(backfill.progress.field >= 0);
+}
+
+/**********************************************************************
+ * Write the next chunk of backfill into the <size> bytes at <buffer>,
+ * if the rate limit and back off allow. Returns false if there is
+ * nothing to send now. The outcome of publishing the chunk must be
+ * reported by backfillResult().
+ */
+boolean backfillNextChunk(char *buffer, size_t size, unsigned long now) {
+  FLASH_LOG_QUERY &query = flashLogQueries[FLASH_LOG_QUERY_BACKFILL];
+  size_t length;
+
+  if ((!backfill.connected) || (backfill.progress.field < 0) || (backfill.awaiting)) return(false);
+  backfill.tokens += (long) (((now - backfill.refilled) * backfill.rateLimit) / 1000UL);
+  backfill.refilled = now;
+  if (backfill.tokens > (long) size) backfill.tokens = (long) size;
+  if (((long) (now - backfill.holdUntil) < 0) || (backfill.tokens < (long) size)) return(false);
+
+  if ((backfill.resend) || (!flashLogPeek(query))) {
+    backfillSeek(now);
+    if ((backfill.progress.field < 0) || (!flashLogPeek(query))) return(false);
+  }
+  FLASH_LOG_FIELD &field = flashLogTable[query.field];
+  length = snprintf(buffer, size, "{ \"field\": \"%s\", \"scale\": %d, \"t\": ", field.field, field.scale);
+  length += flashLogFormat(query, buffer + length, size - length, backfill.values);
+  snprintf(buffer + length, size - length, " }");
+  backfill.pending = query.times[query.index - 1];
+  backfill.awaiting = true;
+  return(true);
+}
+
+/**********************************************************************
+ * Report the outcome of publishing the last chunk: <ok> if the publish
+ * succeeded, the <latency> of the publish in microseconds and the
+ * <bytes> sent. Safe to call from a TCP callback.
+ */
+void backfillResult(boolean ok, unsigned long latency, size_t bytes, unsigned long now) {
+  if (!backfill.awaiting) return;
+  backfill.awaiting = false;
+  backfill.tokens -= (long) bytes;
+  backfill.failureRate += ((((ok)?0:1000) - backfill.failureRate) / 8);
+  if (ok) {
+    backfill.latency = (backfill.latency)?(((backfill.latency * 7) + latency) / 8):latency;
+    if ((backfill.latency <= BACKFILL_LATENCY_TARGET) && (backfill.failureRate < 100)) {
+      if (backfill.values < BACKFILL_MAX_VALUES) backfill.values++;
+    } else {
+      backfill.values = max(BACKFILL_MIN_VALUES, ((backfill.values * 3) / 4));
+    }
+    backfill.retryInterval = BACKFILL_RETRY_MIN;
+    backfill.holdUntil = (now + BACKFILL_INTERVAL);
+    backfill.progress.sent = backfill.pending;
+    backfill.dirty = true;
+  } else {
+    backfill.values = max(BACKFILL_MIN_VALUES, (backfill.values / 2));
+    backfill.holdUntil = (now + backfill.retryInterval);
+    backfill.retryInterval = min(BACKFILL_RETRY_MAX, (backfill.retryInterval * 2));
+    // Send the chunk again, once the next one is asked for.
+    backfill.resend = true;
+  }
+}
+
+#endif
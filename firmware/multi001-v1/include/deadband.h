@@ -0,0 +1,43 @@
+/*********************************************************************
+ * NAME
+ *   deadband.h - change detection with a deadband.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Tracks the most recently published value of a fixed-point field
+ *   and reports whether a new value differs from it by at least the
+ *   field's deadband, in which case the new value becomes the
+ *   published value.
+ */
+
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <Arduino.h>
+
+struct DEADBAND {
+  int32_t deadband;               // Smallest change that is significant
+  int32_t published;              // Most recently published value
+  boolean valid;                  // False until a value is published
+};
+
+/**********************************************************************
+ * Return true (and make <value> the published value) if <value> is a
+ * significant change from the published value of <field>.
+ */
+boolean deadbandExceeded(DEADBAND &field, int32_t value) {
+  if ((field.valid) && (abs(value - field.published) < field.deadband)) return(false);
+  field.published = value;
+  field.valid = true;
+  return(true);
+}
+
+/**********************************************************************
+ * Forget the published value of <field> so that the next value is
+ * always significant.
+ */
+void deadbandReset(DEADBAND &field) {
+  field.valid = false;
+}
+
+#endif
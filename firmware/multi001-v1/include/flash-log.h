@@ -0,0 +1,622 @@
+/*********************************************************************
+ * NAME
+ *   flash-log.h - compressed time-series log on LittleFS.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Keeps an append-only log of selected fields on the flash filesystem
+ *   so that a node which spends days without a broker loses nothing.
+ *
+ *   Samples are time stamped in seconds on the log clock, which runs on
+ *   from the newest logged sample after a restart and is stepped
+ *   forward to UTC once SNTP has set the system time. Stamps are
+ *   therefore always increasing, and are UTC seconds whenever the node
+ *   has ever had a time server.
+ *
+ *   Each field has its own directory holding a sequence of segment
+ *   files, each no larger than a flash sector. A segment begins with an
+ *   index header giving its field, sample count, time range and value
+ *   range, so that a range query can skip whole segments, followed by
+ *   blocks of samples. Samples are encoded as in Facebook's Gorilla:
+ *   timestamps as delta-of-deltas in variable length buckets (a steady
+ *   sample rate costs one bit) and values as the XOR with their
+ *   predecessor, storing only the meaningful bits (an unchanged value
+ *   costs one bit). Values are the fixed-point integers used elsewhere
+ *   in the firmware rather than floats.
+ *
+ *   Flash wear is bounded by building each block in RAM and writing it
+ *   only when it is full or FLASH_LOG_FLUSH_INTERVAL has passed since
+ *   its first sample, and by keeping at most FLASH_LOG_MAX_SEGMENTS
+ *   sealed segments per field, the oldest being deleted to make room.
+ *   A power failure loses at most the block in RAM.
+ *
+ *   The segment being written is called "open". Each block carries a
+ *   CRC and sealing scans the blocks, writes the index header and then
+ *   renames the file to its sequence number; LittleFS makes the rename
+ *   atomic. An open segment found at startup is sealed in the same way,
+ *   discarding anything after its last good block.
+ *
+ *   A query names a field and a range of log clock times and is
+ *   answered by a sequence of chunks produced one at a time by
+ *   flashLogNextChunk(). Each chunk is a JSON object:
+ *
+ *     { "id": i, "field": f, "scale": s, "now": n, "t": t, "d": [...], "v": [...], "more": m }
+ *
+ *   where <i> is the query id, <s> the fixed-point units per field
+ *   unit, <n> the log clock now, <t> the time of the first value, "d"
+ *   the intervals in seconds between successive values, "v" the
+ *   fixed-point values and <m> false on the last chunk.
+ */
+
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <LittleFS.h>
+#include <time.h>
+
+#define FLASH_LOG_ROOT "/log"
+#define FLASH_LOG_MAGIC 0x474F4C47UL      // "GLOG"
+#define FLASH_LOG_SEGMENT_SIZE 4096       // Bytes
+#define FLASH_LOG_MAX_SEGMENTS 48         // Sealed segments kept per field
+#define FLASH_LOG_BLOCK_DATA 116          // Bytes of encoded samples per block
+#define FLASH_LOG_BLOCK_SAMPLES 64        // Maximum samples per block
+#define FLASH_LOG_MAX_SAMPLE_BITS 80      // Worst case size of one sample
+#define FLASH_LOG_FLUSH_INTERVAL 900000UL // Milliseconds a block may stay in RAM
+#define FLASH_LOG_UTC_VALID 1600000000UL  // System times above this are UTC
+#define FLASH_LOG_CHUNK_VALUES 16         // Maximum values per chunk
+
+#define FLASH_LOG_RAM 0xFFFFFFFDUL        // Query sequence numbers
+#define FLASH_LOG_OPEN 0xFFFFFFFEUL
+#define FLASH_LOG_END 0xFFFFFFFFUL
+
+/**********************************************************************
+ * Index header at the start of every segment. The statistics are zero
+ * until the segment is sealed.
+ */
+struct FLASH_LOG_SEGMENT_HEADER {
+  uint32_t magic;
+  char field[24];
+  uint32_t count;                 // Samples in segment
+  uint32_t first;                 // Time of first sample
+  uint32_t last;                  // Time of last sample
+  int32_t minimum;
+  int32_t maximum;
+};
+
+/**********************************************************************
+ * A block of samples, as written to flash. Only <length> bytes of data
+ * are written.
+ */
+struct FLASH_LOG_BLOCK {
+  uint8_t length;                 // Bytes of data used
+  uint8_t count;                  // Samples, including the first
+  uint16_t crc;                   // Of the remainder of the block
+  uint32_t time;                  // Time of first sample
+  int32_t value;                  // First sample
+  uint8_t data[FLASH_LOG_BLOCK_DATA];
+};
+#define FLASH_LOG_BLOCK_HEADER_SIZE (sizeof(FLASH_LOG_BLOCK) - FLASH_LOG_BLOCK_DATA)
+
+/**********************************************************************
+ * Structure describing a single field. The first three members are
+ * user configuration; the remainder is maintained by the module.
+ */
+struct FLASH_LOG_FIELD {
+  const char *field;              // Name of the field (and directory)
+  int scale;                      // Fixed-point units per field unit
+  unsigned long interval;         // Milliseconds between samples
+  uint32_t firstSeq;              // Oldest sealed segment
+  uint32_t nextSeq;               // Sequence number for next seal
+  size_t openSize;                // Bytes in open segment (0 if none)
+  FLASH_LOG_BLOCK block;          // Block being encoded
+  int bits;                       // Bits of block data used
+  uint32_t lastTime;
+  int32_t lastDelta;
+  int32_t lastValue;
+  uint8_t leading;                // Window of last XOR (leading > 31 if none)
+  uint8_t trailing;
+  unsigned long blockStarted;     // Millis of first sample in block
+  unsigned long lastSampled;
+  boolean pending;                // A sample is waiting
+  int32_t pendingValue;
+};
+
+/**********************************************************************
+ * A reader working through a range of one field's log. Reader
+ * FLASH_LOG_QUERY_REQUEST answers queries; others are for use by other
+ * modules.
+ */
+struct FLASH_LOG_QUERY {
+  boolean active;
+  uint32_t id;
+  int field;
+  uint32_t from;
+  uint32_t to;
+  uint32_t seq;                   // Segment being read, or FLASH_LOG_OPEN etc.
+  size_t offset;                  // Offset of next block in segment
+  int count;                      // Samples decoded from current block
+  int index;                      // Next sample to send
+  uint32_t times[FLASH_LOG_BLOCK_SAMPLES];
+  int32_t values[FLASH_LOG_BLOCK_SAMPLES];
+};
+
+#define FLASH_LOG_QUERY_REQUEST 0
+#define FLASH_LOG_QUERY_BACKFILL 1
+#define FLASH_LOG_QUERIES 2
+
+FLASH_LOG_FIELD *flashLogTable = 0;
+int flashLogCount = 0;
+FLASH_LOG_QUERY flashLogQueries[FLASH_LOG_QUERIES];
+uint32_t flashLogSeconds = 0;
+unsigned long flashLogTicked = 0UL;
+
+uint16_t flashLogCrc(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF;
+
+  while (length--) {
+    crc ^= ((uint16_t) *data++ << 8);
+    for (int bit = 0; bit < 8; bit++) crc = (crc & 0x8000)?((crc << 1) ^ 0x1021):(crc << 1);
+  }
+  return(crc);
+}
+
+uint16_t flashLogBlockCrc(const FLASH_LOG_BLOCK &block) {
+  return(flashLogCrc((const uint8_t *) &block.time, (FLASH_LOG_BLOCK_HEADER_SIZE - 4 + block.length)));
+}
+
+void flashLogPath(char *buffer, size_t size, const char *field, uint32_t seq) {
+  if (seq == FLASH_LOG_OPEN) snprintf(buffer, size, FLASH_LOG_ROOT "/%s/open", field);
+  else snprintf(buffer, size, FLASH_LOG_ROOT "/%s/%08lx", field, (unsigned long) seq);
+}
+
+/**********************************************************************
+ * Append the low <count> bits of <bits> to the block being encoded,
+ * most significant first.
+ */
+void flashLogPut(FLASH_LOG_FIELD &field, uint32_t bits, int count) {
+  while (count--) {
+    if ((bits >> count) & 1) field.block.data[field.bits >> 3] |= (0x80 >> (field.bits & 7));
+    field.bits++;
+  }
+}
+
+uint32_t flashLogGet(const uint8_t *data, int &bit, int count) {
+  uint32_t retval = 0;
+
+  while (count--) {
+    retval = ((retval << 1) | ((data[bit >> 3] >> (7 - (bit & 7))) & 1));
+    bit++;
+  }
+  return(retval);
+}
+
+int32_t flashLogSigned(uint32_t bits, int count) {
+  return((count < 32)?((int32_t) (bits << (32 - count)) >> (32 - count)):(int32_t) bits);
+}
+
+/**********************************************************************
+ * Add a sample to the block being encoded, which must have room for it.
+ */
+void flashLogEncode(FLASH_LOG_FIELD &field, uint32_t time, int32_t value, unsigned long now) {
+  if (field.block.count == 0) {
+    memset(&field.block, 0, sizeof(field.block));
+    field.block.time = time;
+    field.block.value = value;
+    field.bits = 0;
+    field.lastDelta = 0;
+    field.leading = 0xFF;
+    field.blockStarted = now;
+  } else {
+    int32_t delta = (int32_t) (time - field.lastTime);
+    int32_t dod = (delta - field.lastDelta);
+    uint32_t xored = ((uint32_t) value ^ (uint32_t) field.lastValue);
+
+    if (dod == 0) flashLogPut(field, 0x0, 1);
+    else if ((dod >= -64) && (dod <= 63)) { flashLogPut(field, 0x2, 2); flashLogPut(field, (uint32_t) dod, 7); }
+    else if ((dod >= -256) && (dod <= 255)) { flashLogPut(field, 0x6, 3); flashLogPut(field, (uint32_t) dod, 9); }
+    else if ((dod >= -2048) && (dod <= 2047)) { flashLogPut(field, 0xE, 4); flashLogPut(field, (uint32_t) dod, 12); }
+    else { flashLogPut(field, 0xF, 4); flashLogPut(field, (uint32_t) dod, 32); }
+    field.lastDelta = delta;
+
+    if (xored == 0) {
+      flashLogPut(field, 0x0, 1);
+    } else {
+      uint8_t leading = __builtin_clz(xored);
+      uint8_t trailing = __builtin_ctz(xored);
+      if (leading > 31) leading = 31;
+      if ((field.leading <= 31) && (leading >= field.leading) && (trailing >= field.trailing)) {
+        flashLogPut(field, 0x2, 2);
+        flashLogPut(field, (xored >> field.trailing), (32 - field.leading - field.trailing));
+      } else {
+        flashLogPut(field, 0x3, 2);
+        flashLogPut(field, leading, 5);
+        flashLogPut(field, (31 - leading - trailing), 5);
+        flashLogPut(field, (xored >> trailing), (32 - leading - trailing));
+        field.leading = leading;
+        field.trailing = trailing;
+      }
+    }
+  }
+  field.block.count++;
+  field.lastTime = time;
+  field.lastValue = value;
+}
+
+/**********************************************************************
+ * Decode <block> into <times> and <values>. Returns the number of
+ * samples.
+ */
+int flashLogDecode(const FLASH_LOG_BLOCK &block, uint32_t *times, int32_t *values) {
+  int bit = 0;
+  int32_t delta = 0;
+  uint8_t leading = 0, trailing = 0;
+
+  times[0] = block.time;
+  values[0] = block.value;
+  for (int i = 1; i < block.count; i++) {
+    int32_t dod = 0;
+    if (flashLogGet(block.data, bit, 1)) {
+      if (!flashLogGet(block.data, bit, 1)) dod = flashLogSigned(flashLogGet(block.data, bit, 7), 7);
+      else if (!flashLogGet(block.data, bit, 1)) dod = flashLogSigned(flashLogGet(block.data, bit, 9), 9);
+      else if (!flashLogGet(block.data, bit, 1)) dod = flashLogSigned(flashLogGet(block.data, bit, 12), 12);
+      else dod = flashLogSigned(flashLogGet(block.data, bit, 32), 32);
+    }
+    delta += dod;
+    times[i] = (times[i - 1] + delta);
+
+    uint32_t xored = 0;
+    if (flashLogGet(block.data, bit, 1)) {
+      if (flashLogGet(block.data, bit, 1)) {
+        leading = flashLogGet(block.data, bit, 5);
+        trailing = (31 - leading - flashLogGet(block.data, bit, 5));
+      }
+      xored = (flashLogGet(block.data, bit, (32 - leading - trailing)) << trailing);
+    }
+    values[i] = (int32_t) ((uint32_t) values[i - 1] ^ xored);
+  }
+  return(block.count);
+}
+
+/**********************************************************************
+ * Read the block at <offset> in <file> into <block>. Returns false if
+ * there is no complete, intact block there.
+ */
+boolean flashLogReadBlock(File &file, size_t offset, FLASH_LOG_BLOCK &block) {
+  if (!file.seek(offset)) return(false);
+  if (file.read((uint8_t *) &block, FLASH_LOG_BLOCK_HEADER_SIZE) != FLASH_LOG_BLOCK_HEADER_SIZE) return(false);
+  if ((block.length > FLASH_LOG_BLOCK_DATA) || (block.count == 0) || (block.count > FLASH_LOG_BLOCK_SAMPLES)) return(false);
+  if (file.read(block.data, block.length) != block.length) return(false);
+  return(flashLogBlockCrc(block) == block.crc);
+}
+
+/**********************************************************************
+ * Seal the open segment of <field>: write its index header, covering
+ * every intact block, and give it the next sequence number, deleting
+ * the oldest segment if the field has too many. An empty open segment
+ * is deleted.
+ */
+void flashLogSeal(FLASH_LOG_FIELD &field) {
+  FLASH_LOG_SEGMENT_HEADER header;
+  FLASH_LOG_BLOCK block;
+  uint32_t times[FLASH_LOG_BLOCK_SAMPLES];
+  int32_t values[FLASH_LOG_BLOCK_SAMPLES];
+  char path[48], sealed[48];
+  size_t offset = sizeof(header);
+
+  flashLogPath(path, sizeof(path), field.field, FLASH_LOG_OPEN);
+  File file = LittleFS.open(path, "r+");
+  if (!file) return;
+  memset(&header, 0, sizeof(header));
+  header.magic = FLASH_LOG_MAGIC;
+  strncpy(header.field, field.field, (sizeof(header.field) - 1));
+  while (flashLogReadBlock(file, offset, block)) {
+    int count = flashLogDecode(block, times, values);
+    for (int i = 0; i < count; i++) {
+      if (header.count == 0) { header.first = times[i]; header.minimum = header.maximum = values[i]; }
+      header.minimum = min(header.minimum, values[i]);
+      header.maximum = max(header.maximum, values[i]);
+      header.last = times[i];
+      header.count++;
+    }
+    offset += (FLASH_LOG_BLOCK_HEADER_SIZE + block.length);
+  }
+  if (header.count) {
+    if (file.size() > offset) file.truncate(offset);
+    file.seek(0);
+    file.write((const uint8_t *) &header, sizeof(header));
+  }
+  file.close();
+  field.openSize = 0;
+  if (!header.count) { LittleFS.remove(path); return; }
+
+  flashLogPath(sealed, sizeof(sealed), field.field, field.nextSeq);
+  LittleFS.rename(path, sealed);
+  for (int i = 0; i < FLASH_LOG_QUERIES; i++) {
+    FLASH_LOG_QUERY &query = flashLogQueries[i];
+    if ((query.active) && (&flashLogTable[query.field] == &field) && (query.seq == FLASH_LOG_OPEN)) query.seq = field.nextSeq;
+  }
+  field.nextSeq++;
+  while ((field.nextSeq - field.firstSeq) > FLASH_LOG_MAX_SEGMENTS) {
+    flashLogPath(path, sizeof(path), field.field, field.firstSeq++);
+    LittleFS.remove(path);
+  }
+}
+
+/**********************************************************************
+ * Append the block being encoded for <field> to its open segment,
+ * sealing the segment first if the block would overflow it.
+ */
+void flashLogFlush(FLASH_LOG_FIELD &field) {
+  char path[48];
+
+  if (field.block.count == 0) return;
+  field.block.length = ((field.bits + 7) / 8);
+  field.block.crc = flashLogBlockCrc(field.block);
+  if ((field.openSize) && ((field.openSize + FLASH_LOG_BLOCK_HEADER_SIZE + field.block.length) > FLASH_LOG_SEGMENT_SIZE)) flashLogSeal(field);
+
+  flashLogPath(path, sizeof(path), field.field, FLASH_LOG_OPEN);
+  File file = LittleFS.open(path, "a");
+  if (file) {
+    if (field.openSize == 0) {
+      FLASH_LOG_SEGMENT_HEADER header;
+      memset(&header, 0, sizeof(header));
+      header.magic = FLASH_LOG_MAGIC;
+      strncpy(header.field, field.field, (sizeof(header.field) - 1));
+      field.openSize = file.write((const uint8_t *) &header, sizeof(header));
+    }
+    field.openSize += file.write((const uint8_t *) &field.block, (FLASH_LOG_BLOCK_HEADER_SIZE + field.block.length));
+    file.close();
+  }
+  field.block.count = 0;
+}
+
+/**********************************************************************
+ * Returns the log clock at <now>, stepping it forward to UTC if the
+ * system time has been set.
+ */
+uint32_t flashLogClock(unsigned long now) {
+  time_t utc = time(nullptr);
+
+  while ((now - flashLogTicked) >= 1000UL) {
+    flashLogSeconds++;
+    flashLogTicked += 1000UL;
+  }
+  if ((utc > (time_t) FLASH_LOG_UTC_VALID) && ((uint32_t) utc > flashLogSeconds)) flashLogSeconds = (uint32_t) utc;
+  return(flashLogSeconds);
+}
+
+/**********************************************************************
+ * Mount the filesystem and recover the log of each of the <count>
+ * fields described by <fields>, sealing any segment left open. The log
+ * clock resumes after the newest sample found. Returns false if the
+ * filesystem is unavailable.
+ */
+boolean flashLogBegin(FLASH_LOG_FIELD *fields, int count, unsigned long now) {
+  FLASH_LOG_SEGMENT_HEADER header;
+  char path[48];
+  uint32_t newest = 0;
+
+  flashLogTable = fields;
+  flashLogCount = 0;
+  flashLogTicked = now;
+  if (!LittleFS.begin()) return(false);
+  for (int i = 0; i < count; i++) {
+    FLASH_LOG_FIELD &field = fields[i];
+    boolean found = false;
+    field.firstSeq = field.nextSeq = 0;
+    field.openSize = 0;
+    field.block.count = 0;
+    field.pending = false;
+    field.lastSampled = (now - field.interval);
+    snprintf(path, sizeof(path), FLASH_LOG_ROOT "/%s", field.field);
+    LittleFS.mkdir(path);
+    Dir dir = LittleFS.openDir(path);
+    while (dir.next()) {
+      String name = dir.fileName();
+      if (strcmp(name.c_str(), "open") == 0) continue;
+      uint32_t seq = strtoul(name.c_str(), 0, 16);
+      if ((!found) || (seq < field.firstSeq)) field.firstSeq = seq;
+      if ((!found) || (seq >= field.nextSeq)) field.nextSeq = (seq + 1);
+      found = true;
+    }
+    flashLogSeal(field);
+    if (field.nextSeq != field.firstSeq) {
+      flashLogPath(path, sizeof(path), field.field, (field.nextSeq - 1));
+      File file = LittleFS.open(path, "r");
+      if ((file) && (file.read((uint8_t *) &header, sizeof(header)) == sizeof(header)) && (header.magic == FLASH_LOG_MAGIC) && (header.last >= newest)) newest = (header.last + 1);
+      if (file) file.close();
+    }
+  }
+  flashLogSeconds = newest;
+  flashLogCount = count;
+  return(true);
+}
+
+/**********************************************************************
+ * Offer a fixed-point <value> of <field> for logging. Returns false if
+ * the field is not logged.
+ */
+boolean flashLogSample(const char *field, int32_t value) {
+  for (int i = 0; i < flashLogCount; i++) {
+    if (strcmp(flashLogTable[i].field, field) == 0) {
+      flashLogTable[i].pending = true;
+      flashLogTable[i].pendingValue = value;
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). Logs the waiting sample of each field
+ * whose interval has passed and writes out any block which is full or
+ * has been in RAM for too long.
+ */
+void flashLogService(unsigned long now) {
+  uint32_t clock = flashLogClock(now);
+
+  for (int i = 0; i < flashLogCount; i++) {
+    FLASH_LOG_FIELD &field = flashLogTable[i];
+    if ((field.pending) && ((now - field.lastSampled) >= field.interval)) {
+      if ((field.block.count == FLASH_LOG_BLOCK_SAMPLES) || ((field.bits + FLASH_LOG_MAX_SAMPLE_BITS) > (FLASH_LOG_BLOCK_DATA * 8))) flashLogFlush(field);
+      flashLogEncode(field, clock, field.pendingValue, now);
+      field.pending = false;
+      field.lastSampled = now;
+    }
+    if ((field.block.count) && ((now - field.blockStarted) >= FLASH_LOG_FLUSH_INTERVAL)) flashLogFlush(field);
+  }
+}
+
+/**********************************************************************
+ * Set <query> to read the samples of field <index> logged between
+ * <from> and <to>.
+ */
+void flashLogOpen(FLASH_LOG_QUERY &query, int index, uint32_t from, uint32_t to) {
+  query.field = index;
+  query.from = from;
+  query.to = to;
+  query.seq = flashLogTable[index].firstSeq;
+  query.offset = 0;
+  query.count = query.index = 0;
+  query.active = true;
+}
+
+/**********************************************************************
+ * Start answering the query in <payload>, a JSON object of the form
+ * { "id": i, "field": f, "from": a, "to": b } where <a> and <b> are log
+ * clock times (both optional; the default is everything). Any query in
+ * progress is abandoned. Returns false if the query is invalid.
+ */
+boolean flashLogRequest(const char *payload, unsigned int length) {
+  FLASH_LOG_QUERY &query = flashLogQueries[FLASH_LOG_QUERY_REQUEST];
+  StaticJsonDocument<160> request;
+  const char *field;
+
+  query.active = false;
+  if (deserializeJson(request, payload, length)) return(false);
+  field = request["field"] | "";
+  for (int i = 0; i < flashLogCount; i++) {
+    if (strcmp(flashLogTable[i].field, field) == 0) {
+      query.id = (request["id"] | 0UL);
+      flashLogOpen(query, i, (request["from"] | 0UL), (request["to"] | 0xFFFFFFFFUL));
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Decode the next block wanted by <query>, reading sealed segments,
+ * then the open segment and finally the block in RAM. Returns false at
+ * the end of the log or of the query's range.
+ */
+boolean flashLogNextBlock(FLASH_LOG_QUERY &query) {
+  FLASH_LOG_FIELD &field = flashLogTable[query.field];
+  FLASH_LOG_SEGMENT_HEADER header;
+  FLASH_LOG_BLOCK block;
+  char path[48];
+
+  query.count = query.index = 0;
+  while (query.seq != FLASH_LOG_END) {
+    if (query.seq == FLASH_LOG_RAM) {
+      query.seq = FLASH_LOG_END;
+      if (field.block.count == 0) return(false);
+      query.count = flashLogDecode(field.block, query.times, query.values);
+      return(query.times[0] <= query.to);
+    }
+    if ((query.seq < FLASH_LOG_RAM) && (query.seq < field.firstSeq)) { query.seq = field.firstSeq; query.offset = 0; }
+    if ((query.seq < FLASH_LOG_RAM) && (query.seq >= field.nextSeq)) { query.seq = FLASH_LOG_OPEN; query.offset = 0; }
+
+    flashLogPath(path, sizeof(path), field.field, query.seq);
+    File file = LittleFS.open(path, "r");
+    if ((file) && (query.offset == 0)) {
+      if ((file.read((uint8_t *) &header, sizeof(header)) == sizeof(header)) && (header.magic == FLASH_LOG_MAGIC)) {
+        query.offset = sizeof(header);
+        // The index header lets us skip sealed segments out of range.
+        if ((query.seq != FLASH_LOG_OPEN) && (header.first > query.to)) { file.close(); query.seq = FLASH_LOG_END; return(false); }
+        if ((query.seq != FLASH_LOG_OPEN) && (header.last < query.from)) query.offset = file.size();
+      }
+    }
+    if ((file) && (query.offset) && (flashLogReadBlock(file, query.offset, block))) {
+      file.close();
+      query.offset += (FLASH_LOG_BLOCK_HEADER_SIZE + block.length);
+      if (block.time > query.to) { query.seq = FLASH_LOG_END; return(false); }
+      query.count = flashLogDecode(block, query.times, query.values);
+      return(true);
+    }
+    if (file) file.close();
+    query.seq = (query.seq == FLASH_LOG_OPEN)?FLASH_LOG_RAM:(query.seq + 1);
+    query.offset = 0;
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Position <query> on its next sample in range. Returns false, and
+ * makes the query inactive, if there are no more.
+ */
+boolean flashLogPeek(FLASH_LOG_QUERY &query) {
+  while ((query.active) && ((query.index >= query.count) || (query.times[query.index] < query.from))) {
+    if (query.index < query.count) query.index++; else query.active = flashLogNextBlock(query);
+  }
+  if ((query.active) && (query.times[query.index] > query.to)) query.active = false;
+  return(query.active);
+}
+
+/**********************************************************************
+ * Write as many as <limit> samples from the current position of
+ * <query> into the <size> bytes at <buffer> as the JSON fragment
+ *
+ *   t, "d": [...], "v": [...]
+ *
+ * leaving room for a closing member of up to 48 bytes. The query must
+ * be positioned by flashLogPeek() and samples are taken from the
+ * current block only. Returns the length of the fragment.
+ */
+size_t flashLogFormat(FLASH_LOG_QUERY &query, char *buffer, size_t size, int limit) {
+  int values = 0, budget = ((int) size - 48);
+  size_t length;
+
+  while ((values < limit) && ((query.index + values) < query.count) && (query.times[query.index + values] <= query.to)) {
+    int i = (query.index + values);
+    budget -= snprintf(0, 0, "%lu,%ld,", (unsigned long) (i?(query.times[i] - query.times[i - 1]):0), (long) query.values[i]);
+    if ((values) && (budget < 0)) break;
+    values++;
+  }
+
+  length = snprintf(buffer, size, "%lu, \"d\": [", (unsigned long) query.times[query.index]);
+  for (int i = 1; i < values; i++) length += snprintf(buffer + length, size - length, "%s%lu", (i > 1)?",":"", (unsigned long) (query.times[query.index + i] - query.times[query.index + i - 1]));
+  length += snprintf(buffer + length, size - length, "], \"v\": [");
+  for (int i = 0; i < values; i++) length += snprintf(buffer + length, size - length, "%s%ld", i?",":"", (long) query.values[query.index + i]);
+  length += snprintf(buffer + length, size - length, "]");
+  query.index += values;
+  return(length);
+}
+
+/**********************************************************************
+ * Write the next chunk of the reply to the current query into the
+ * <size> bytes at <buffer>. A chunk never spans two blocks. Returns
+ * false if there is nothing to send.
+ */
+boolean flashLogNextChunk(char *buffer, size_t size, unsigned long now) {
+  FLASH_LOG_QUERY &query = flashLogQueries[FLASH_LOG_QUERY_REQUEST];
+  size_t length;
+
+  if (!query.active) return(false);
+  FLASH_LOG_FIELD &field = flashLogTable[query.field];
+
+  length = snprintf(buffer, size, "{ \"id\": %lu, \"field\": \"%s\", \"scale\": %d, \"now\": %lu, \"t\": ", (unsigned long) query.id, field.field, field.scale, (unsigned long) flashLogClock(now));
+  if (!flashLogPeek(query)) {
+    snprintf(buffer + length, size - length, "0, \"d\": [], \"v\": [], \"more\": false }");
+    return(true);
+  }
+  length += flashLogFormat(query, buffer + length, size - length, FLASH_LOG_CHUNK_VALUES);
+
+  // Look ahead so that the last chunk says so.
+  snprintf(buffer + length, size - length, ", \"more\": %s }", (flashLogPeek(query))?"true":"false");
+  return(true);
+}
+
+#endif
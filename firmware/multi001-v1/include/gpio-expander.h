@@ -0,0 +1,231 @@
+/*********************************************************************
+ * NAME
+ *   gpio-expander.h - interrupt driven input bank on I2C expanders.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DEVICES
+ *   MCP23017 (16 inputs)
+ *   PCF8574/PCF8574A (8 inputs)
+ * DESCRIPTION
+ *   Extends the number of SPST contact inputs available to a module
+ *   by hanging one or more GPIO expanders off the existing I2C bus.
+ *
+ *   The interrupt outputs of all expanders are wired together onto a
+ *   single, active-low, GPIO line. MCP23017 devices are configured
+ *   with mirrored, open-drain interrupt outputs so that they can share
+ *   this line with the (always open-drain) PCF8574 interrupt output.
+ *
+ *   The expanders are only read when the shared interrupt line is
+ *   asserted. A read of every device is made in a single I2C
+ *   transaction per device (both ports of an MCP23017 are recovered by
+ *   one sequential read) and this read also clears the device's
+ *   interrupt. Any change then starts a debounce period at the end of
+ *   which the devices are read again and, if the inputs are stable,
+ *   the new state is committed and the bits which changed are
+ *   accumulated in the device's change mask.
+ *
+ *   Each device has an input mask which selects the inputs that are
+ *   of interest: on an MCP23017 the mask is used to enable the
+ *   per-port interrupt-on-change logic and on all devices it filters
+ *   the change mask.
+ */
+
+#ifndef GPIO_EXPANDER_H
+#define GPIO_EXPANDER_H
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#define GPIO_EXPANDER_DEBOUNCE_INTERVAL 20  // Milliseconds inputs must be stable
+
+#define MCP23017_IODIRA 0x00
+#define MCP23017_IOCON 0x0A
+#define MCP23017_GPIOA 0x12
+#define MCP23017_IOCON_MIRROR 0x40
+#define MCP23017_IOCON_ODR 0x04
+
+enum GPIO_EXPANDER_TYPE { GPIO_EXPANDER_MCP23017, GPIO_EXPANDER_PCF8574 };
+
+/**********************************************************************
+ * Structure describing a single expander. The first three members are
+ * user configuration; the remainder is maintained by the driver.
+ */
+struct GPIO_EXPANDER {
+  GPIO_EXPANDER_TYPE type;        // Device type
+  uint8_t address;                // I2C address
+  uint16_t mask;                  // Inputs of interest (port B in high byte)
+  boolean present;                // Device responded during initialisation
+  uint16_t state;                 // Debounced input state
+  uint16_t raw;                   // Most recently read input state
+  uint16_t changed;               // Inputs changed since last collection
+};
+
+GPIO_EXPANDER *gpioExpanderDevices = 0;
+int gpioExpanderCount = 0;
+int gpioExpanderInterruptPin = -1;
+volatile boolean gpioExpanderInterrupt = false;
+boolean gpioExpanderSettling = false;
+unsigned long gpioExpanderSettleStart = 0UL;
+
+void IRAM_ATTR gpioExpanderIsr() {
+  gpioExpanderInterrupt = true;
+}
+
+/**********************************************************************
+ * Write <count> bytes from <data> to consecutive registers starting at
+ * <reg> on the device at <address>.
+ */
+boolean gpioExpanderWrite(uint8_t address, int reg, const uint8_t *data, int count) {
+  Wire.beginTransmission(address);
+  if (reg >= 0) Wire.write((uint8_t) reg);
+  Wire.write(data, count);
+  return(Wire.endTransmission() == 0);
+}
+
+/**********************************************************************
+ * Read all the inputs on <device> in a single transaction, returning
+ * false if the device did not respond.
+ */
+boolean gpioExpanderRead(GPIO_EXPANDER &device) {
+  uint8_t count = (device.type == GPIO_EXPANDER_MCP23017)?2:1;
+
+  if (device.type == GPIO_EXPANDER_MCP23017) {
+    Wire.beginTransmission(device.address);
+    Wire.write((uint8_t) MCP23017_GPIOA);
+    if (Wire.endTransmission(false) != 0) return(false);
+  }
+  if (Wire.requestFrom(device.address, count) != count) return(false);
+  device.raw = Wire.read();
+  if (count == 2) device.raw |= (Wire.read() << 8);
+  return(true);
+}
+
+/**********************************************************************
+ * Configure a device for interrupt driven input on the inputs selected
+ * by its mask. All inputs are pulled-up so that they suit active-low
+ * SPST switches.
+ */
+boolean gpioExpanderConfigure(GPIO_EXPANDER &device) {
+  if (device.type == GPIO_EXPANDER_MCP23017) {
+    // IOCON first, so that the register map is known to be BANK=0.
+    uint8_t iocon = (MCP23017_IOCON_MIRROR | MCP23017_IOCON_ODR);
+    if (!gpioExpanderWrite(device.address, MCP23017_IOCON, &iocon, 1)) return(false);
+    // IODIR, IPOL, GPINTEN, DEFVAL, INTCON, IOCON, GPPU (A/B pairs).
+    uint8_t registers[] = {
+      0xFF, 0xFF,
+      0x00, 0x00,
+      (uint8_t) (device.mask & 0xFF), (uint8_t) (device.mask >> 8),
+      0x00, 0x00,
+      0x00, 0x00,
+      iocon, iocon,
+      0xFF, 0xFF
+    };
+    if (!gpioExpanderWrite(device.address, MCP23017_IODIRA, registers, sizeof(registers))) return(false);
+  } else {
+    // Quasi-bidirectional pins become inputs when written high.
+    uint8_t high = 0xFF;
+    if (!gpioExpanderWrite(device.address, -1, &high, 1)) return(false);
+  }
+  return(true);
+}
+
+/**********************************************************************
+ * Read every present device. Returns true if any input differs from
+ * its previous raw reading.
+ */
+boolean gpioExpanderReadAll() {
+  boolean retval = false;
+  uint16_t previous;
+
+  gpioExpanderInterrupt = false;
+  for (int i = 0; i < gpioExpanderCount; i++) {
+    if (gpioExpanderDevices[i].present) {
+      previous = gpioExpanderDevices[i].raw;
+      if (gpioExpanderRead(gpioExpanderDevices[i])) {
+        if ((gpioExpanderDevices[i].raw ^ previous) & gpioExpanderDevices[i].mask) retval = true;
+      }
+    }
+  }
+  // A device that asserted its interrupt while we were reading the
+  // others will be holding the shared line low without generating a
+  // new falling edge, so pick that up here.
+  if (digitalRead(gpioExpanderInterruptPin) == LOW) gpioExpanderInterrupt = true;
+  return(retval);
+}
+
+/**********************************************************************
+ * Initialise the <count> devices described by <devices> and arm the
+ * shared interrupt on <interruptPin>. Wire must already have been
+ * started. Returns the number of devices that responded.
+ */
+int gpioExpanderBegin(GPIO_EXPANDER *devices, int count, int interruptPin) {
+  int retval = 0;
+
+  gpioExpanderDevices = devices;
+  gpioExpanderCount = count;
+  gpioExpanderInterruptPin = interruptPin;
+
+  for (int i = 0; i < count; i++) {
+    devices[i].present = gpioExpanderConfigure(devices[i]) && gpioExpanderRead(devices[i]);
+    devices[i].state = devices[i].raw;
+    devices[i].changed = 0;
+    if (devices[i].present) retval++;
+  }
+  pinMode(interruptPin, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(interruptPin), gpioExpanderIsr, FALLING);
+  if (digitalRead(interruptPin) == LOW) gpioExpanderInterrupt = true;
+  return(retval);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). I2C traffic is only generated when
+ * the shared interrupt has fired or a debounce period expires. Returns
+ * true when a debounced change is waiting to be collected.
+ */
+boolean gpioExpanderService(unsigned long now) {
+  boolean retval = false;
+
+  if (!gpioExpanderSettling) {
+    if (gpioExpanderInterrupt) {
+      if (gpioExpanderReadAll()) {
+        gpioExpanderSettling = true;
+        gpioExpanderSettleStart = now;
+      }
+    }
+  } else {
+    // Interrupts during the debounce period just extend it: the read at
+    // the end of the period will clear any asserted interrupt.
+    if (gpioExpanderInterrupt) {
+      gpioExpanderInterrupt = false;
+      gpioExpanderSettleStart = now;
+    }
+    if ((now - gpioExpanderSettleStart) >= GPIO_EXPANDER_DEBOUNCE_INTERVAL) {
+      if (gpioExpanderReadAll()) {
+        gpioExpanderSettleStart = now;
+      } else {
+        gpioExpanderSettling = false;
+        for (int i = 0; i < gpioExpanderCount; i++) {
+          GPIO_EXPANDER &device = gpioExpanderDevices[i];
+          uint16_t delta = ((device.raw ^ device.state) & device.mask);
+          if (delta) {
+            device.changed |= delta;
+            device.state = device.raw;
+            retval = true;
+          }
+        }
+      }
+    }
+  }
+  return(retval);
+}
+
+/**********************************************************************
+ * Return the change mask of device <index> and clear it.
+ */
+uint16_t gpioExpanderCollect(int index) {
+  uint16_t retval = gpioExpanderDevices[index].changed;
+  gpioExpanderDevices[index].changed = 0;
+  return(retval);
+}
+
+#endif
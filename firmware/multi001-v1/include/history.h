@@ -0,0 +1,320 @@
+/*********************************************************************
+ * NAME
+ *   history.h - delta-encoded in-RAM history of fixed-point fields.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Keeps a history of selected fields in a fixed RAM budget so that a
+ *   consumer which restarts can recover more than the last retained
+ *   message.
+ *
+ *   Each field is sampled once per step (the last value seen in a step
+ *   is the one stored) and quantised to the field's resolution. Stored
+ *   samples are packed into fixed size blocks: a block header holds
+ *   the step number and value of its first sample and every following
+ *   sample is stored as the zigzag varint encoded difference from its
+ *   predecessor, so a slowly varying field costs about one byte per
+ *   sample. A block ends when it is full or a step is missed (e.g.
+ *   because the sensor failed). HISTORY_RAM_BUDGET bytes of blocks are
+ *   shared equally between the fields, each of which uses its share as
+ *   a ring, dropping its oldest block when it needs a new one.
+ *
+ *   A query names a field and a range of ages and is answered by a
+ *   sequence of chunks produced one at a time by historyNextChunk(), so
+ *   that the caller can pace their publication. Each chunk is a JSON
+ *   object:
+ *
+ *     { "id": i, "field": f, "scale": s, "step": t, "age": a, "v": [...], "more": m }
+ *
+ *   where <i> is the query id, <s> the fixed-point units per field
+ *   unit, <t> the step in seconds, <a> the age in seconds of the first
+ *   value, "v" consecutive fixed-point values one step apart and <m>
+ *   false on the last chunk. A chunk never spans a gap in the history.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifndef HISTORY_RAM_BUDGET
+#define HISTORY_RAM_BUDGET 6144           // Bytes of sample blocks
+#endif
+#define HISTORY_BLOCK_DATA 54             // Bytes of deltas per block
+#define HISTORY_CHUNK_VALUES 32           // Maximum values per chunk
+
+/**********************************************************************
+ * A run of consecutive samples.
+ */
+struct HISTORY_BLOCK {
+  uint32_t firstStep;             // Step number of first sample
+  int32_t firstValue;             // Quantised first sample
+  uint8_t count;                  // Samples in block
+  uint8_t used;                   // Bytes of data used
+  uint8_t data[HISTORY_BLOCK_DATA]; // Zigzag varint deltas
+};
+
+/**********************************************************************
+ * Structure describing a single field. The first four members are user
+ * configuration; the remainder is maintained by the module.
+ */
+struct HISTORY_FIELD {
+  const char *field;              // Name of the field
+  int scale;                      // Fixed-point units per field unit
+  int32_t resolution;             // Fixed-point units per stored unit
+  unsigned long step;             // Milliseconds between samples
+  HISTORY_BLOCK *blocks;          // This field's share of the pool
+  int blockCount;
+  int head;                       // Block being written
+  int used;                       // Blocks holding samples
+  uint32_t currentStep;           // Steps since startup
+  unsigned long stepStart;        // Millis at which current step began
+  boolean pending;                // A sample was seen in this step
+  int32_t pendingValue;
+  int32_t lastValue;              // Last stored (quantised) sample
+};
+
+/**********************************************************************
+ * State of the query being answered.
+ */
+struct HISTORY_QUERY {
+  boolean active;
+  uint32_t id;
+  int field;
+  uint32_t fromStep;              // First step wanted
+  uint32_t toStep;                // Last step wanted
+  int block;                      // Blocks from the oldest
+  int offset;                     // Byte offset in block
+  int index;                      // Sample index in block
+  int32_t value;                  // Value of sample at index
+};
+
+HISTORY_BLOCK historyPool[HISTORY_RAM_BUDGET / sizeof(HISTORY_BLOCK)];
+HISTORY_FIELD *historyTable = 0;
+int historyCount = 0;
+HISTORY_QUERY historyQuery = { false };
+
+/**********************************************************************
+ * Share the block pool between the <count> fields described by
+ * <fields>.
+ */
+void historyBegin(HISTORY_FIELD *fields, int count, unsigned long now) {
+  int share = (count)?((sizeof(historyPool) / sizeof(HISTORY_BLOCK)) / count):0;
+
+  historyTable = fields;
+  historyCount = count;
+  for (int i = 0; i < count; i++) {
+    fields[i].blocks = (historyPool + (i * share));
+    fields[i].blockCount = share;
+    fields[i].head = -1;
+    fields[i].used = 0;
+    fields[i].currentStep = 0;
+    fields[i].stepStart = now;
+    fields[i].pending = false;
+  }
+}
+
+int historyFind(const char *field) {
+  for (int i = 0; i < historyCount; i++) if (strcmp(historyTable[i].field, field) == 0) return(i);
+  return(-1);
+}
+
+/**********************************************************************
+ * Append <value> to <buffer> as a zigzag varint, if it fits in the
+ * <size> bytes available. Returns the number of bytes written (0 if it
+ * does not fit).
+ */
+int historyEncode(uint8_t *buffer, int size, int32_t value) {
+  uint32_t zigzag = (((uint32_t) value << 1) ^ (uint32_t) (value >> 31));
+  int retval = 0;
+
+  do {
+    if (retval == size) return(0);
+    buffer[retval++] = ((zigzag & 0x7F) | ((zigzag > 0x7F)?0x80:0x00));
+    zigzag >>= 7;
+  } while (zigzag);
+  return(retval);
+}
+
+/**********************************************************************
+ * Decode the zigzag varint at <buffer> into <value>. Returns the number
+ * of bytes read.
+ */
+int historyDecode(const uint8_t *buffer, int32_t &value) {
+  uint32_t zigzag = 0;
+  int retval = 0;
+
+  do {
+    zigzag |= ((uint32_t) (buffer[retval] & 0x7F) << (7 * retval));
+  } while (buffer[retval++] & 0x80);
+  value = (int32_t) ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+  return(retval);
+}
+
+HISTORY_BLOCK &historyBlock(HISTORY_FIELD &field, int age) {
+  return(field.blocks[(field.head - field.used + 1 + age + field.blockCount) % field.blockCount]);
+}
+
+/**********************************************************************
+ * Store quantised <value> as the sample for <step> of <field>.
+ */
+void historyStore(HISTORY_FIELD &field, uint32_t step, int32_t value) {
+  int length = 0;
+
+  if (field.head >= 0) {
+    HISTORY_BLOCK &block = field.blocks[field.head];
+    if ((block.count < 255) && (step == (block.firstStep + block.count))) {
+      length = historyEncode(block.data + block.used, (HISTORY_BLOCK_DATA - block.used), (value - field.lastValue));
+      if (length) {
+        block.used += length;
+        block.count++;
+      }
+    }
+  }
+  if (!length) {
+    if (field.used < field.blockCount) {
+      field.used++;
+    } else if ((historyQuery.active) && (&historyTable[historyQuery.field] == &field)) {
+      // The oldest block is dropped: keep the query's place, or restart
+      // it at the new oldest block if that is the one being read.
+      if (historyQuery.block > 0) historyQuery.block--; else historyQuery.index = -1;
+    }
+    field.head = ((field.head + 1) % field.blockCount);
+    HISTORY_BLOCK &block = field.blocks[field.head];
+    block.firstStep = step;
+    block.firstValue = value;
+    block.count = 1;
+    block.used = 0;
+  }
+  field.lastValue = value;
+}
+
+/**********************************************************************
+ * Offer a fixed-point <value> of <field> as the sample for the current
+ * step. Returns false if the field has no history.
+ */
+boolean historySample(const char *field, int32_t value) {
+  int index = historyFind(field);
+
+  if (index < 0) return(false);
+  historyTable[index].pending = true;
+  historyTable[index].pendingValue = value;
+  return(true);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). Stores the sample of each field
+ * whose step has ended.
+ */
+void historyService(unsigned long now) {
+  for (int i = 0; i < historyCount; i++) {
+    HISTORY_FIELD &field = historyTable[i];
+    while ((field.blockCount) && ((now - field.stepStart) >= field.step)) {
+      if (field.pending) {
+        int32_t half = (field.resolution / 2);
+        int32_t value = field.pendingValue;
+        historyStore(field, field.currentStep, ((value >= 0)?(value + half):(value - half)) / field.resolution);
+        field.pending = false;
+      }
+      field.currentStep++;
+      field.stepStart += field.step;
+    }
+  }
+}
+
+/**********************************************************************
+ * Start answering the query in <payload>, a JSON object of the form
+ * { "id": i, "field": f, "from": a, "to": b } where <a> and <b> are
+ * ages in seconds (both optional; the default is everything). Any
+ * query in progress is abandoned. Returns false if the query is
+ * invalid.
+ */
+boolean historyRequest(const char *payload, unsigned int length) {
+  StaticJsonDocument<160> request;
+  uint32_t from, to, stepSeconds;
+  int index;
+
+  historyQuery.active = false;
+  if (deserializeJson(request, payload, length)) return(false);
+  if ((index = historyFind(request["field"] | "")) < 0) return(false);
+
+  HISTORY_FIELD &field = historyTable[index];
+  stepSeconds = max(1UL, (field.step / 1000));
+  from = (request["from"] | 0xFFFFFFFFUL) / stepSeconds;
+  to = (request["to"] | 0UL) / stepSeconds;
+  historyQuery.id = (request["id"] | 0UL);
+  historyQuery.field = index;
+  historyQuery.fromStep = (from >= field.currentStep)?0:(field.currentStep - from);
+  historyQuery.toStep = (to >= field.currentStep)?0:(field.currentStep - to);
+  historyQuery.block = 0;
+  historyQuery.index = -1;
+  historyQuery.active = true;
+  return(true);
+}
+
+/**********************************************************************
+ * Write the next chunk of the reply to the current query into the
+ * <size> bytes at <buffer>. Returns false if there is nothing to send.
+ */
+boolean historyNextChunk(char *buffer, size_t size) {
+  HISTORY_QUERY &query = historyQuery;
+  int values = 0;
+  size_t length;
+
+  if (!query.active) return(false);
+  HISTORY_FIELD &field = historyTable[query.field];
+
+  // Find the next sample in range, skipping whole blocks where possible.
+  while (query.block < field.used) {
+    HISTORY_BLOCK &block = historyBlock(field, query.block);
+    if (query.index < 0) {
+      if ((block.firstStep + block.count) <= query.fromStep) { query.block++; continue; }
+      query.index = 0;
+      query.offset = 0;
+      query.value = block.firstValue;
+    }
+    if ((query.index < block.count) && ((block.firstStep + query.index) < query.fromStep)) {
+      int32_t delta;
+      query.offset += historyDecode(block.data + query.offset, delta);
+      query.value += delta;
+      query.index++;
+      continue;
+    }
+    if ((query.index == block.count) || ((block.firstStep + query.index) > query.toStep)) {
+      query.block = ((block.firstStep + query.index) > query.toStep)?field.used:(query.block + 1);
+      query.index = -1;
+      continue;
+    }
+    break;
+  }
+
+  length = snprintf(buffer, size, "{ \"id\": %lu, \"field\": \"%s\", \"scale\": %d, \"step\": %lu, \"age\": ", (unsigned long) query.id, field.field, field.scale, (field.step / 1000));
+  if (query.block >= field.used) {
+    // Nothing (more) in range.
+    query.active = false;
+    snprintf(buffer + length, size - length, "0, \"v\": [], \"more\": false }");
+    return(true);
+  }
+
+  HISTORY_BLOCK &block = historyBlock(field, query.block);
+  length += snprintf(buffer + length, size - length, "%lu, \"v\": [", (unsigned long) (((field.currentStep - (block.firstStep + query.index)) * field.step) / 1000));
+  while ((values < HISTORY_CHUNK_VALUES) && (length < (size - 40)) && (query.index < block.count) && ((block.firstStep + query.index) <= query.toStep)) {
+    length += snprintf(buffer + length, size - length, "%s%ld", (values++)?",":"", (long) (query.value * field.resolution));
+    if (++query.index < block.count) {
+      int32_t delta;
+      query.offset += historyDecode(block.data + query.offset, delta);
+      query.value += delta;
+    }
+  }
+  if ((query.index == block.count) || ((block.firstStep + query.index) > query.toStep)) {
+    query.block = ((block.firstStep + query.index) > query.toStep)?field.used:(query.block + 1);
+    query.index = -1;
+  }
+  // Look ahead so that the last chunk says so.
+  if ((query.block >= field.used) || ((query.index < 0) && (historyBlock(field, query.block).firstStep > query.toStep))) query.active = false;
+  snprintf(buffer + length, size - length, "], \"more\": %s }", (query.active)?"true":"false");
+  return(true);
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*********************************************************************
+ * NAME
+ *   i2c-bus.h - I2C bus discovery and raw transfer helpers.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Scans the I2C bus once at boot and records which addresses
+ *   acknowledge, so that sensor drivers can decide whether their device
+ *   is fitted without each probing the bus themselves.
+ *
+ *   The scan result is cached in RTC memory (see rtc-store.h). On a
+ *   warm boot (a software restart, watchdog reset, exception or wake
+ *   from deep sleep) the cached result is used and the scan is skipped.
+ *   A power-on or a press of the reset button always scans, so that
+ *   newly fitted devices are found.
+ *
+ *   Also provides the register and command transfers used by the raw
+ *   sensor drivers and the CRC-8 used by Sensirion devices.
+ */
+
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "rtc-store.h"
+
+#define I2C_BUS_FIRST_ADDRESS 0x08
+#define I2C_BUS_LAST_ADDRESS 0x77
+
+struct I2C_BUS_RTC_RECORD {
+  uint32_t present[4];            // Bitmap of acknowledging addresses
+};
+
+I2C_BUS_RTC_RECORD i2cBusScanResult;
+
+/**********************************************************************
+ * Return true if the last reset left RTC memory (and so the cached
+ * scan) describing the hardware as it is now.
+ */
+boolean i2cBusWarmBoot() {
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  return((reason != REASON_DEFAULT_RST) && (reason != REASON_EXT_SYS_RST));
+}
+
+/**********************************************************************
+ * Find the devices on the bus, using the cached scan on a warm boot.
+ * Returns true if the cached scan was used.
+ */
+boolean i2cBusScan() {
+  if ((i2cBusWarmBoot()) && (rtcStoreRead(RTC_STORE_I2C_BUS_BLOCK, &i2cBusScanResult, sizeof(i2cBusScanResult)))) return(true);
+
+  memset(&i2cBusScanResult, 0, sizeof(i2cBusScanResult));
+  for (uint8_t address = I2C_BUS_FIRST_ADDRESS; address <= I2C_BUS_LAST_ADDRESS; address++) {
+    Wire.beginTransmission(address);
+    if (Wire.endTransmission() == 0) i2cBusScanResult.present[address >> 5] |= (1UL << (address & 0x1F));
+  }
+  rtcStoreWrite(RTC_STORE_I2C_BUS_BLOCK, &i2cBusScanResult, sizeof(i2cBusScanResult));
+  return(false);
+}
+
+boolean i2cBusPresent(uint8_t address) {
+  return((i2cBusScanResult.present[(address >> 5) & 0x03] & (1UL << (address & 0x1F))) != 0);
+}
+
+/**********************************************************************
+ * Write the <size> bytes at <data> to the device at <address>.
+ */
+boolean i2cBusWrite(uint8_t address, const uint8_t *data, size_t size) {
+  Wire.beginTransmission(address);
+  Wire.write(data, size);
+  return(Wire.endTransmission() == 0);
+}
+
+/**********************************************************************
+ * Send the 16-bit <command> to the device at <address> (Sensirion
+ * style, most significant byte first).
+ */
+boolean i2cBusCommand(uint8_t address, uint16_t command) {
+  uint8_t data[2] = { (uint8_t) (command >> 8), (uint8_t) command };
+  return(i2cBusWrite(address, data, sizeof(data)));
+}
+
+/**********************************************************************
+ * Read <size> bytes from the device at <address> into <data>.
+ */
+boolean i2cBusRead(uint8_t address, uint8_t *data, size_t size) {
+  if (Wire.requestFrom(address, (uint8_t) size) != size) return(false);
+  for (size_t i = 0; i < size; i++) data[i] = Wire.read();
+  return(true);
+}
+
+/**********************************************************************
+ * Read <size> bytes starting at register <reg> of the device at
+ * <address> into <data>.
+ */
+boolean i2cBusReadRegisters(uint8_t address, uint8_t reg, uint8_t *data, size_t size) {
+  if (!i2cBusWrite(address, &reg, 1)) return(false);
+  return(i2cBusRead(address, data, size));
+}
+
+boolean i2cBusWriteRegister(uint8_t address, uint8_t reg, uint8_t value) {
+  uint8_t data[2] = { reg, value };
+  return(i2cBusWrite(address, data, sizeof(data)));
+}
+
+/**********************************************************************
+ * Sensirion CRC-8 (polynomial 0x31, initial value 0xFF) of the two
+ * bytes at <data>.
+ */
+uint8_t i2cBusSensirionCrc(const uint8_t *data) {
+  uint8_t crc = 0xFF;
+
+  for (int i = 0; i < 2; i++) {
+    crc ^= data[i];
+    for (int b = 0; b < 8; b++) crc = (crc & 0x80)?((crc << 1) ^ 0x31):(crc << 1);
+  }
+  return(crc);
+}
+
+/**********************************************************************
+ * Return the big-endian word at <data> into <word> if the CRC byte
+ * that follows it is correct.
+ */
+boolean i2cBusSensirionWord(const uint8_t *data, uint16_t &word) {
+  if (i2cBusSensirionCrc(data) != data[2]) return(false);
+  word = ((uint16_t) data[0] << 8) | data[1];
+  return(true);
+}
+
+#endif
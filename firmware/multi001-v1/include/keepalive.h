@@ -0,0 +1,129 @@
+/*********************************************************************
+ * NAME
+ *   keepalive.h - learn the longest idle interval the broker path allows.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   A connection which carries nothing for long enough may be dropped
+ *   silently by a NAT or firewall on the way to the broker, so an idle
+ *   client must ping. Pinging more often than the path needs wastes
+ *   radio wake-ups and broker work, and how often it needs varies from
+ *   site to site. This module learns the interval.
+ *
+ *   The MQTT client pings only after the connection has been idle (sent
+ *   nothing) for the interval this module gives it, so telemetry which
+ *   flows more often than that suppresses pings altogether. Anything
+ *   sent on a timer of its own would cut every idle period short and
+ *   stop the interval being learned, which is why the round trip probes
+ *   of publish-rate.h are only sent with telemetry. The outcome of each
+ *   ping, and the idle time before it, is passed back with
+ *   keepaliveResult(). A ping answered after idling for the probe
+ *   interval shows that the path tolerates it: it becomes the learned
+ *   interval and the next probe is half as long again. A ping which is
+ *   not answered shows that the path does not: the idle time becomes
+ *   the ceiling, which later probes approach by halving the gap, and if
+ *   even the learned interval failed that is halved. Probing stops once
+ *   the gap to the ceiling is within KEEPALIVE_RESOLUTION.
+ *
+ *   The learned interval and the ceiling are kept in a KEEPALIVE_RECORD
+ *   which the caller should save whenever keepaliveChanged() says so
+ *   and pass back to keepaliveBegin() after a restart.
+ */
+
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+#include <Arduino.h>
+
+#define KEEPALIVE_MAGIC 0x4B41            // "KA"
+#define KEEPALIVE_RESOLUTION 15           // Seconds
+
+/**********************************************************************
+ * What has been learned, as saved.
+ */
+struct KEEPALIVE_RECORD {
+  uint16_t magic;
+  uint16_t interval;              // Seconds known to be tolerated
+  uint16_t ceiling;               // Seconds known not to be, or 0
+};
+
+/**********************************************************************
+ * State of the module. The first two members are user configuration;
+ * the remainder is maintained by the module.
+ */
+struct KEEPALIVE {
+  uint16_t minimum;               // Seconds
+  uint16_t maximum;               // Seconds
+  KEEPALIVE_RECORD learned;
+  uint16_t probe;                 // Seconds, or 0 if not probing
+  boolean changed;                // Learned values not yet saved
+};
+
+KEEPALIVE keepalive = { 15, 900 };
+
+/**********************************************************************
+ * Choose the next interval to try, if any is worth trying.
+ */
+void keepaliveNextProbe() {
+  KEEPALIVE_RECORD &learned = keepalive.learned;
+  uint16_t limit = (learned.ceiling)?learned.ceiling:(keepalive.maximum + KEEPALIVE_RESOLUTION);
+  uint16_t probe = min((uint16_t) ((learned.interval * 3) / 2), keepalive.maximum);
+
+  if (probe >= limit) probe = ((learned.interval + limit) / 2);
+  keepalive.probe = ((probe > learned.interval) && ((limit - learned.interval) > KEEPALIVE_RESOLUTION))?probe:0;
+}
+
+/**********************************************************************
+ * Start from <saved>, as last saved (it is ignored if not valid), with
+ * intervals confined to <minimum>..<maximum> seconds.
+ */
+void keepaliveBegin(uint16_t minimum, uint16_t maximum, const KEEPALIVE_RECORD &saved) {
+  keepalive.minimum = minimum;
+  keepalive.maximum = maximum;
+  keepalive.learned = { KEEPALIVE_MAGIC, minimum, 0 };
+  if ((saved.magic == KEEPALIVE_MAGIC) && (saved.interval >= minimum) && (saved.interval <= maximum)) {
+    keepalive.learned.interval = saved.interval;
+    keepalive.learned.ceiling = (saved.ceiling > saved.interval)?saved.ceiling:0;
+  }
+  keepalive.changed = false;
+  keepaliveNextProbe();
+}
+
+/**********************************************************************
+ * Returns the idle time in seconds after which to ping.
+ */
+uint16_t keepaliveInterval() {
+  return((keepalive.probe)?keepalive.probe:keepalive.learned.interval);
+}
+
+/**********************************************************************
+ * Report whether a ping sent after the connection had been <idle>
+ * seconds was <answered>.
+ */
+void keepaliveResult(unsigned long idle, boolean answered) {
+  KEEPALIVE_RECORD &learned = keepalive.learned;
+
+  if (answered) {
+    if (idle <= learned.interval) return;
+    learned.interval = min(idle, (unsigned long) keepalive.maximum);
+    if (learned.ceiling <= learned.interval) learned.ceiling = 0;
+  } else {
+    if ((learned.ceiling) && (idle >= learned.ceiling)) return;
+    learned.ceiling = max(idle, (unsigned long) keepalive.minimum);
+    if (learned.interval >= learned.ceiling) learned.interval = max((uint16_t) (learned.ceiling / 2), keepalive.minimum);
+  }
+  keepalive.changed = true;
+  keepaliveNextProbe();
+}
+
+/**********************************************************************
+ * Returns true, once, after the learned values change.
+ */
+boolean keepaliveChanged() {
+  boolean retval = keepalive.changed;
+
+  keepalive.changed = false;
+  return(retval);
+}
+
+#endif
@@ -0,0 +1,657 @@
+/*********************************************************************
+ * NAME
+ *   mqtt-async.h - event-driven MQTT 5 client on ESPAsyncTCP.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   A minimal MQTT client which never blocks the caller. Connection,
+ *   publication and subscription only build packets in an outgoing
+ *   queue, which is handed to the TCP stack as it makes room, and
+ *   everything the broker sends is handled from the TCP stack's
+ *   callbacks as it arrives. A stalled connection therefore fills the
+ *   queue, after which publications fail at once, rather than freezing
+ *   loop().
+ *
+ *   The client speaks MQTT 5, falling back to 3.1.1 until restarted
+ *   if the broker rejects the protocol version. Under MQTT 5,
+ *   if the broker allows topic aliases (its Topic Alias Maximum in
+ *   CONNACK), up to MQTT_ASYNC_ALIASES topics are given one: the first
+ *   publication to a topic carries the topic and its alias and later
+ *   ones carry only the two byte alias, the least recently used alias
+ *   being reassigned when all are taken. Aliases last for the
+ *   connection. A publication may also be given an expiry interval,
+ *   after which the broker discards it rather than deliver it late.
+ *   The broker's Server Keep Alive, if it sends one, overrides ours.
+ *
+ *   Publications are at QoS 0. A publication is complete when the
+ *   broker's TCP stack has acknowledged its last byte, and the sent
+ *   callback is then called with its token and the time it took; if the
+ *   connection is lost first, the callback reports failure.
+ *   Subscriptions are at QoS 0. Incoming messages at QoS 1 are
+ *   acknowledged.
+ *
+ *   Packets are not written the moment they are queued. Those queued
+ *   within the coalescing window of the first (or until
+ *   MQTT_ASYNC_COALESCE_BYTES have gathered) are handed to TCP in one
+ *   write, so that a burst of publications can share TCP segments and
+ *   acknowledgements rather than taking one each. Control packets
+ *   (PUBACK, SUBSCRIBE and PINGREQ) are written at once, taking
+ *   anything queued with them. Nagle's algorithm is turned off on the
+ *   connection, as it would only hold back a write which has already
+ *   been coalesced.
+ *   The packets and writes members count MQTT packets queued and TCP
+ *   writes made. How many segments and radio frames the writes become
+ *   is up to the TCP stack and is not measured.
+ *
+ *   The keepalive requested at connection (MQTT_ASYNC_KEEPALIVE unless
+ *   set by mqttAsyncKeepalive()) is the longest the broker will wait to
+ *   hear from us; a PINGREQ is sent only once nothing has been sent for
+ *   the ping interval (by default the keepalive), so regular traffic
+ *   suppresses pings. The ping callback is told how long the
+ *   connection had been idle before each ping and whether the broker
+ *   answered it within MQTT_ASYNC_PING_TIMEOUT; a connection whose
+ *   ping goes unanswered is dropped.
+ *
+ *   On ESP8266 the TCP callbacks run in the system context, between
+ *   passes of loop() or inside yield() and delay(), rather than
+ *   interrupting loop() code, so the callbacks may share state with it
+ *   freely. mqttAsyncService() need only be called for keepalive and
+ *   connection timeouts.
+ */
+
+#ifndef MQTT_ASYNC_H
+#define MQTT_ASYNC_H
+
+#include <Arduino.h>
+#include <ESPAsyncTCP.h>
+
+#define MQTT_ASYNC_QUEUE_SIZE 4096        // Bytes of outgoing packets (holds the largest)
+#define MQTT_ASYNC_RECEIVE_SIZE 512       // Bytes in largest incoming packet
+#define MQTT_ASYNC_TRACKED 16             // Publications awaiting completion
+#define MQTT_ASYNC_KEEPALIVE 15           // Seconds
+#define MQTT_ASYNC_PING_TIMEOUT 10000UL   // Milliseconds
+#define MQTT_ASYNC_CONNECT_TIMEOUT 10000UL // Milliseconds
+#define MQTT_ASYNC_COALESCE_BYTES 536     // Bytes which are written at once
+#define MQTT_ASYNC_ALIASES 8              // Topics given an alias
+#define MQTT_ASYNC_ALIAS_TOPIC 96         // Bytes in longest aliased topic
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_PROPERTY_EXPIRY 0x02
+#define MQTT_PROPERTY_SERVER_KEEPALIVE 0x13
+#define MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM 0x22
+#define MQTT_PROPERTY_TOPIC_ALIAS 0x23
+
+enum MQTT_ASYNC_STATE { MQTT_ASYNC_DISCONNECTED, MQTT_ASYNC_CONNECTING, MQTT_ASYNC_HANDSHAKE, MQTT_ASYNC_CONNECTED };
+
+typedef void (*MQTT_ASYNC_MESSAGE_CALLBACK)(char *topic, byte *payload, unsigned int length);
+typedef void (*MQTT_ASYNC_SENT_CALLBACK)(uint16_t token, boolean ok, unsigned long latency);
+typedef void (*MQTT_ASYNC_PING_CALLBACK)(unsigned long idle, boolean answered);
+
+/**********************************************************************
+ * A topic with an alias, which is its index plus one.
+ */
+struct MQTT_ASYNC_ALIAS {
+  char topic[MQTT_ASYNC_ALIAS_TOPIC]; // Empty if unassigned
+  uint32_t used;                  // Publication count when last used
+};
+
+/**********************************************************************
+ * A publication awaiting completion.
+ */
+struct MQTT_ASYNC_TRACK {
+  uint32_t end;                   // Stream offset of its last byte
+  uint16_t token;
+  unsigned long queued;           // Micros
+};
+
+struct MQTT_ASYNC {
+  const char *host;
+  uint16_t port;
+  MQTT_ASYNC_MESSAGE_CALLBACK onMessage;
+  MQTT_ASYNC_SENT_CALLBACK onSent;
+  MQTT_ASYNC_PING_CALLBACK onPing;
+  unsigned long coalesceWindow;   // Milliseconds
+  uint16_t keepalive;             // Seconds, as requested
+  uint16_t pingInterval;          // Seconds idle before a ping, or 0
+  AsyncClient tcp;
+  MQTT_ASYNC_STATE state;
+  unsigned long stateChanged;     // Millis
+  uint8_t version;                // Protocol level: 5, or 4 for 3.1.1
+  uint16_t grantedKeepalive;      // Seconds, as the broker has it
+  int aliasCount;                 // Aliases the broker allows us
+  MQTT_ASYNC_ALIAS aliases[MQTT_ASYNC_ALIASES];
+  uint32_t publications;
+  uint8_t queue[MQTT_ASYNC_QUEUE_SIZE];
+  size_t queueHead;               // First byte not yet given to TCP
+  size_t queueLength;
+  unsigned long waitingSince;     // Millis at which oldest packet was queued
+  uint32_t queued;                // Bytes queued since connecting
+  uint32_t acked;                 // Bytes acknowledged since connecting
+  MQTT_ASYNC_TRACK tracks[MQTT_ASYNC_TRACKED];
+  int trackCount;
+  uint16_t nextToken;
+  uint8_t rx[MQTT_ASYNC_RECEIVE_SIZE];
+  size_t rxLength;
+  size_t rxSkip;                  // Bytes of an oversize packet to discard
+  unsigned long lastSent;         // Millis
+  boolean pinging;
+  unsigned long pingSent;         // Millis
+  unsigned long pingIdle;         // Milliseconds idle before the ping
+  uint32_t packets;               // MQTT packets queued
+  uint32_t writes;                // TCP writes made
+};
+
+MQTT_ASYNC mqttAsync;
+
+boolean mqttAsyncConnected() {
+  return(mqttAsync.state == MQTT_ASYNC_CONNECTED);
+}
+
+MQTT_ASYNC_STATE mqttAsyncState() {
+  return(mqttAsync.state);
+}
+
+/**********************************************************************
+ * Hand as much of the outgoing queue to TCP as it will take.
+ */
+void mqttAsyncFlush() {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  size_t given = 0;
+
+  if (mqtt.state < MQTT_ASYNC_HANDSHAKE) return;
+  while ((mqtt.queueLength) && (mqtt.tcp.space())) {
+    size_t length = min(mqtt.queueLength, (MQTT_ASYNC_QUEUE_SIZE - mqtt.queueHead));
+    size_t added = mqtt.tcp.add((const char *) (mqtt.queue + mqtt.queueHead), min(length, mqtt.tcp.space()), ASYNC_WRITE_FLAG_COPY);
+    if (added == 0) break;
+    mqtt.queueHead = ((mqtt.queueHead + added) % MQTT_ASYNC_QUEUE_SIZE);
+    mqtt.queueLength -= added;
+    given += added;
+  }
+  if ((given) && (mqtt.tcp.send())) {
+    mqtt.lastSent = millis();
+    mqtt.writes++;
+  }
+}
+
+/**********************************************************************
+ * Hand the outgoing queue to TCP if its oldest packet has waited out
+ * the coalescing window or enough has gathered to fill a segment.
+ */
+void mqttAsyncCoalesce(unsigned long now) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+
+  if ((mqtt.queueLength) && ((mqtt.queueLength >= MQTT_ASYNC_COALESCE_BYTES) || ((now - mqtt.waitingSince) >= mqtt.coalesceWindow))) mqttAsyncFlush();
+}
+
+/**********************************************************************
+ * Append <length> bytes at <data> to the outgoing queue, which the
+ * caller has checked has room.
+ */
+void mqttAsyncQueue(const uint8_t *data, size_t length) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+
+  while (length--) {
+    mqtt.queue[(mqtt.queueHead + mqtt.queueLength++) % MQTT_ASYNC_QUEUE_SIZE] = *data++;
+    mqtt.queued++;
+  }
+}
+
+void mqttAsyncQueueString(const char *string) {
+  uint16_t length = strlen(string);
+  uint8_t prefix[2] = { (uint8_t) (length >> 8), (uint8_t) length };
+
+  mqttAsyncQueue(prefix, 2);
+  mqttAsyncQueue((const uint8_t *) string, length);
+}
+
+void mqttAsyncQueueInteger(uint32_t value, int bytes) {
+  while (bytes--) {
+    uint8_t byte = (value >> (8 * bytes));
+    mqttAsyncQueue(&byte, 1);
+  }
+}
+
+size_t mqttAsyncPacketSize(size_t remaining) {
+  return(1 + ((remaining < 128)?1:((remaining < 16384)?2:3)) + remaining);
+}
+
+/**********************************************************************
+ * Queue the fixed header of a packet of <type> with <remaining> bytes
+ * following, if the whole packet will fit. Returns false if it will
+ * not.
+ */
+boolean mqttAsyncQueueHeader(uint8_t type, size_t remaining) {
+  uint8_t header[5] = { type };
+  size_t length = 1;
+
+  if (mqttAsyncPacketSize(remaining) > (MQTT_ASYNC_QUEUE_SIZE - mqttAsync.queueLength)) return(false);
+  if (!mqttAsync.queueLength) mqttAsync.waitingSince = millis();
+  mqttAsync.packets++;
+  do {
+    header[length] = (remaining & 0x7F);
+    remaining >>= 7;
+    if (remaining) header[length] |= 0x80;
+    length++;
+  } while (remaining);
+  mqttAsyncQueue(header, length);
+  return(true);
+}
+
+/**********************************************************************
+ * Fail every publication still awaiting completion and reset the
+ * connection state.
+ */
+void mqttAsyncDropped() {
+  MQTT_ASYNC &mqtt = mqttAsync;
+
+  mqtt.state = MQTT_ASYNC_DISCONNECTED;
+  mqtt.stateChanged = millis();
+  for (int i = 0; i < mqtt.trackCount; i++) {
+    if (mqtt.onSent) mqtt.onSent(mqtt.tracks[i].token, false, (micros() - mqtt.tracks[i].queued));
+  }
+  mqtt.trackCount = 0;
+  mqtt.queueLength = 0;
+  if (mqtt.pinging) {
+    mqtt.pinging = false;
+    if (mqtt.onPing) mqtt.onPing((mqtt.pingIdle / 1000), false);
+  }
+}
+
+/**********************************************************************
+ * Complete every publication whose last byte has been acknowledged.
+ */
+void mqttAsyncAcked(size_t length) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  int completed = 0;
+
+  mqtt.acked += length;
+  while ((completed < mqtt.trackCount) && ((int32_t) (mqtt.acked - mqtt.tracks[completed].end) >= 0)) {
+    if (mqtt.onSent) mqtt.onSent(mqtt.tracks[completed].token, true, (micros() - mqtt.tracks[completed].queued));
+    completed++;
+  }
+  if (completed) {
+    mqtt.trackCount -= completed;
+    memmove(mqtt.tracks, mqtt.tracks + completed, (mqtt.trackCount * sizeof(MQTT_ASYNC_TRACK)));
+  }
+  mqttAsyncCoalesce(millis());
+}
+
+/**********************************************************************
+ * Decode the variable byte integer at <data>, of which <size> bytes are
+ * available, into <value>. Returns the number of bytes read, or 0 if
+ * it is malformed.
+ */
+size_t mqttAsyncDecodeLength(const uint8_t *data, size_t size, uint32_t &value) {
+  value = 0;
+  for (size_t i = 0; (i < size) && (i < 4); i++) {
+    value |= ((uint32_t) (data[i] & 0x7F) << (7 * i));
+    if (!(data[i] & 0x80)) return(i + 1);
+  }
+  return(0);
+}
+
+/**********************************************************************
+ * Take what we need from the CONNACK properties at <data> (<size>
+ * bytes, starting with the property length).
+ */
+void mqttAsyncProperties(const uint8_t *data, size_t size) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  uint32_t length;
+  size_t offset = mqttAsyncDecodeLength(data, size, length);
+
+  if ((!offset) || ((offset + length) > size)) return;
+  size = (offset + length);
+  while (offset < size) {
+    uint8_t id = data[offset++];
+    size_t field;
+    switch (id) {
+      case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        field = 1;
+        break;
+      case MQTT_PROPERTY_SERVER_KEEPALIVE: case 0x21: case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM: case MQTT_PROPERTY_TOPIC_ALIAS:
+        field = 2;
+        break;
+      case MQTT_PROPERTY_EXPIRY: case 0x11: case 0x18: case 0x27:
+        field = 4;
+        break;
+      case 0x0B: {
+        uint32_t value;
+        field = mqttAsyncDecodeLength(data + offset, (size - offset), value);
+        break;
+      }
+      case 0x26:
+        // A string pair is two strings.
+        if ((offset + 2) > size) return;
+        field = (2 + ((data[offset] << 8) | data[offset + 1]));
+        if ((offset + field + 2) > size) return;
+        field += (2 + ((data[offset + field] << 8) | data[offset + field + 1]));
+        break;
+      default:
+        // Strings and binary data.
+        if ((offset + 2) > size) return;
+        field = (2 + ((data[offset] << 8) | data[offset + 1]));
+        break;
+    }
+    if ((!field) || ((offset + field) > size)) return;
+    if (id == MQTT_PROPERTY_SERVER_KEEPALIVE) mqtt.grantedKeepalive = ((data[offset] << 8) | data[offset + 1]);
+    if (id == MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM) mqtt.aliasCount = min((int) ((data[offset] << 8) | data[offset + 1]), MQTT_ASYNC_ALIASES);
+    offset += field;
+  }
+}
+
+/**********************************************************************
+ * Handle the complete packet in the receive buffer, whose fixed header
+ * is <header> bytes long.
+ */
+void mqttAsyncHandle(size_t header) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  uint8_t *packet = mqtt.rx;
+  size_t length = (mqtt.rxLength - header);
+  uint8_t *body = (packet + header);
+
+  switch (packet[0] & 0xF0) {
+    case MQTT_CONNACK:
+      if ((mqtt.state == MQTT_ASYNC_HANDSHAKE) && (length >= 2) && (body[1] == 0)) {
+        if (mqtt.version == 5) mqttAsyncProperties(body + 2, (length - 2));
+        mqtt.state = MQTT_ASYNC_CONNECTED;
+        mqtt.stateChanged = millis();
+      } else {
+        // A 3.1.1 broker answers an MQTT 5 CONNECT with return code 1.
+        if ((length >= 2) && ((body[1] == 0x01) || (body[1] == 0x84))) mqtt.version = 4;
+        mqtt.tcp.close(true);
+      }
+      break;
+    case MQTT_PUBLISH:
+      if (length >= 2) {
+        uint8_t qos = ((packet[0] >> 1) & 0x03);
+        size_t topicLength = ((body[0] << 8) | body[1]);
+        size_t offset = (2 + topicLength + ((qos)?2:0));
+        if ((mqtt.version == 5) && (offset < length)) {
+          uint32_t properties;
+          size_t size = mqttAsyncDecodeLength(body + offset, (length - offset), properties);
+          if (!size) break;
+          offset += (size + properties);
+        }
+        if (offset > length) break;
+        if ((qos == 1) && (mqttAsyncQueueHeader(MQTT_PUBACK, 2))) {
+          mqttAsyncQueue(body + 2 + topicLength, 2);
+          mqttAsyncFlush();
+        }
+        // Shift the topic over its length to make room for a terminator.
+        memmove(body, body + 2, topicLength);
+        body[topicLength] = 0;
+        if (mqtt.onMessage) mqtt.onMessage((char *) body, (body + offset), (length - offset));
+      }
+      break;
+    case MQTT_PINGRESP:
+      if (mqtt.pinging) {
+        mqtt.pinging = false;
+        if (mqtt.onPing) mqtt.onPing((mqtt.pingIdle / 1000), true);
+      }
+      break;
+    case MQTT_DISCONNECT:
+      mqtt.tcp.close(true);
+      break;
+    default:
+      break;
+  }
+}
+
+/**********************************************************************
+ * Accumulate <length> bytes at <data> from the broker into packets and
+ * handle each as it is completed.
+ */
+void mqttAsyncReceive(const uint8_t *data, size_t length) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+
+  while (length) {
+    if (mqtt.rxSkip) {
+      size_t skipped = min(mqtt.rxSkip, length);
+      mqtt.rxSkip -= skipped;
+      data += skipped;
+      length -= skipped;
+      continue;
+    }
+
+    // Read the fixed header a byte at a time and the rest in bulk.
+    size_t header = 0, remaining = 0;
+    for (size_t i = 1; (i < mqtt.rxLength) && (i < 5); i++) {
+      remaining |= ((size_t) (mqtt.rx[i] & 0x7F) << (7 * (i - 1)));
+      if (!(mqtt.rx[i] & 0x80)) { header = (i + 1); break; }
+    }
+    if (!header) {
+      mqtt.rx[mqtt.rxLength++] = *data++;
+      length--;
+      if ((mqtt.rxLength == 2) && (mqtt.rx[1] == 0)) {
+        // A packet with no body is complete with its header.
+        mqttAsyncHandle(2);
+        mqtt.rxLength = 0;
+      } else if (mqtt.rxLength == 5) {
+        mqtt.tcp.close(true);
+        mqtt.rxLength = 0;
+        return;
+      }
+      continue;
+    }
+    if ((header + remaining) > MQTT_ASYNC_RECEIVE_SIZE) {
+      mqtt.rxSkip = ((header + remaining) - mqtt.rxLength);
+      mqtt.rxLength = 0;
+      continue;
+    }
+    size_t wanted = min(((header + remaining) - mqtt.rxLength), length);
+    memcpy(mqtt.rx + mqtt.rxLength, data, wanted);
+    mqtt.rxLength += wanted;
+    data += wanted;
+    length -= wanted;
+    if (mqtt.rxLength == (header + remaining)) {
+      mqttAsyncHandle(header);
+      mqtt.rxLength = 0;
+    }
+  }
+}
+
+/**********************************************************************
+ * Set the broker at <host>:<port>, the callback for incoming messages
+ * and the window in milliseconds within which publications are
+ * coalesced (0 writes each at once) and install the TCP callbacks.
+ */
+void mqttAsyncBegin(const char *host, uint16_t port, MQTT_ASYNC_MESSAGE_CALLBACK onMessage, unsigned long coalesceWindow) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+
+  mqtt.host = host;
+  mqtt.port = port;
+  mqtt.onMessage = onMessage;
+  mqtt.coalesceWindow = coalesceWindow;
+  mqtt.state = MQTT_ASYNC_DISCONNECTED;
+  mqtt.version = 5;
+  mqtt.keepalive = MQTT_ASYNC_KEEPALIVE;
+  mqtt.tcp.onConnect([](void *arg, AsyncClient *client) {
+    client->setNoDelay(true);
+    mqttAsync.state = MQTT_ASYNC_HANDSHAKE;
+    mqttAsyncFlush();
+  });
+  mqtt.tcp.onDisconnect([](void *arg, AsyncClient *client) { mqttAsyncDropped(); });
+  mqtt.tcp.onAck([](void *arg, AsyncClient *client, size_t length, uint32_t time) { mqttAsyncAcked(length); });
+  mqtt.tcp.onData([](void *arg, AsyncClient *client, void *data, size_t length) { mqttAsyncReceive((const uint8_t *) data, length); });
+  mqtt.tcp.onTimeout([](void *arg, AsyncClient *client, uint32_t time) { client->close(true); });
+}
+
+void mqttAsyncOnSent(MQTT_ASYNC_SENT_CALLBACK onSent) {
+  mqttAsync.onSent = onSent;
+}
+
+void mqttAsyncOnPing(MQTT_ASYNC_PING_CALLBACK onPing) {
+  mqttAsync.onPing = onPing;
+}
+
+/**********************************************************************
+ * Set the <keepalive> in seconds to request at the next connection.
+ */
+void mqttAsyncKeepalive(uint16_t keepalive) {
+  mqttAsync.keepalive = keepalive;
+}
+
+/**********************************************************************
+ * Set the idle time in seconds after which to ping (0 for the
+ * keepalive). The keepalive granted by the broker is never exceeded.
+ */
+void mqttAsyncPingInterval(uint16_t interval) {
+  mqttAsync.pingInterval = interval;
+}
+
+/**********************************************************************
+ * Start connecting to the broker as <clientId>, with <username> and
+ * <password> unless they are empty. Returns false if a connection is
+ * already up or in progress or cannot be started; otherwise the
+ * connection is up when mqttAsyncConnected() says so.
+ */
+boolean mqttAsyncConnect(const char *clientId, const char *username, const char *password) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  uint8_t flags = 0x02;           // Clean session (clean start)
+  size_t remaining = (10 + ((mqtt.version == 5)?1:0) + 2 + strlen(clientId));
+
+  if (mqtt.state != MQTT_ASYNC_DISCONNECTED) return(false);
+  if ((username) && (*username)) { flags |= 0x80; remaining += (2 + strlen(username)); }
+  if ((password) && (*password)) { flags |= 0x40; remaining += (2 + strlen(password)); }
+
+  mqtt.queueHead = mqtt.queueLength = 0;
+  mqtt.queued = mqtt.acked = 0;
+  mqtt.trackCount = 0;
+  mqtt.rxLength = mqtt.rxSkip = 0;
+  mqtt.pinging = false;
+  mqtt.grantedKeepalive = mqtt.keepalive;
+  mqtt.aliasCount = 0;
+  for (int i = 0; i < MQTT_ASYNC_ALIASES; i++) mqtt.aliases[i].topic[0] = 0;
+  if (!mqttAsyncQueueHeader(MQTT_CONNECT, remaining)) return(false);
+  const uint8_t variable[] = { 0, 4, 'M', 'Q', 'T', 'T', mqtt.version, flags, (uint8_t) (mqtt.keepalive >> 8), (uint8_t) mqtt.keepalive, 0 };
+  // Under MQTT 5 the variable header ends with an empty property list.
+  mqttAsyncQueue(variable, (sizeof(variable) - ((mqtt.version == 5)?0:1)));
+  mqttAsyncQueueString(clientId);
+  if (flags & 0x80) mqttAsyncQueueString(username);
+  if (flags & 0x40) mqttAsyncQueueString(password);
+
+  mqtt.state = MQTT_ASYNC_CONNECTING;
+  mqtt.stateChanged = millis();
+  if (!mqtt.tcp.connect(mqtt.host, mqtt.port)) {
+    mqtt.state = MQTT_ASYNC_DISCONNECTED;
+    return(false);
+  }
+  return(true);
+}
+
+/**********************************************************************
+ * Returns the index of the alias for <topic>, setting <known> if the
+ * broker already has it, or -1 if it cannot have one.
+ */
+int mqttAsyncAlias(const char *topic, size_t length, boolean &known) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  int retval = -1;
+
+  known = false;
+  if (length >= MQTT_ASYNC_ALIAS_TOPIC) return(-1);
+  for (int i = 0; i < mqtt.aliasCount; i++) {
+    if (strcmp(mqtt.aliases[i].topic, topic) == 0) { known = true; return(i); }
+    if ((retval < 0) || (mqtt.aliases[i].used < mqtt.aliases[retval].used)) retval = i;
+  }
+  return(retval);
+}
+
+/**********************************************************************
+ * Queue <payload> for publication to <topic>, to be discarded by the
+ * broker if it cannot be delivered within <expiry> seconds (0 for
+ * never; ignored under MQTT 3.1.1). Returns a token which identifies
+ * the publication to the sent callback, or 0 if it cannot be queued
+ * (we are not connected, or the queue is full).
+ */
+uint16_t mqttAsyncPublish(const char *topic, const char *payload, boolean retained = false, uint32_t expiry = 0) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  size_t topicLength = strlen(topic), payloadLength = strlen(payload);
+  size_t properties = 0;
+  boolean known = false;
+  int alias = -1;
+
+  if ((mqtt.state != MQTT_ASYNC_CONNECTED) || (mqtt.trackCount == MQTT_ASYNC_TRACKED)) return(0);
+  if (mqtt.version == 5) {
+    alias = mqttAsyncAlias(topic, topicLength, known);
+    properties = (((expiry)?5:0) + ((alias >= 0)?3:0));
+  }
+  size_t remaining = (2 + ((known)?0:topicLength) + ((mqtt.version == 5)?1:0) + properties + payloadLength);
+  if (!mqttAsyncQueueHeader((MQTT_PUBLISH | ((retained)?0x01:0x00)), remaining)) return(0);
+  mqttAsyncQueueString((known)?"":topic);
+  if (mqtt.version == 5) {
+    mqttAsyncQueueInteger(properties, 1);
+    if (expiry) {
+      mqttAsyncQueueInteger(MQTT_PROPERTY_EXPIRY, 1);
+      mqttAsyncQueueInteger(expiry, 4);
+    }
+    if (alias >= 0) {
+      mqttAsyncQueueInteger(MQTT_PROPERTY_TOPIC_ALIAS, 1);
+      mqttAsyncQueueInteger((alias + 1), 2);
+      if (!known) strcpy(mqtt.aliases[alias].topic, topic);
+      mqtt.aliases[alias].used = ++mqtt.publications;
+    }
+  }
+  mqttAsyncQueue((const uint8_t *) payload, payloadLength);
+
+  if (++mqtt.nextToken == 0) mqtt.nextToken = 1;
+  mqtt.tracks[mqtt.trackCount++] = { mqtt.queued, mqtt.nextToken, micros() };
+  mqttAsyncCoalesce(millis());
+  return(mqtt.nextToken);
+}
+
+/**********************************************************************
+ * Queue a subscription to <topic>. Returns false if it cannot be
+ * queued.
+ */
+boolean mqttAsyncSubscribe(const char *topic) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  size_t remaining = (2 + ((mqtt.version == 5)?1:0) + 2 + strlen(topic) + 1);
+  const uint8_t qos = 0;
+
+  if ((mqtt.state != MQTT_ASYNC_CONNECTED) || (!mqttAsyncQueueHeader(MQTT_SUBSCRIBE, remaining))) return(false);
+  if (++mqtt.nextToken == 0) mqtt.nextToken = 1;
+  const uint8_t id[2] = { (uint8_t) (mqtt.nextToken >> 8), (uint8_t) mqtt.nextToken };
+  mqttAsyncQueue(id, 2);
+  if (mqtt.version == 5) mqttAsyncQueueInteger(0, 1);
+  mqttAsyncQueueString(topic);
+  mqttAsyncQueue(&qos, 1);
+  mqttAsyncFlush();
+  return(true);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). Abandons a connection attempt which
+ * has taken too long, writes publications whose coalescing window has
+ * passed, keeps the connection alive when nothing else is being sent
+ * and drops it if the broker stops answering.
+ */
+void mqttAsyncService(unsigned long now) {
+  MQTT_ASYNC &mqtt = mqttAsync;
+  unsigned long interval = (mqtt.pingInterval)?min(mqtt.pingInterval, mqtt.grantedKeepalive):mqtt.grantedKeepalive;
+
+  if (((mqtt.state == MQTT_ASYNC_CONNECTING) || (mqtt.state == MQTT_ASYNC_HANDSHAKE)) && ((now - mqtt.stateChanged) >= MQTT_ASYNC_CONNECT_TIMEOUT)) {
+    mqtt.tcp.close(true);
+  } else if (mqtt.state == MQTT_ASYNC_CONNECTED) {
+    if ((mqtt.pinging) && ((now - mqtt.pingSent) >= MQTT_ASYNC_PING_TIMEOUT)) {
+      mqtt.tcp.close(true);
+    } else if ((!mqtt.pinging) && (interval) && ((now - mqtt.lastSent) >= (interval * 1000UL)) && (mqttAsyncQueueHeader(MQTT_PINGREQ, 0))) {
+      mqtt.pinging = true;
+      mqtt.pingSent = now;
+      mqtt.pingIdle = (now - mqtt.lastSent);
+      mqttAsyncFlush();
+    } else {
+      mqttAsyncCoalesce(now);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*********************************************************************
+ * NAME
+ *   occupancy.h - occupancy state machine fusing PIR, lux and door.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Derives a space's occupancy state from raw PIR motion samples and,
+ *   optionally, a door switch and an ambient light level, so that
+ *   consumers can react to a small number of deterministic state
+ *   transitions rather than to a flood of motion samples.
+ *
+ *   VACANT    Nobody is thought to be present. Motion, or the lights
+ *             being switched on (lux rising through the configured
+ *             threshold), makes the space OCCUPIED.
+ *
+ *   OCCUPIED  Somebody is present. The state is held for holdTime after
+ *             the last motion, then becomes HOLD. A door event (the
+ *             door opening or closing) also moves to HOLD straight away
+ *             since it may mean the occupant has left. If motion is seen
+ *             after the door has closed then the occupant is known to be
+ *             inside and the state is latched (no hold timeout) until
+ *             the door next opens.
+ *
+ *   HOLD      Somebody may be present. Motion within retriggerWindow
+ *             returns to OCCUPIED; otherwise the space becomes VACANT
+ *             when the window expires or immediately if the lights are
+ *             switched off (lux falls below the configured threshold).
+ *
+ *   Door and lux inputs are optional and are disabled by giving their
+ *   configuration a negative value.
+ */
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <Arduino.h>
+
+enum OCCUPANCY_STATE { OCCUPANCY_VACANT, OCCUPANCY_OCCUPIED, OCCUPANCY_HOLD };
+
+const char *OCCUPANCY_STATE_NAMES[] = { "vacant", "occupied", "hold" };
+
+struct OCCUPANCY_CONFIG {
+  unsigned long holdTime;         // Milliseconds OCCUPIED persists after motion
+  unsigned long retriggerWindow;  // Milliseconds HOLD waits for motion
+  int doorGpio;                   // Active-low door switch or -1
+  int luxThreshold;               // Lights-on lux level or -1
+};
+
+struct OCCUPANCY {
+  OCCUPANCY_CONFIG config;
+  OCCUPANCY_STATE state;
+  unsigned long lastMotion;       // Millis of most recent motion sample
+  unsigned long holdStart;        // Millis at which HOLD was entered
+  int door;                       // Last door switch reading
+  int lux;                        // Last lux reading
+  boolean latched;                // Occupant seen inside a closed room
+};
+
+void occupancyBegin(OCCUPANCY &occupancy, OCCUPANCY_CONFIG config) {
+  occupancy.config = config;
+  occupancy.state = OCCUPANCY_VACANT;
+  occupancy.lastMotion = 0UL;
+  occupancy.holdStart = 0UL;
+  occupancy.latched = false;
+  occupancy.lux = 0;
+  occupancy.door = HIGH;
+  if (config.doorGpio >= 0) {
+    pinMode(config.doorGpio, INPUT_PULLUP);
+    occupancy.door = digitalRead(config.doorGpio);
+  }
+}
+
+/**********************************************************************
+ * Feed the state machine with a <motion> sample and a <lux> reading
+ * taken at <now>. The door switch, if configured, is read here.
+ * Returns true if the occupancy state changed.
+ */
+boolean occupancyUpdate(OCCUPANCY &occupancy, unsigned long now, int motion, int lux) {
+  OCCUPANCY_STATE previous = occupancy.state;
+  boolean doorEvent = false;
+  boolean lightsOn = false;
+  boolean lightsOff = false;
+
+  if (occupancy.config.doorGpio >= 0) {
+    int door = digitalRead(occupancy.config.doorGpio);
+    if (door != occupancy.door) {
+      occupancy.door = door;
+      occupancy.latched = false;
+      doorEvent = true;
+    }
+  }
+
+  if (occupancy.config.luxThreshold >= 0) {
+    lightsOn = ((occupancy.lux < occupancy.config.luxThreshold) && (lux >= occupancy.config.luxThreshold));
+    lightsOff = (lux < occupancy.config.luxThreshold);
+    occupancy.lux = lux;
+  }
+
+  if (motion) {
+    occupancy.lastMotion = now;
+    if ((occupancy.config.doorGpio >= 0) && (occupancy.door == LOW) && (!doorEvent)) occupancy.latched = true;
+  }
+
+  switch (occupancy.state) {
+    case OCCUPANCY_VACANT:
+      if ((motion) || (lightsOn)) {
+        occupancy.state = OCCUPANCY_OCCUPIED;
+        occupancy.lastMotion = now;
+      }
+      break;
+    case OCCUPANCY_OCCUPIED:
+      if (doorEvent) {
+        occupancy.state = OCCUPANCY_HOLD;
+      } else if ((!occupancy.latched) && ((now - occupancy.lastMotion) > occupancy.config.holdTime)) {
+        occupancy.state = OCCUPANCY_HOLD;
+      }
+      if (occupancy.state == OCCUPANCY_HOLD) occupancy.holdStart = now;
+      break;
+    case OCCUPANCY_HOLD:
+      if ((motion) && (!doorEvent)) {
+        occupancy.state = OCCUPANCY_OCCUPIED;
+      } else if ((lightsOff) || ((now - occupancy.holdStart) > occupancy.config.retriggerWindow)) {
+        occupancy.state = OCCUPANCY_VACANT;
+      }
+      break;
+  }
+  return(occupancy.state != previous);
+}
+
+const char *occupancyStateName(OCCUPANCY &occupancy) {
+  return(OCCUPANCY_STATE_NAMES[occupancy.state]);
+}
+
+#endif
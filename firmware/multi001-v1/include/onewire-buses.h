@@ -0,0 +1,252 @@
+/*********************************************************************
+ * NAME
+ *   onewire-buses.h - DS18B20 sensors on multiple one-wire buses.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Supports DS18B20 temperature sensors spread over several
+ *   independent one-wire buses, each on its own GPIO pin, so that long
+ *   cable runs can be split and a shorted probe only takes out the bus
+ *   it is on.
+ *
+ *   Each bus has its own discovery table (built once at startup), its
+ *   own conversion resolution and its own conversion interval.
+ *
+ *   Conversions are started with a broadcast Convert T on every bus
+ *   which is due (or will be due within ONE_WIRE_BUS_ALIGN_WINDOW)
+ *   without waiting for them to complete, so all buses convert in
+ *   parallel and total sampling time does not grow with the number of
+ *   probes or buses. When a bus's conversion time has elapsed its
+ *   probes are read back one per call to oneWireBusService() so that
+ *   loop() is never blocked for more than a single scratchpad read.
+ *
+ *   Every scratchpad read is validated before it is used. A read with
+ *   a bad CRC, or which floats high because the probe has gone, is
+ *   repeated; a probe which reports the 85C power-on value (it has
+ *   reset since the conversion started) is sent a conversion of its
+ *   own and read again once that completes. Retries come from a budget
+ *   of ONE_WIRE_BUS_RETRY_BUDGET per bus per round and a retry
+ *   conversion is only started if it will finish before the bus's next
+ *   scheduled conversion, so a failing probe can neither stall the bus
+ *   nor delay its schedule. A probe whose reading is still invalid
+ *   when the budget is spent records a failure in its health record
+ *   (see sensor-health.h). Once a probe's circuit breaker opens its
+ *   scratchpad is not read, and it takes no retries from the budget,
+ *   until its backoff expires.
+ *
+ *   Valid readings pass through a median-of-three filter which removes
+ *   single sample spikes.
+ */
+
+#ifndef ONEWIRE_BUSES_H
+#define ONEWIRE_BUSES_H
+
+#include <Arduino.h>
+#include <OneWire.h>
+#include <DallasTemperature.h>
+#include "sensor-health.h"
+
+#define ONE_WIRE_BUS_MAX_BUSES 4
+#define ONE_WIRE_BUS_MAX_DEVICES 16       // Per bus
+#define ONE_WIRE_BUS_ALIGN_WINDOW 1000    // Milliseconds
+#define ONE_WIRE_BUS_RETRY_BUDGET 4       // Retries per bus per round
+#define ONE_WIRE_BUS_MEDIAN_WINDOW 3      // Samples in spike filter
+
+#define DS18B20_POWER_ON_RAW 0x0550       // 85C in 1/16 degree
+#define DS18B20_MIN_RAW (-55 * 16)
+#define DS18B20_MAX_RAW (125 * 16)
+
+enum ONE_WIRE_PROBE_STATUS { ONE_WIRE_PROBE_OK, ONE_WIRE_PROBE_CRC, ONE_WIRE_PROBE_DISCONNECTED, ONE_WIRE_PROBE_POWER_ON, ONE_WIRE_PROBE_RANGE };
+
+// Health error class of each probe status
+const SENSOR_ERROR ONE_WIRE_PROBE_ERRORS[] = { SENSOR_ERROR_NONE, SENSOR_ERROR_CRC, SENSOR_ERROR_BUS, SENSOR_ERROR_RESET, SENSOR_ERROR_RANGE };
+
+/**********************************************************************
+ * Structure describing a single bus. The first three members are user
+ * configuration; the remainder is maintained by the driver.
+ */
+struct ONE_WIRE_BUS {
+  int gpio;                       // GPIO pin
+  uint8_t resolution;             // Conversion resolution in bits (9..12)
+  unsigned long interval;         // Milliseconds between conversions
+  int deviceCount;                // Number of devices discovered
+  DeviceAddress addresses[ONE_WIRE_BUS_MAX_DEVICES];
+  float temperatures[ONE_WIRE_BUS_MAX_DEVICES]; // Filtered, when valid
+  boolean valid[ONE_WIRE_BUS_MAX_DEVICES]; // Last read of probe succeeded
+  SENSOR_HEALTH health[ONE_WIRE_BUS_MAX_DEVICES];
+  int16_t samples[ONE_WIRE_BUS_MAX_DEVICES][ONE_WIRE_BUS_MEDIAN_WINDOW]; // Raw
+  uint8_t sampleCount[ONE_WIRE_BUS_MAX_DEVICES];
+  unsigned long nextConversion;   // Millis at which next conversion is due
+  unsigned long conversionDone;   // Millis at which conversion completes
+  int collectIndex;               // Next device to read or -1 if idle
+  int retries;                    // Retries used in this round
+  boolean updated;                // New readings since last collection
+};
+
+OneWire oneWireBusWires[ONE_WIRE_BUS_MAX_BUSES];
+DallasTemperature oneWireBusSensors[ONE_WIRE_BUS_MAX_BUSES];
+ONE_WIRE_BUS *oneWireBusTable = 0;
+int oneWireBusCount = 0;
+
+/**********************************************************************
+ * Initialise the <count> buses described by <buses> and build their
+ * discovery tables. Returns the total number of devices discovered.
+ */
+int oneWireBusBegin(ONE_WIRE_BUS *buses, int count) {
+  int retval = 0;
+
+  oneWireBusTable = buses;
+  oneWireBusCount = min(count, ONE_WIRE_BUS_MAX_BUSES);
+
+  for (int b = 0; b < oneWireBusCount; b++) {
+    ONE_WIRE_BUS &bus = buses[b];
+    oneWireBusWires[b].begin(bus.gpio);
+    oneWireBusSensors[b].setOneWire(&oneWireBusWires[b]);
+    oneWireBusSensors[b].begin();
+    oneWireBusSensors[b].setWaitForConversion(false);
+    bus.deviceCount = 0;
+    for (int i = 0; i < oneWireBusSensors[b].getDeviceCount(); i++) {
+      if (bus.deviceCount == ONE_WIRE_BUS_MAX_DEVICES) break;
+      if (oneWireBusSensors[b].getAddress(bus.addresses[bus.deviceCount], i)) {
+        oneWireBusSensors[b].setResolution(bus.addresses[bus.deviceCount], bus.resolution);
+        bus.temperatures[bus.deviceCount] = DEVICE_DISCONNECTED_C;
+        bus.valid[bus.deviceCount] = false;
+        sensorHealthBegin(bus.health[bus.deviceCount]);
+        bus.sampleCount[bus.deviceCount] = 0;
+        bus.deviceCount++;
+      }
+    }
+    bus.nextConversion = millis();
+    bus.collectIndex = -1;
+    bus.updated = false;
+    retval += bus.deviceCount;
+  }
+  return(retval);
+}
+
+/**********************************************************************
+ * Read and validate the scratchpad of <device> on bus <b>, returning
+ * the temperature in 1/16 degree in <raw> if it is OK.
+ */
+ONE_WIRE_PROBE_STATUS oneWireBusReadProbe(int b, int device, int16_t &raw) {
+  ONE_WIRE_BUS &bus = oneWireBusTable[b];
+  uint8_t scratchpad[9];
+  boolean high = true;
+
+  if (!oneWireBusSensors[b].readScratchPad(bus.addresses[device], scratchpad)) return(ONE_WIRE_PROBE_DISCONNECTED);
+  for (unsigned int i = 0; i < sizeof(scratchpad); i++) high &= (scratchpad[i] == 0xFF);
+  if (high) return(ONE_WIRE_PROBE_DISCONNECTED);
+  if (OneWire::crc8(scratchpad, 8) != scratchpad[8]) return(ONE_WIRE_PROBE_CRC);
+  raw = (int16_t) (((uint16_t) scratchpad[1] << 8) | scratchpad[0]);
+  if (raw == DS18B20_POWER_ON_RAW) return(ONE_WIRE_PROBE_POWER_ON);
+  if ((raw < DS18B20_MIN_RAW) || (raw > DS18B20_MAX_RAW)) return(ONE_WIRE_PROBE_RANGE);
+  return(ONE_WIRE_PROBE_OK);
+}
+
+/**********************************************************************
+ * Add the valid reading <raw> to the spike filter of <device> on <bus>
+ * and return the filtered temperature.
+ */
+float oneWireBusFilter(ONE_WIRE_BUS &bus, int device, int16_t raw) {
+  int16_t *samples = bus.samples[device];
+  int16_t a, b, c;
+
+  if (bus.sampleCount[device] < ONE_WIRE_BUS_MEDIAN_WINDOW) {
+    samples[bus.sampleCount[device]++] = raw;
+  } else {
+    samples[0] = samples[1];
+    samples[1] = samples[2];
+    samples[2] = raw;
+  }
+  if (bus.sampleCount[device] < ONE_WIRE_BUS_MEDIAN_WINDOW) return(raw / 16.0);
+  a = samples[0]; b = samples[1]; c = samples[2];
+  return(max(min(a, b), min(max(a, b), c)) / 16.0);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). Returns true when any bus has
+ * completed a round of readings.
+ */
+boolean oneWireBusService(unsigned long now) {
+  boolean retval = false;
+  boolean due = false;
+
+  // Start conversions on every idle bus that is due or nearly due, but
+  // only if at least one bus is actually due.
+  for (int b = 0; b < oneWireBusCount; b++) {
+    if ((oneWireBusTable[b].deviceCount) && (oneWireBusTable[b].collectIndex == -1) && ((long) (now - oneWireBusTable[b].nextConversion) >= 0)) due = true;
+  }
+  if (due) {
+    for (int b = 0; b < oneWireBusCount; b++) {
+      ONE_WIRE_BUS &bus = oneWireBusTable[b];
+      if ((bus.deviceCount) && (bus.collectIndex == -1) && ((long) (now + ONE_WIRE_BUS_ALIGN_WINDOW - bus.nextConversion) >= 0)) {
+        oneWireBusSensors[b].requestTemperatures();
+        bus.conversionDone = (now + oneWireBusSensors[b].millisToWaitForConversion(bus.resolution));
+        bus.nextConversion = (now + bus.interval);
+        bus.collectIndex = 0;
+        bus.retries = 0;
+      }
+    }
+  }
+
+  // Read back one probe from one bus whose conversion has completed.
+  for (int b = 0; b < oneWireBusCount; b++) {
+    ONE_WIRE_BUS &bus = oneWireBusTable[b];
+    if ((bus.collectIndex != -1) && ((long) (now - bus.conversionDone) >= 0)) {
+      int16_t raw = 0;
+      unsigned long conversionTime;
+      ONE_WIRE_PROBE_STATUS status;
+
+      // Probes with an open circuit breaker cost no bus time.
+      while ((bus.collectIndex < bus.deviceCount) && (!sensorHealthAllow(bus.health[bus.collectIndex], now))) bus.valid[bus.collectIndex++] = false;
+      if (bus.collectIndex == bus.deviceCount) {
+        bus.collectIndex = -1;
+        bus.updated = true;
+        retval = true;
+        break;
+      }
+      status = oneWireBusReadProbe(b, bus.collectIndex, raw);
+
+      if ((status != ONE_WIRE_PROBE_OK) && (status != ONE_WIRE_PROBE_RANGE) && (bus.retries < ONE_WIRE_BUS_RETRY_BUDGET)) {
+        if (status != ONE_WIRE_PROBE_POWER_ON) {
+          // Read again on the next call.
+          bus.retries++;
+          break;
+        }
+        conversionTime = oneWireBusSensors[b].millisToWaitForConversion(bus.resolution);
+        if ((long) (now + conversionTime - bus.nextConversion) < 0) {
+          // The probe reset: restore its resolution and convert again.
+          bus.retries++;
+          oneWireBusSensors[b].setResolution(bus.addresses[bus.collectIndex], bus.resolution, true);
+          oneWireBusSensors[b].requestTemperaturesByAddress(bus.addresses[bus.collectIndex]);
+          bus.conversionDone = (now + conversionTime);
+          break;
+        }
+      }
+      if ((bus.valid[bus.collectIndex] = (status == ONE_WIRE_PROBE_OK))) {
+        bus.temperatures[bus.collectIndex] = oneWireBusFilter(bus, bus.collectIndex, raw);
+        sensorHealthSuccess(bus.health[bus.collectIndex], now);
+      } else {
+        sensorHealthFailure(bus.health[bus.collectIndex], ONE_WIRE_PROBE_ERRORS[status], now, bus.interval);
+      }
+      if (++bus.collectIndex == bus.deviceCount) {
+        bus.collectIndex = -1;
+        bus.updated = true;
+        retval = true;
+      }
+      break;
+    }
+  }
+  return(retval);
+}
+
+/**********************************************************************
+ * Return true if bus <index> has new readings and clear the flag.
+ */
+boolean oneWireBusCollect(int index) {
+  boolean retval = oneWireBusTable[index].updated;
+  oneWireBusTable[index].updated = false;
+  return(retval);
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*********************************************************************
+ * NAME
+ *   outputs.h - named digital outputs (relays and GPIO).
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Maintains a table of named digital outputs, each driving a GPIO pin
+ *   with a configurable active level, so that relays and other outputs
+ *   can be addressed by name from local rules and remote commands.
+ *
+ *   Outputs are switched off when they are initialised.
+ *
+ *   Outputs can also be commanded remotely. outputCommand() applies a
+ *   command payload, which is either a plain state (0, 1, on, off, true
+ *   or false) or a JSON object of the form:
+ *
+ *     { "seq": n, "value": v }
+ *
+ *   where <n> is an optional sequence number and <v> is a state. A
+ *   command whose sequence number is not later than that of the last
+ *   sequenced command applied to the output is stale and is rejected,
+ *   so that commands delivered late or twice cannot undo newer ones.
+ *   Payloads are parsed in place without any memory allocation, so that
+ *   commands can be handled directly from an MQTT callback.
+ *
+ *   Every command leaves an acknowledgement on its output recording the
+ *   result and the microseconds between the caller's reference time
+ *   (normally the moment it began reading the command) and the output
+ *   pin being driven. The caller sends acknowledgements outside the
+ *   callback, checking for one with outputAckPending() and collecting
+ *   it with outputAckCollect() once it has been sent.
+ */
+
+#ifndef OUTPUTS_H
+#define OUTPUTS_H
+
+#include <Arduino.h>
+
+enum OUTPUT_COMMAND_RESULT { OUTPUT_COMMAND_OK, OUTPUT_COMMAND_STALE, OUTPUT_COMMAND_INVALID };
+
+const char *OUTPUT_COMMAND_RESULT_NAMES[] = { "ok", "stale", "invalid" };
+
+/**********************************************************************
+ * Structure describing an output. The first three members are user
+ * configuration; the remainder is maintained by the module.
+ */
+struct OUTPUT_CHANNEL {
+  const char *name;               // Name used by rules and commands
+  int gpio;                       // GPIO pin
+  int activeLevel;                // Pin level which switches output on
+  boolean state;                  // True if output is on
+  boolean changed;                // State changed since last collection
+  boolean sequenced;              // A sequenced command has been applied
+  uint32_t sequence;              // Sequence number of that command
+  boolean ackPending;             // Acknowledgement awaiting collection
+  uint32_t ackSequence;           // Sequence number being acknowledged
+  OUTPUT_COMMAND_RESULT ackResult;
+  unsigned long ackLatency;       // Microseconds from reference to actuation
+};
+
+OUTPUT_CHANNEL *outputTable = 0;
+int outputCount = 0;
+
+void outputBegin(OUTPUT_CHANNEL *outputs, int count) {
+  outputTable = outputs;
+  outputCount = count;
+  for (int i = 0; i < count; i++) {
+    outputs[i].state = false;
+    outputs[i].changed = false;
+    outputs[i].sequenced = false;
+    outputs[i].ackPending = false;
+    digitalWrite(outputs[i].gpio, !outputs[i].activeLevel);
+    pinMode(outputs[i].gpio, OUTPUT);
+  }
+}
+
+/**********************************************************************
+ * Return the index of the output called <name> or -1.
+ */
+int outputFind(const char *name) {
+  for (int i = 0; i < outputCount; i++) {
+    if (strcmp(outputTable[i].name, name) == 0) return(i);
+  }
+  return(-1);
+}
+
+/**********************************************************************
+ * Switch output <index> on or off.
+ */
+void outputSet(int index, boolean state) {
+  OUTPUT_CHANNEL &output = outputTable[index];
+
+  digitalWrite(output.gpio, (state)?output.activeLevel:!output.activeLevel);
+  if (state != output.state) {
+    output.state = state;
+    output.changed = true;
+  }
+}
+
+boolean outputState(int index) {
+  return(outputTable[index].state);
+}
+
+/**********************************************************************
+ * Return true if the state of output <index> has changed since it was
+ * last collected and clear the flag.
+ */
+boolean outputCollect(int index) {
+  boolean retval = outputTable[index].changed;
+  outputTable[index].changed = false;
+  return(retval);
+}
+
+/**********************************************************************
+ * Parse the state token of <length> characters at <p>, which may be
+ * quoted, into <state>. Returns false if the token is not a state.
+ */
+boolean outputParseState(const char *p, unsigned int length, boolean &state) {
+  if ((length >= 2) && (p[0] == '"') && (p[length - 1] == '"')) { p++; length -= 2; }
+  if (((length == 1) && (*p == '1')) || ((length == 2) && (strncasecmp(p, "on", 2) == 0)) || ((length == 4) && (strncasecmp(p, "true", 4) == 0))) {
+    state = true;
+    return(true);
+  }
+  if (((length == 1) && (*p == '0')) || ((length == 3) && (strncasecmp(p, "off", 3) == 0)) || ((length == 5) && (strncasecmp(p, "false", 5) == 0))) {
+    state = false;
+    return(true);
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Parse the command <payload> of <length> bytes. <sequenced> says
+ * whether a sequence number was given. Returns false if the payload is
+ * malformed.
+ */
+boolean outputParseCommand(const char *payload, unsigned int length, boolean &state, boolean &sequenced, uint32_t &sequence) {
+  const char *p = payload;
+  const char *end = (payload + length);
+  boolean stated = false;
+
+  sequenced = false;
+  while ((p < end) && (isspace(*p))) p++;
+  while ((end > p) && (isspace(*(end - 1)))) end--;
+  if (p == end) return(false);
+  if (*p != '{') return(outputParseState(p, (end - p), state));
+
+  // A flat JSON object: "key": value pairs separated by commas.
+  p++;
+  while (p < end) {
+    const char *key, *value;
+    unsigned int keyLength, valueLength;
+
+    while ((p < end) && ((isspace(*p)) || (*p == ','))) p++;
+    if ((p < end) && (*p == '}')) break;
+    if ((p == end) || (*p++ != '"')) return(false);
+    for (key = p; ((p < end) && (*p != '"')); p++);
+    if (p == end) return(false);
+    keyLength = (p++ - key);
+    while ((p < end) && (isspace(*p))) p++;
+    if ((p == end) || (*p++ != ':')) return(false);
+    while ((p < end) && (isspace(*p))) p++;
+    for (value = p; ((p < end) && (*p != ',') && (*p != '}') && (!isspace(*p))); p++);
+    valueLength = (p - value);
+
+    if ((keyLength == 3) && (strncmp(key, "seq", 3) == 0)) {
+      sequence = 0;
+      if (valueLength == 0) return(false);
+      for (unsigned int i = 0; i < valueLength; i++) {
+        if (!isdigit(value[i])) return(false);
+        sequence = ((sequence * 10) + (value[i] - '0'));
+      }
+      sequenced = true;
+    } else if ((keyLength == 5) && (strncmp(key, "value", 5) == 0)) {
+      if (!outputParseState(value, valueLength, state)) return(false);
+      stated = true;
+    }
+  }
+  return(stated);
+}
+
+/**********************************************************************
+ * Apply the command <payload> of <length> bytes to output <index>.
+ * <reference> is the micros() value from which actuation latency is
+ * measured. Returns true if the command was applied.
+ */
+boolean outputCommand(int index, const char *payload, unsigned int length, unsigned long reference) {
+  OUTPUT_CHANNEL &output = outputTable[index];
+  boolean state = false;
+  boolean sequenced;
+  uint32_t sequence = 0;
+
+  output.ackSequence = 0;
+  output.ackLatency = 0;
+  output.ackPending = true;
+  if (!outputParseCommand(payload, length, state, sequenced, sequence)) {
+    output.ackResult = OUTPUT_COMMAND_INVALID;
+    return(false);
+  }
+  output.ackSequence = sequence;
+  if ((sequenced) && (output.sequenced) && ((int32_t) (sequence - output.sequence) <= 0)) {
+    output.ackResult = OUTPUT_COMMAND_STALE;
+    return(false);
+  }
+  outputSet(index, state);
+  output.ackLatency = (micros() - reference);
+  output.ackResult = OUTPUT_COMMAND_OK;
+  if (sequenced) {
+    output.sequence = sequence;
+    output.sequenced = true;
+  }
+  return(true);
+}
+
+/**********************************************************************
+ * Return true if output <index> has an acknowledgement awaiting
+ * collection, leaving the flag set.
+ */
+boolean outputAckPending(int index) {
+  return(outputTable[index].ackPending);
+}
+
+/**********************************************************************
+ * Return true if output <index> has an acknowledgement awaiting
+ * collection and clear the flag.
+ */
+boolean outputAckCollect(int index) {
+  boolean retval = outputTable[index].ackPending;
+  outputTable[index].ackPending = false;
+  return(retval);
+}
+
+const char *outputAckResultName(OUTPUT_CHANNEL &output) {
+  return(OUTPUT_COMMAND_RESULT_NAMES[output.ackResult]);
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*********************************************************************
+ * NAME
+ *   pir-metrics.h - PIR activity duty cycle and pulse metrics.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Summarises the output of a PIR motion sensor over fixed windows as
+ *   three occupancy intensity metrics, so that space utilisation can
+ *   be analysed without streaming raw motion samples:
+ *
+ *   active    Percentage of the window for which motion was reported.
+ *   triggers  Number of times motion started during the window.
+ *   idle      Longest unbroken period without motion in the window.
+ *
+ *   GPIO16, where the PIR is connected, cannot raise interrupts, so
+ *   the input is sampled by a Ticker at PIR_METRICS_SAMPLE_INTERVAL
+ *   independently of loop(). The Ticker callback only counts; the
+ *   metrics are computed from the counts when a window closes.
+ */
+
+#ifndef PIR_METRICS_H
+#define PIR_METRICS_H
+
+#include <Arduino.h>
+#include <Ticker.h>
+
+#define PIR_METRICS_SAMPLE_INTERVAL 50    // Milliseconds between PIR samples
+
+/**********************************************************************
+ * Metrics of the most recently completed window.
+ */
+struct PIR_METRICS {
+  uint16_t activePermille;        // Active time in tenths of a percent
+  uint16_t triggers;              // Motion starts
+  unsigned long longestIdle;      // Milliseconds
+};
+
+struct PIR_METRICS_COUNTS {
+  uint32_t samples;               // Samples in window
+  uint32_t activeSamples;         // Samples reporting motion
+  uint16_t triggers;              // Inactive to active transitions
+  uint32_t idleRun;               // Current run of inactive samples
+  uint32_t longestIdleRun;        // Longest completed run in window
+  int level;                      // Last sample
+};
+
+Ticker pirMetricsTicker;
+int pirMetricsGpio = -1;
+volatile PIR_METRICS_COUNTS pirMetricsCounts;
+unsigned long pirMetricsWindowStart = 0UL;
+
+void pirMetricsSample() {
+  int level = digitalRead(pirMetricsGpio);
+
+  pirMetricsCounts.samples++;
+  if (level) {
+    pirMetricsCounts.activeSamples++;
+    if (!pirMetricsCounts.level) pirMetricsCounts.triggers++;
+    if (pirMetricsCounts.idleRun > pirMetricsCounts.longestIdleRun) pirMetricsCounts.longestIdleRun = pirMetricsCounts.idleRun;
+    pirMetricsCounts.idleRun = 0;
+  } else {
+    pirMetricsCounts.idleRun++;
+  }
+  pirMetricsCounts.level = level;
+}
+
+/**********************************************************************
+ * Start sampling the (active-high) PIR output on <gpio>.
+ */
+void pirMetricsBegin(int gpio, unsigned long now) {
+  pirMetricsGpio = gpio;
+  pirMetricsCounts.samples = 0;
+  pirMetricsCounts.activeSamples = 0;
+  pirMetricsCounts.triggers = 0;
+  pirMetricsCounts.idleRun = 0;
+  pirMetricsCounts.longestIdleRun = 0;
+  pirMetricsCounts.level = digitalRead(gpio);
+  pirMetricsWindowStart = now;
+  pirMetricsTicker.attach_ms(PIR_METRICS_SAMPLE_INTERVAL, pirMetricsSample);
+}
+
+/**********************************************************************
+ * Close the current window into <metrics> if it is at least <window>
+ * milliseconds old at <now> and start a new one. Returns true if
+ * <metrics> was updated.
+ */
+boolean pirMetricsService(unsigned long now, unsigned long window, PIR_METRICS &metrics) {
+  uint32_t samples, activeSamples, longestIdleRun;
+  uint16_t triggers;
+
+  if ((now - pirMetricsWindowStart) < window) return(false);
+  pirMetricsWindowStart = now;
+
+  noInterrupts();
+  samples = pirMetricsCounts.samples;
+  activeSamples = pirMetricsCounts.activeSamples;
+  triggers = pirMetricsCounts.triggers;
+  // An idle run still in progress counts towards this window and is
+  // counted again from the start of the next.
+  longestIdleRun = max(pirMetricsCounts.longestIdleRun, pirMetricsCounts.idleRun);
+  pirMetricsCounts.samples = 0;
+  pirMetricsCounts.activeSamples = 0;
+  pirMetricsCounts.triggers = 0;
+  pirMetricsCounts.idleRun = 0;
+  pirMetricsCounts.longestIdleRun = 0;
+  interrupts();
+
+  metrics.activePermille = (samples)?(uint16_t) ((activeSamples * 1000UL) / samples):0;
+  metrics.triggers = triggers;
+  metrics.longestIdle = (longestIdleRun * PIR_METRICS_SAMPLE_INTERVAL);
+  return(true);
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*********************************************************************
+ * NAME
+ *   psychrometrics.h - fixed-point derived humidity values.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Computes dew point, absolute humidity and humidex from a dry bulb
+ *   temperature and a relative humidity without any floating point
+ *   exp() or log() calls.
+ *
+ *   All values are fixed-point integers: temperatures (including dew
+ *   point and humidex) are in tenths of a degree Celsius, relative
+ *   humidity in tenths of a percent and absolute humidity in
+ *   hundredths of a gram per cubic metre.
+ *
+ *   Everything derives from the actual vapour pressure e, which is the
+ *   saturation vapour pressure at the dry bulb temperature scaled by
+ *   relative humidity. Saturation vapour pressure comes from a table
+ *   of the Magnus formula (over water) at one degree steps from -40C
+ *   to +80C, linearly interpolated. Dew point is the temperature at
+ *   which saturation pressure equals e, found by a binary search of
+ *   the same table, so no inverse function is needed.
+ *
+ *     absolute humidity = 2.167 * e(Pa) / T(K)
+ *     humidex           = T(C) + 0.5555 * (e(hPa) - 10)
+ */
+
+#ifndef PSYCHROMETRICS_H
+#define PSYCHROMETRICS_H
+
+#include <Arduino.h>
+
+#define PSYCHROMETRIC_MIN_TEMPERATURE -400  // Tenths of a degree Celsius
+#define PSYCHROMETRIC_MAX_TEMPERATURE 800   // Tenths of a degree Celsius
+#define PSYCHROMETRIC_TABLE_SIZE 121
+
+// Saturation vapour pressure in tenths of a Pascal from -40C to +80C.
+const uint32_t PSYCHROMETRIC_SATURATION_PRESSURE[PSYCHROMETRIC_TABLE_SIZE] PROGMEM = {
+  190, 211, 234, 259, 286, 316, 348, 384,
+  423, 465, 512, 562, 617, 676, 741, 811,
+  887, 970, 1059, 1155, 1260, 1372, 1494, 1625,
+  1766, 1919, 2083, 2259, 2448, 2652, 2870, 3105,
+  3356, 3625, 3913, 4222, 4552, 4904, 5281, 5683,
+  6112, 6569, 7057, 7576, 8129, 8717, 9343, 10008,
+  10714, 11464, 12260, 13105, 14000, 14948, 15953, 17017,
+  18142, 19333, 20591, 21921, 23326, 24809, 26374, 28025,
+  29766, 31601, 33533, 35569, 37711, 39966, 42337, 44830,
+  47450, 50203, 53094, 56128, 59313, 62653, 66156, 69827,
+  73675, 77704, 81924, 86341, 90963, 95797, 100852, 106137,
+  111659, 117427, 123452, 129741, 136304, 143152, 150294, 157742,
+  165504, 173593, 182020, 190796, 199933, 209443, 219338, 229632,
+  240337, 251467, 263035, 275056, 287543, 300512, 313977, 327954,
+  342458, 357506, 373114, 389299, 406077, 423468, 441487, 460155,
+  479489
+};
+
+uint32_t psychrometricTable(int index) {
+  return(pgm_read_dword(&PSYCHROMETRIC_SATURATION_PRESSURE[index]));
+}
+
+/**********************************************************************
+ * Return the saturation vapour pressure in tenths of a Pascal at <t10>
+ * tenths of a degree Celsius.
+ */
+uint32_t psychrometricSaturationPressure(int t10) {
+  t10 = constrain(t10, PSYCHROMETRIC_MIN_TEMPERATURE, PSYCHROMETRIC_MAX_TEMPERATURE);
+  int index = ((t10 - PSYCHROMETRIC_MIN_TEMPERATURE) / 10);
+  int fraction = ((t10 - PSYCHROMETRIC_MIN_TEMPERATURE) % 10);
+
+  if (index == (PSYCHROMETRIC_TABLE_SIZE - 1)) return(psychrometricTable(index));
+  return(psychrometricTable(index) + (((psychrometricTable(index + 1) - psychrometricTable(index)) * fraction + 5) / 10));
+}
+
+/**********************************************************************
+ * Return the actual vapour pressure in tenths of a Pascal at <t10>
+ * tenths of a degree Celsius and <rh10> tenths of a percent relative
+ * humidity.
+ */
+uint32_t psychrometricVapourPressure(int t10, int rh10) {
+  rh10 = constrain(rh10, 0, 1000);
+  return((psychrometricSaturationPressure(t10) * (uint32_t) rh10 + 500) / 1000);
+}
+
+/**********************************************************************
+ * Return the dew point in tenths of a degree Celsius.
+ */
+int psychrometricDewPoint(int t10, int rh10) {
+  uint32_t e = psychrometricVapourPressure(t10, rh10);
+  int low = 0;
+  int high = (PSYCHROMETRIC_TABLE_SIZE - 1);
+
+  if (e <= psychrometricTable(low)) return(PSYCHROMETRIC_MIN_TEMPERATURE);
+  if (e >= psychrometricTable(high)) return(PSYCHROMETRIC_MAX_TEMPERATURE);
+  while ((high - low) > 1) {
+    int middle = ((low + high) / 2);
+    if (psychrometricTable(middle) <= e) low = middle; else high = middle;
+  }
+  uint32_t span = (psychrometricTable(high) - psychrometricTable(low));
+  return(PSYCHROMETRIC_MIN_TEMPERATURE + (low * 10) + (int) (((e - psychrometricTable(low)) * 10 + (span / 2)) / span));
+}
+
+/**********************************************************************
+ * Return the absolute humidity in hundredths of a gram per cubic metre.
+ */
+int psychrometricAbsoluteHumidity(int t10, int rh10) {
+  int64_t e = psychrometricVapourPressure(t10, rh10);
+  int64_t k10 = (t10 + 2732);
+
+  return((int) ((2167 * e + (5 * k10)) / (10 * k10)));
+}
+
+/**********************************************************************
+ * Return the humidex in tenths of a degree Celsius.
+ */
+int psychrometricHumidex(int t10, int rh10) {
+  int64_t e = psychrometricVapourPressure(t10, rh10);
+
+  return(t10 + (int) ((5555 * (e - 10000)) / 1000000));
+}
+
+#endif
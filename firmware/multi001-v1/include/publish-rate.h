@@ -0,0 +1,124 @@
+/*********************************************************************
+ * NAME
+ *   publish-rate.h - telemetry rate control from broker round trip time.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Measures the round trip time to the broker and slows non-urgent
+ *   telemetry when it climbs, so that a struggling broker or network
+ *   gets relief without the fleet being reconfigured.
+ *
+ *   When it publishes telemetry, and at most every
+ *   PUBLISH_RATE_PROBE_INTERVAL, the caller publishes a probe, a
+ *   sequence number, to a topic which it also subscribes to and passes
+ *   the echo it receives back to publishRateEcho(). Probes ride along
+ *   with telemetry rather than running on a timer of their own because
+ *   only telemetry is throttled, and because traffic of their own would
+ *   shorten the idle periods from which keepalive.h learns the ping
+ *   interval. The round trip time
+ *   is smoothed and controls a stretch factor, in per cent, by AIMD:
+ *   a smoothed round trip time above the target, or a probe with no
+ *   echo within PUBLISH_RATE_PROBE_TIMEOUT, doubles the factor, and one
+ *   below half the target reduces it by PUBLISH_RATE_STEP, down to 100.
+ *
+ *   The caller stretches its telemetry intervals with
+ *   publishRateStretch() and delays telemetry updates by
+ *   publishRateHoldoff(), which is zero while the factor is 100 and so
+ *   leaves the normal cadence untouched. Events should not be delayed.
+ */
+
+#ifndef PUBLISH_RATE_H
+#define PUBLISH_RATE_H
+
+#include <Arduino.h>
+
+#define PUBLISH_RATE_PROBE_INTERVAL 15000UL // Milliseconds
+#define PUBLISH_RATE_PROBE_TIMEOUT 5000UL   // Milliseconds
+#define PUBLISH_RATE_MIN_FACTOR 100         // Per cent
+#define PUBLISH_RATE_MAX_FACTOR 1000        // Per cent
+#define PUBLISH_RATE_STEP 50                // Per cent
+
+/**********************************************************************
+ * The first member is user configuration; the remainder is maintained
+ * by the module.
+ */
+struct PUBLISH_RATE {
+  unsigned long latencyTarget;    // Milliseconds
+  unsigned long rtt;              // Smoothed round trip (milliseconds)
+  int factor;                     // Per cent
+  uint32_t sequence;              // Of last probe
+  boolean waiting;                // For an echo
+  unsigned long probeSent;        // Millis
+};
+
+PUBLISH_RATE publishRate = { 250UL };
+
+void publishRateBegin(unsigned long latencyTarget, unsigned long now) {
+  publishRate.latencyTarget = latencyTarget;
+  publishRate.rtt = 0UL;
+  publishRate.factor = PUBLISH_RATE_MIN_FACTOR;
+  publishRate.sequence = 0;
+  publishRate.waiting = false;
+  publishRate.probeSent = (now - PUBLISH_RATE_PROBE_INTERVAL);
+}
+
+void publishRateSlower() {
+  publishRate.factor = min(PUBLISH_RATE_MAX_FACTOR, (publishRate.factor * 2));
+}
+
+/**********************************************************************
+ * Called whenever telemetry is published while connected. Returns
+ * true, with the probe's <sequence> number, if a probe should be
+ * published with it.
+ */
+boolean publishRateProbe(unsigned long now, uint32_t &sequence) {
+  if ((publishRate.waiting) && ((now - publishRate.probeSent) >= PUBLISH_RATE_PROBE_TIMEOUT)) {
+    // A lost probe is taken as congestion.
+    publishRate.waiting = false;
+    publishRateSlower();
+  }
+  if ((publishRate.waiting) || ((now - publishRate.probeSent) < PUBLISH_RATE_PROBE_INTERVAL)) return(false);
+  publishRate.waiting = true;
+  publishRate.probeSent = now;
+  sequence = ++publishRate.sequence;
+  return(true);
+}
+
+/**********************************************************************
+ * Handle the echo of a probe, received at <now>. Echoes of anything
+ * but the last probe are ignored.
+ */
+void publishRateEcho(const char *payload, unsigned int length, unsigned long now) {
+  char buffer[12];
+  unsigned long rtt = (now - publishRate.probeSent);
+
+  if ((!publishRate.waiting) || (length >= sizeof(buffer))) return;
+  memcpy(buffer, payload, length);
+  buffer[length] = 0;
+  if (strtoul(buffer, 0, 10) != publishRate.sequence) return;
+  publishRate.waiting = false;
+  publishRate.rtt = (publishRate.rtt)?(((publishRate.rtt * 3) + rtt) / 4):rtt;
+  if (publishRate.rtt > publishRate.latencyTarget) {
+    publishRateSlower();
+  } else if ((publishRate.rtt < (publishRate.latencyTarget / 2)) && (publishRate.factor > PUBLISH_RATE_MIN_FACTOR)) {
+    publishRate.factor = max(PUBLISH_RATE_MIN_FACTOR, (publishRate.factor - PUBLISH_RATE_STEP));
+  }
+}
+
+/**********************************************************************
+ * Forget any outstanding probe, e.g. after reconnecting.
+ */
+void publishRateReset(unsigned long now) {
+  publishRate.waiting = false;
+  publishRate.probeSent = (now - PUBLISH_RATE_PROBE_INTERVAL);
+}
+
+unsigned long publishRateStretch(unsigned long interval) {
+  return((interval * publishRate.factor) / 100);
+}
+
+unsigned long publishRateHoldoff(unsigned long interval) {
+  return((interval * (publishRate.factor - PUBLISH_RATE_MIN_FACTOR)) / 100);
+}
+
+#endif
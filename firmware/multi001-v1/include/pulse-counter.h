@@ -0,0 +1,131 @@
+/*********************************************************************
+ * NAME
+ *   pulse-counter.h - interrupt driven pulse counting on switch inputs.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Allows any switch GPIO to count the pulses produced by an energy or
+ *   flow meter's open-collector (active-low) pulse output.
+ *
+ *   Counting is done by an interrupt service routine on the falling
+ *   edge of each pulse so that meters pulsing at up to 100Hz are
+ *   counted reliably however long loop() takes. Edges arriving within
+ *   PULSE_COUNTER_MIN_PULSE_INTERVAL of a counted edge are treated as
+ *   contact bounce and ignored.
+ *
+ *   Each counter maintains a free-running 32-bit count and a rate (in
+ *   pulses per minute) computed over a caller specified window. Counts
+ *   are saved to RTC memory whenever they change (at most once every
+ *   PULSE_COUNTER_SAVE_INTERVAL) and are restored at startup, so that
+ *   they survive a reset or a crash.
+ */
+
+#ifndef PULSE_COUNTER_H
+#define PULSE_COUNTER_H
+
+#include <Arduino.h>
+#include "rtc-store.h"
+
+#define PULSE_COUNTER_MAX_CHANNELS 4
+#define PULSE_COUNTER_MIN_PULSE_INTERVAL 2000 // Microseconds (debounce)
+#define PULSE_COUNTER_SAVE_INTERVAL 1000  // Milliseconds between RTC saves
+
+struct PULSE_COUNTER {
+  int gpio;                       // GPIO pin or -1 if channel unused
+  volatile uint32_t count;        // Maintained by ISR
+  volatile unsigned long lastEdge; // Micros at last counted edge
+  uint32_t windowCount;           // Count at start of current window
+  unsigned long windowStart;      // Millis at start of current window
+  float rate;                     // Pulses per minute over last window
+};
+
+struct PULSE_COUNTER_RTC_RECORD {
+  uint32_t count[PULSE_COUNTER_MAX_CHANNELS];
+};
+
+PULSE_COUNTER pulseCounters[PULSE_COUNTER_MAX_CHANNELS] = { { -1 }, { -1 }, { -1 }, { -1 } };
+PULSE_COUNTER_RTC_RECORD pulseCounterSaved;
+boolean pulseCounterUnsaved = false;
+unsigned long pulseCounterSaveDeadline = 0UL;
+
+void IRAM_ATTR pulseCounterIsr(void *arg) {
+  PULSE_COUNTER *counter = (PULSE_COUNTER *) arg;
+  unsigned long now = micros();
+
+  if ((now - counter->lastEdge) >= PULSE_COUNTER_MIN_PULSE_INTERVAL) {
+    counter->count++;
+    counter->lastEdge = now;
+  }
+}
+
+/**********************************************************************
+ * Start counting pulses on <gpio> using counter <channel>. Any count
+ * saved in RTC memory by a previous incarnation is restored.
+ */
+void pulseCounterBegin(int channel, int gpio) {
+  static boolean restored = false;
+
+  if (!restored) {
+    if (!rtcStoreRead(RTC_STORE_PULSE_COUNTER_BLOCK, &pulseCounterSaved, sizeof(pulseCounterSaved))) {
+      memset(&pulseCounterSaved, 0, sizeof(pulseCounterSaved));
+    }
+    restored = true;
+  }
+
+  PULSE_COUNTER &counter = pulseCounters[channel];
+  counter.gpio = gpio;
+  counter.count = pulseCounterSaved.count[channel];
+  counter.lastEdge = micros();
+  counter.windowCount = counter.count;
+  counter.windowStart = millis();
+  counter.rate = 0.0;
+  pinMode(gpio, INPUT_PULLUP);
+  attachInterruptArg(digitalPinToInterrupt(gpio), pulseCounterIsr, &counter, FALLING);
+}
+
+boolean pulseCounterEnabled(int channel) {
+  return(pulseCounters[channel].gpio != -1);
+}
+
+uint32_t pulseCounterCount(int channel) {
+  return(pulseCounters[channel].count);
+}
+
+float pulseCounterRate(int channel) {
+  return(pulseCounters[channel].rate);
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). Saves changed counts to RTC memory
+ * and, once every <window> milliseconds, recomputes rates. Returns
+ * true at the end of a window in which any count or rate changed.
+ */
+boolean pulseCounterService(unsigned long now, unsigned long window) {
+  boolean retval = false;
+
+  for (int i = 0; i < PULSE_COUNTER_MAX_CHANNELS; i++) {
+    if (pulseCounters[i].gpio != -1) {
+      uint32_t count = pulseCounters[i].count;
+      if (count != pulseCounterSaved.count[i]) {
+        pulseCounterSaved.count[i] = count;
+        pulseCounterUnsaved = true;
+      }
+      if ((now - pulseCounters[i].windowStart) >= window) {
+        float rate = ((count - pulseCounters[i].windowCount) * 60000.0) / (now - pulseCounters[i].windowStart);
+        if ((count != pulseCounters[i].windowCount) || (rate != pulseCounters[i].rate)) retval = true;
+        pulseCounters[i].rate = rate;
+        pulseCounters[i].windowCount = count;
+        pulseCounters[i].windowStart = now;
+      }
+    }
+  }
+
+  if ((pulseCounterUnsaved) && (now > pulseCounterSaveDeadline)) {
+    rtcStoreWrite(RTC_STORE_PULSE_COUNTER_BLOCK, &pulseCounterSaved, sizeof(pulseCounterSaved));
+    pulseCounterUnsaved = false;
+    pulseCounterSaveDeadline = (now + PULSE_COUNTER_SAVE_INTERVAL);
+  }
+  return(retval);
+}
+
+#endif
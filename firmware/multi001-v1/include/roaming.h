@@ -0,0 +1,257 @@
+/*********************************************************************
+ * NAME
+ *   roaming.h - move to a clearly better access point.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   The station stays associated with whatever access point it first
+ *   joined, however poor the link becomes. This module watches the
+ *   link and moves to a better access point of a known network when
+ *   one is available.
+ *
+ *   Known networks are the network the module was configured with
+ *   (any access point) and those in a table passed to roamBegin(), each
+ *   of which may be restricted to a single access point by BSSID; the
+ *   table ends at an entry with a null ssid. The signal strength of
+ *   the current link is sampled every ROAM_SAMPLE_INTERVAL and
+ *   smoothed. While it is below ROAM_RSSI_THRESHOLD the known networks
+ *   are scanned for in the background, one at a time and each on the
+ *   channel of the strongest other access point seen in the last scan
+ *   for it (on every channel if there was none), so that most scans are
+ *   short. The strongest access point found which is not the current
+ *   one and beats the current link by at least ROAM_HYSTERESIS is
+ *   joined. A scan which finds nothing better doubles the interval
+ *   before the next, up to ROAM_SCAN_INTERVAL_MAX, and no roam is made
+ *   within ROAM_DWELL of the last, so that the module does not flap
+ *   between two access points of similar strength.
+ *
+ *   If the new access point cannot be joined within ROAM_JOIN_TIMEOUT
+ *   the module returns to the configured network. Each roam (or failed
+ *   attempt) is recorded in roamLast, with the time it took and the
+ *   signal strength before and after, and flagged for the caller, which
+ *   checks for it with roamPending() and collects it with roamCollect()
+ *   once it has been reported.
+ *
+ *   The ESP8266 SDK does not report transmit retry counts, so link
+ *   quality is judged on signal strength alone.
+ */
+
+#ifndef ROAMING_H
+#define ROAMING_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define ROAM_SAMPLE_INTERVAL 2000UL       // Milliseconds
+#define ROAM_RSSI_THRESHOLD -70           // dBm below which to look around
+#define ROAM_HYSTERESIS 8                 // dB a candidate must be better by
+#define ROAM_SCAN_INTERVAL 30000UL        // Milliseconds
+#define ROAM_SCAN_INTERVAL_MAX 600000UL   // Milliseconds
+#define ROAM_DWELL 120000UL               // Milliseconds between roams
+#define ROAM_JOIN_TIMEOUT 10000UL         // Milliseconds
+
+/**********************************************************************
+ * Structure describing a known network. The first three members are
+ * user configuration; the remainder is maintained by the module.
+ */
+struct ROAM_NETWORK {
+  const char *ssid;
+  const char *password;
+  uint8_t bssid[6];               // Access point, or all zero for any
+  int32_t channel;                // To scan, or 0 for every channel
+};
+
+/**********************************************************************
+ * Record of a roam.
+ */
+struct ROAM_EVENT {
+  uint8_t from[6];                // BSSID
+  uint8_t to[6];                  // BSSID
+  int32_t rssiBefore;             // dBm
+  int32_t rssiAfter;              // dBm, or 0 if the roam failed
+  unsigned long duration;         // Milliseconds
+};
+
+enum ROAM_STATE { ROAM_IDLE, ROAM_SCANNING, ROAM_JOINING };
+
+struct ROAMING {
+  ROAM_NETWORK *networks;
+  int count;                      // Networks (the configured one is -1)
+  char ssid[33];                  // Configured network
+  char password[65];
+  int32_t configuredChannel;
+  ROAM_STATE state;
+  int32_t rssi;                   // Smoothed, dBm
+  unsigned long sampled;          // Millis
+  unsigned long scanInterval;
+  unsigned long scanDue;          // Millis
+  int scanNext;                   // Network to scan for next
+  int bestNetwork;                // Best found in this round of scans
+  int32_t bestRssi;
+  int32_t bestChannel;
+  uint8_t bestBssid[6];
+  unsigned long roamed;           // Millis of last roam
+  ROAM_EVENT event;               // Roam in progress
+  ROAM_EVENT roamLast;
+  boolean pending;                // roamLast not yet collected
+};
+
+ROAMING roaming;
+
+/**********************************************************************
+ * Start watching the link, which must be up, with the further known
+ * <networks>.
+ */
+void roamBegin(ROAM_NETWORK *networks, unsigned long now) {
+  int count = 0;
+
+  while (networks[count].ssid) count++;
+  roaming.networks = networks;
+  roaming.count = count;
+  strncpy(roaming.ssid, WiFi.SSID().c_str(), sizeof(roaming.ssid) - 1);
+  strncpy(roaming.password, WiFi.psk().c_str(), sizeof(roaming.password) - 1);
+  roaming.configuredChannel = 0;
+  for (int i = 0; i < count; i++) networks[i].channel = 0;
+  roaming.state = ROAM_IDLE;
+  roaming.rssi = WiFi.RSSI();
+  roaming.sampled = now;
+  roaming.scanInterval = ROAM_SCAN_INTERVAL;
+  roaming.scanDue = now;
+  roaming.scanNext = -1;
+  roaming.roamed = (now - ROAM_DWELL);
+  roaming.pending = false;
+  // Roams are temporary: the configured network stays in flash.
+  WiFi.persistent(false);
+}
+
+const char *roamSsid(int network) {
+  return((network < 0)?roaming.ssid:roaming.networks[network].ssid);
+}
+
+int32_t &roamChannel(int network) {
+  return((network < 0)?roaming.configuredChannel:roaming.networks[network].channel);
+}
+
+boolean roamBssidMatch(const uint8_t *wanted, const uint8_t *bssid) {
+  static const uint8_t any[6] = { 0 };
+  return((memcmp(wanted, any, 6) == 0) || (memcmp(wanted, bssid, 6) == 0));
+}
+
+/**********************************************************************
+ * Start a scan for the next network in the round.
+ */
+void roamScan() {
+  int network = roaming.scanNext;
+
+  roaming.state = ROAM_SCANNING;
+  WiFi.scanNetworks(true, false, (uint8_t) roamChannel(network), (uint8_t *) roamSsid(network));
+}
+
+/**********************************************************************
+ * Take the best candidate from the results of a finished scan.
+ */
+void roamScanned(int results) {
+  int network = roaming.scanNext;
+  int32_t best = -1000;
+
+  // The next scan looks only on the channel of the strongest other
+  // access point, or on every channel if there was none.
+  roamChannel(network) = 0;
+  for (int i = 0; i < results; i++) {
+    if (strcmp(WiFi.SSID(i).c_str(), roamSsid(network)) != 0) continue;
+    if ((network >= 0) && (!roamBssidMatch(roaming.networks[network].bssid, WiFi.BSSID(i)))) continue;
+    if (memcmp(WiFi.BSSID(i), WiFi.BSSID(), 6) == 0) continue;
+    if (WiFi.RSSI(i) > best) {
+      best = WiFi.RSSI(i);
+      roamChannel(network) = WiFi.channel(i);
+    }
+    if (WiFi.RSSI(i) > roaming.bestRssi) {
+      roaming.bestNetwork = network;
+      roaming.bestRssi = WiFi.RSSI(i);
+      roaming.bestChannel = WiFi.channel(i);
+      memcpy(roaming.bestBssid, WiFi.BSSID(i), 6);
+    }
+  }
+  WiFi.scanDelete();
+}
+
+/**********************************************************************
+ * Called on every pass of loop().
+ */
+void roamService(unsigned long now) {
+  switch (roaming.state) {
+    case ROAM_IDLE:
+      if (WiFi.status() != WL_CONNECTED) break;
+      if ((now - roaming.sampled) >= ROAM_SAMPLE_INTERVAL) {
+        roaming.sampled = now;
+        roaming.rssi = (((roaming.rssi * 3) + WiFi.RSSI()) / 4);
+      }
+      if ((roaming.rssi < ROAM_RSSI_THRESHOLD) && ((long) (now - roaming.scanDue) >= 0) && ((now - roaming.roamed) >= ROAM_DWELL)) {
+        roaming.scanNext = -1;
+        roaming.bestNetwork = -2;
+        roaming.bestRssi = (roaming.rssi + ROAM_HYSTERESIS - 1);
+        roamScan();
+      }
+      break;
+    case ROAM_SCANNING: {
+      int results = WiFi.scanComplete();
+      if (results == WIFI_SCAN_RUNNING) break;
+      if (results > 0) roamScanned(results); else WiFi.scanDelete();
+      if ((++roaming.scanNext < roaming.count) && (WiFi.status() == WL_CONNECTED)) {
+        roamScan();
+        break;
+      }
+      roaming.state = ROAM_IDLE;
+      if (roaming.bestNetwork < -1) {
+        roaming.scanInterval = min((roaming.scanInterval * 2), ROAM_SCAN_INTERVAL_MAX);
+        roaming.scanDue = (now + roaming.scanInterval);
+        break;
+      }
+      memcpy(roaming.event.from, WiFi.BSSID(), 6);
+      memcpy(roaming.event.to, roaming.bestBssid, 6);
+      roaming.event.rssiBefore = roaming.rssi;
+      roaming.event.duration = now;
+      roaming.state = ROAM_JOINING;
+      WiFi.begin(roamSsid(roaming.bestNetwork), ((roaming.bestNetwork < 0)?roaming.password:roaming.networks[roaming.bestNetwork].password), roaming.bestChannel, roaming.bestBssid);
+      break;
+    }
+    case ROAM_JOINING:
+      if ((WiFi.status() == WL_CONNECTED) || ((now - roaming.event.duration) >= ROAM_JOIN_TIMEOUT)) {
+        roaming.event.duration = (now - roaming.event.duration);
+        roaming.event.rssiAfter = (WiFi.status() == WL_CONNECTED)?WiFi.RSSI():0;
+        roaming.roamLast = roaming.event;
+        roaming.pending = true;
+        roaming.roamed = now;
+        roaming.state = ROAM_IDLE;
+        roaming.scanInterval = ROAM_SCAN_INTERVAL;
+        roaming.scanDue = now;
+        if (roaming.event.rssiAfter) {
+          roaming.rssi = roaming.event.rssiAfter;
+        } else {
+          WiFi.begin(roaming.ssid, roaming.password);
+        }
+      }
+      break;
+  }
+}
+
+/**********************************************************************
+ * Returns true if a roam or failed roam, whose record is in
+ * roaming.roamLast, has not yet been collected, leaving it pending.
+ */
+boolean roamPending() {
+  return(roaming.pending);
+}
+
+/**********************************************************************
+ * Returns true, once, after a roam or failed roam, whose record is in
+ * roaming.roamLast.
+ */
+boolean roamCollect() {
+  boolean retval = roaming.pending;
+
+  roaming.pending = false;
+  return(retval);
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*********************************************************************
+ * NAME
+ *   rtc-store.h - checked records in ESP8266 RTC user memory.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   The ESP8266 has 512 bytes of RTC user memory, organised as 128
+ *   32-bit blocks, which survives a reset (but not a power cycle).
+ *
+ *   A record is stored as a two block header (a magic number and a
+ *   CRC32 of the record data) followed by the record data, so that a
+ *   read can tell whether a record was ever written and is intact.
+ *   Record data must be a whole number of blocks.
+ *
+ *   Block allocations for all modules that use RTC memory are made
+ *   here so that they can be seen to not overlap.
+ */
+
+#ifndef RTC_STORE_H
+#define RTC_STORE_H
+
+#include <Arduino.h>
+
+#define RTC_STORE_MAGIC 0x4D554C54        // "MULT"
+#define RTC_STORE_HEADER_BLOCKS 2
+
+// Block allocations (header included)
+#define RTC_STORE_PULSE_COUNTER_BLOCK 0   // 2 + 4 blocks
+#define RTC_STORE_I2C_BUS_BLOCK 6         // 2 + 4 blocks
+
+uint32_t rtcStoreCrc(const uint8_t *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (size--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return(~crc);
+}
+
+/**********************************************************************
+ * Read the record of <size> bytes at <block> into <data>. Returns
+ * false (leaving <data> in an undefined state) if there is no valid
+ * record.
+ */
+boolean rtcStoreRead(uint32_t block, void *data, size_t size) {
+  uint32_t header[RTC_STORE_HEADER_BLOCKS];
+
+  if (!ESP.rtcUserMemoryRead(block, header, sizeof(header))) return(false);
+  if (header[0] != RTC_STORE_MAGIC) return(false);
+  if (!ESP.rtcUserMemoryRead(block + RTC_STORE_HEADER_BLOCKS, (uint32_t *) data, size)) return(false);
+  return(header[1] == rtcStoreCrc((const uint8_t *) data, size));
+}
+
+/**********************************************************************
+ * Write the <size> bytes at <data> as the record at <block>.
+ */
+boolean rtcStoreWrite(uint32_t block, const void *data, size_t size) {
+  uint32_t header[RTC_STORE_HEADER_BLOCKS] = { RTC_STORE_MAGIC, rtcStoreCrc((const uint8_t *) data, size) };
+
+  if (!ESP.rtcUserMemoryWrite(block + RTC_STORE_HEADER_BLOCKS, (uint32_t *) data, size)) return(false);
+  return(ESP.rtcUserMemoryWrite(block, header, sizeof(header)));
+}
+
+#endif
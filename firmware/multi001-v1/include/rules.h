@@ -0,0 +1,267 @@
+/*********************************************************************
+ * NAME
+ *   rules.h - local rule engine driving named outputs.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Switches outputs (see outputs.h) in response to local signal values
+ *   so that simple actuation does not depend on a round trip through an
+ *   MQTT broker and continues to work when the network is down.
+ *
+ *   Signals are named fixed-point values which the caller keeps up to
+ *   date with ruleSignalSet() as it samples its inputs. Rules are
+ *   compiled once from text and are then evaluated by ruleService() on
+ *   every pass of the main loop.
+ *
+ *   A rule set is a list of rules separated by ';'. Each rule has the
+ *   form:
+ *
+ *     condition [ '&' condition ]... ':' output '=' seconds
+ *
+ *   where a condition has the form "signal op value", op is one of <,
+ *   <=, >, >=, = or != and value is given in the signal's reported
+ *   units (it may have a fractional part). Whitespace is ignored. For
+ *   example:
+ *
+ *     sw0=0&temperature<18.5:relay=600;humidity>=80:relay=0
+ *
+ *   When every condition of a rule becomes true the rule's output is
+ *   switched on. If seconds is zero the output follows the rule and is
+ *   switched off when the rule becomes false; otherwise the output is
+ *   switched off when the rule has been false for the given number of
+ *   seconds. Rules act only on these transitions, so an output switched
+ *   by some other means keeps its state until one of its rules next
+ *   changes. A condition on a signal which has not yet been set is
+ *   false.
+ */
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <Arduino.h>
+#include "outputs.h"
+
+#define RULE_MAX_RULES 8
+#define RULE_MAX_CONDITIONS 3
+
+enum RULE_OPERATOR { RULE_LT, RULE_LE, RULE_GT, RULE_GE, RULE_EQ, RULE_NE };
+
+/**********************************************************************
+ * Structure describing a signal. The first two members are user
+ * configuration; the remainder is maintained by the module.
+ */
+struct RULE_SIGNAL {
+  const char *name;               // Name used in rule text
+  int scale;                      // Fixed-point units per reported unit
+  int32_t value;                  // Most recent value
+  boolean valid;                  // False until a value is set
+};
+
+struct RULE_CONDITION {
+  int8_t signal;                  // Index into signal table
+  RULE_OPERATOR op;
+  int32_t value;                  // Fixed-point comparison value
+};
+
+struct RULE {
+  RULE_CONDITION conditions[RULE_MAX_CONDITIONS];
+  int conditionCount;
+  int output;                     // Index into output table
+  unsigned long duration;         // Milliseconds (0 = follow rule)
+  boolean active;                 // All conditions true at last evaluation
+  boolean timing;                 // Output will be switched off at offAt
+  unsigned long offAt;
+};
+
+RULE_SIGNAL *ruleSignalTable = 0;
+int ruleSignalCount = 0;
+RULE rules[RULE_MAX_RULES];
+int ruleCount = 0;
+
+void ruleBegin(RULE_SIGNAL *signals, int count) {
+  ruleSignalTable = signals;
+  ruleSignalCount = count;
+  for (int i = 0; i < count; i++) signals[i].valid = false;
+  ruleCount = 0;
+}
+
+/**********************************************************************
+ * Set the signal called <name> to the fixed-point <value>. Names which
+ * are not in the signal table are ignored.
+ */
+void ruleSignalSet(const char *name, int32_t value) {
+  for (int i = 0; i < ruleSignalCount; i++) {
+    if (strcmp(ruleSignalTable[i].name, name) == 0) {
+      ruleSignalTable[i].value = value;
+      ruleSignalTable[i].valid = true;
+      return;
+    }
+  }
+}
+
+/**********************************************************************
+ * Mark the signal called <name> as unknown (for example, because its
+ * sensor could not be read) so that conditions on it are false.
+ */
+void ruleSignalInvalidate(const char *name) {
+  for (int i = 0; i < ruleSignalCount; i++) {
+    if (strcmp(ruleSignalTable[i].name, name) == 0) ruleSignalTable[i].valid = false;
+  }
+}
+
+/**********************************************************************
+ * Copy the name starting at <p> into <name> (of <size> bytes) and
+ * return a pointer to the first character after it.
+ */
+const char *ruleParseName(const char *p, char *name, int size) {
+  int n = 0;
+  while ((isalnum(*p)) || (*p == '_') || (*p == '-') || (*p == '.')) {
+    if (n < (size - 1)) name[n++] = *p;
+    p++;
+  }
+  name[n] = 0;
+  return(p);
+}
+
+const char *ruleSkipSpace(const char *p) {
+  while (*p == ' ') p++;
+  return(p);
+}
+
+/**********************************************************************
+ * Compile the rule set <text>, replacing any existing rules. Returns
+ * the number of rules compiled or -1 (and no rules) if <text> contains
+ * an error. Signal and output names must exist in their tables.
+ */
+int ruleCompile(const char *text) {
+  const char *p = text;
+  char name[24];
+  char *end;
+
+  ruleCount = 0;
+  while (*(p = ruleSkipSpace(p))) {
+    if (*p == ';') { p++; continue; }
+    if (ruleCount == RULE_MAX_RULES) return(ruleCount = -1);
+
+    RULE &rule = rules[ruleCount];
+    rule.conditionCount = 0;
+    rule.active = rule.timing = false;
+
+    // Conditions.
+    for (;;) {
+      if (rule.conditionCount == RULE_MAX_CONDITIONS) return(ruleCount = -1);
+      RULE_CONDITION &condition = rule.conditions[rule.conditionCount];
+
+      p = ruleParseName(ruleSkipSpace(p), name, sizeof(name));
+      condition.signal = -1;
+      for (int i = 0; i < ruleSignalCount; i++) {
+        if (strcmp(ruleSignalTable[i].name, name) == 0) condition.signal = i;
+      }
+      if (condition.signal < 0) return(ruleCount = -1);
+
+      p = ruleSkipSpace(p);
+      switch (*p++) {
+        case '<': condition.op = (*p == '=')?RULE_LE:RULE_LT; break;
+        case '>': condition.op = (*p == '=')?RULE_GE:RULE_GT; break;
+        case '=': condition.op = RULE_EQ; break;
+        case '!': condition.op = RULE_NE; if (*p != '=') return(ruleCount = -1); break;
+        default: return(ruleCount = -1);
+      }
+      if (*p == '=') p++;
+
+      p = ruleSkipSpace(p);
+      double value = strtod(p, &end);
+      if (end == p) return(ruleCount = -1);
+      condition.value = (int32_t) round(value * ruleSignalTable[condition.signal].scale);
+      p = ruleSkipSpace(end);
+      rule.conditionCount++;
+      if (*p != '&') break;
+      p++;
+    }
+
+    // Action.
+    if (*p++ != ':') return(ruleCount = -1);
+    p = ruleParseName(ruleSkipSpace(p), name, sizeof(name));
+    if ((rule.output = outputFind(name)) < 0) return(ruleCount = -1);
+    p = ruleSkipSpace(p);
+    if (*p++ != '=') return(ruleCount = -1);
+    p = ruleSkipSpace(p);
+    long seconds = strtol(p, &end, 10);
+    if ((end == p) || (seconds < 0)) return(ruleCount = -1);
+    rule.duration = (seconds * 1000UL);
+    p = ruleSkipSpace(end);
+    if ((*p) && (*p != ';')) return(ruleCount = -1);
+    ruleCount++;
+  }
+  return(ruleCount);
+}
+
+/**********************************************************************
+ * Stop any rule timer which would switch off <output>, so that a state
+ * set by some other means (for example, a remote command) is not
+ * undone when the timer expires.
+ */
+void ruleCancelTimers(int output) {
+  for (int r = 0; r < ruleCount; r++) {
+    if (rules[r].output == output) rules[r].timing = false;
+  }
+}
+
+boolean ruleConditionTrue(RULE_CONDITION &condition) {
+  RULE_SIGNAL &signal = ruleSignalTable[condition.signal];
+
+  if (!signal.valid) return(false);
+  switch (condition.op) {
+    case RULE_LT: return(signal.value < condition.value);
+    case RULE_LE: return(signal.value <= condition.value);
+    case RULE_GT: return(signal.value > condition.value);
+    case RULE_GE: return(signal.value >= condition.value);
+    case RULE_EQ: return(signal.value == condition.value);
+    case RULE_NE: return(signal.value != condition.value);
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Evaluate every rule against the current signal values at <now> and
+ * switch outputs accordingly. Returns true if any rule acted on its
+ * output.
+ */
+boolean ruleService(unsigned long now) {
+  boolean retval = false;
+
+  for (int r = 0; r < ruleCount; r++) {
+    RULE &rule = rules[r];
+    boolean active = true;
+
+    for (int c = 0; c < rule.conditionCount; c++) {
+      if (!ruleConditionTrue(rule.conditions[c])) { active = false; break; }
+    }
+
+    if (active) {
+      if (!rule.active) {
+        outputSet(rule.output, true);
+        retval = true;
+      }
+      // A timed rule holds its output on while it remains true.
+      if (rule.duration) {
+        rule.offAt = (now + rule.duration);
+        rule.timing = true;
+      }
+    } else {
+      if ((rule.active) && (!rule.duration)) {
+        outputSet(rule.output, false);
+        retval = true;
+      }
+      if ((rule.timing) && ((long) (now - rule.offAt) >= 0)) {
+        outputSet(rule.output, false);
+        rule.timing = false;
+        retval = true;
+      }
+    }
+    rule.active = active;
+  }
+  return(retval);
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*********************************************************************
+ * NAME
+ *   sensor-am2320.h - AM2320 humidity/temperature sensor driver.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Sensor registry driver (see sensor-registry.h) for an AM2320 on the
+ *   I2C bus. Besides temperature and relative humidity the driver
+ *   reports the derived psychrometric fields (see psychrometrics.h)
+ *   selected by PSYCHROMETRIC_FIELDS, which defaults to all of them and
+ *   can be overridden with a build flag.
+ *
+ *   The AM232X library reads the device in a single short transaction,
+ *   so a sample completes on the first poll.
+ */
+
+#ifndef SENSOR_AM2320_H
+#define SENSOR_AM2320_H
+
+#include <Arduino.h>
+#include <AM232X.h>
+#include "sensor-registry.h"
+#include "psychrometrics.h"
+
+#define AM2320_STARTUP_DELAY 2000         // Milliseconds
+#define AM2320_INTERVAL 3000              // Milliseconds
+
+// Derived values reported from AM2320 readings
+#define PSYCHROMETRIC_DEWPOINT 0x01
+#define PSYCHROMETRIC_ABSOLUTE_HUMIDITY 0x02
+#define PSYCHROMETRIC_HUMIDEX 0x04
+#ifndef PSYCHROMETRIC_FIELDS
+#define PSYCHROMETRIC_FIELDS (PSYCHROMETRIC_DEWPOINT | PSYCHROMETRIC_ABSOLUTE_HUMIDITY | PSYCHROMETRIC_HUMIDEX)
+#endif
+
+struct AM2320_SENSOR {
+  enum { TEMPERATURE, HUMIDITY, DEWPOINT, ABSOLUTE_HUMIDITY, HUMIDEX };
+
+  static constexpr const char *NAME = "AM2320";
+  static constexpr unsigned long INTERVAL = AM2320_INTERVAL;
+  static constexpr int FIELD_COUNT = 5;
+  static SENSOR_FIELD FIELDS[FIELD_COUNT];
+
+  static AM232X device;
+  static boolean valid;           // Last sample was read successfully
+  static SENSOR_ERROR error;
+  static int32_t t10;             // Temperature in tenths of a degree
+  static int32_t rh10;            // Humidity in tenths of a percent
+
+  static boolean discover() {
+    return(device.begin());
+  }
+
+  static void start() {
+    device.wakeUp();
+    delay(AM2320_STARTUP_DELAY);
+  }
+
+  static boolean poll(unsigned long now) {
+    int status = device.read();
+
+    if ((valid = (status == AM232X_OK))) {
+      t10 = (int32_t) round(device.getTemperature() * 10);
+      rh10 = (int32_t) round(device.getHumidity() * 10);
+    } else if ((status == AM232X_ERROR_CRC_1) || (status == AM232X_ERROR_CRC_2)) {
+      error = SENSOR_ERROR_CRC;
+    } else if ((status == AM232X_HUMIDITY_OUT_OF_RANGE) || (status == AM232X_TEMPERATURE_OUT_OF_RANGE)) {
+      error = SENSOR_ERROR_RANGE;
+    } else {
+      error = SENSOR_ERROR_BUS;
+    }
+    return(true);
+  }
+
+  template <typename Sink>
+  static void collect(Sink &sink) {
+    sink.field(FIELDS[TEMPERATURE], t10, valid);
+    sink.field(FIELDS[HUMIDITY], rh10, valid);
+    if (PSYCHROMETRIC_FIELDS & PSYCHROMETRIC_DEWPOINT) sink.field(FIELDS[DEWPOINT], (valid)?psychrometricDewPoint(t10, rh10):0, valid);
+    if (PSYCHROMETRIC_FIELDS & PSYCHROMETRIC_ABSOLUTE_HUMIDITY) sink.field(FIELDS[ABSOLUTE_HUMIDITY], (valid)?psychrometricAbsoluteHumidity(t10, rh10):0, valid);
+    if (PSYCHROMETRIC_FIELDS & PSYCHROMETRIC_HUMIDEX) sink.field(FIELDS[HUMIDEX], (valid)?psychrometricHumidex(t10, rh10):0, valid);
+  }
+};
+
+SENSOR_FIELD AM2320_SENSOR::FIELDS[AM2320_SENSOR::FIELD_COUNT] = {
+  // name, unit, scale, decimals, { deadband }
+  { "temperature", "C", 10, 0, { 5 } },
+  { "humidity", "%", 10, 0, { 5 } },
+  { "dewpoint", "C", 10, 1, { 5 } },
+  { "absolutehumidity", "g/m3", 100, 2, { 20 } },
+  { "humidex", "C", 10, 1, { 5 } }
+};
+
+AM232X AM2320_SENSOR::device;
+boolean AM2320_SENSOR::valid = false;
+SENSOR_ERROR AM2320_SENSOR::error = SENSOR_ERROR_NONE;
+int32_t AM2320_SENSOR::t10 = 0;
+int32_t AM2320_SENSOR::rh10 = 0;
+
+#endif
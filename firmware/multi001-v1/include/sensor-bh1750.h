@@ -0,0 +1,87 @@
+/*********************************************************************
+ * NAME
+ *   sensor-bh1750.h - BH1750 ambient light sensor driver.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Sensor registry driver (see sensor-registry.h) for a BH1750 at I2C
+ *   address 0x23, found by the boot scan (see i2c-bus.h). The device's
+ *   alternate address (0x5C) is shared with the AM2320 and is not
+ *   probed.
+ *
+ *   Each sample is a one time high resolution measurement, after which
+ *   the device powers down: the first poll starts the measurement and a
+ *   later poll, once the conversion time has passed, reads the result.
+ */
+
+#ifndef SENSOR_BH1750_H
+#define SENSOR_BH1750_H
+
+#include <Arduino.h>
+#include "i2c-bus.h"
+#include "sensor-registry.h"
+
+#define BH1750_ADDRESS 0x23
+#define BH1750_INTERVAL 5000              // Milliseconds
+#define BH1750_CONVERSION_TIME 180        // Milliseconds
+#define BH1750_ONE_TIME_HIGH 0x20
+
+struct BH1750_SENSOR {
+  enum { ILLUMINANCE };
+
+  static constexpr const char *NAME = "BH1750";
+  static constexpr unsigned long INTERVAL = BH1750_INTERVAL;
+  static constexpr int FIELD_COUNT = 1;
+  static SENSOR_FIELD FIELDS[FIELD_COUNT];
+
+  static boolean converting;
+  static unsigned long started;
+  static boolean valid;
+  static SENSOR_ERROR error;
+  static int32_t lux10;           // Tenths of a lux
+
+  static boolean discover() {
+    return(i2cBusPresent(BH1750_ADDRESS));
+  }
+
+  static void start() {
+    converting = false;
+  }
+
+  static boolean poll(unsigned long now) {
+    uint8_t command = BH1750_ONE_TIME_HIGH;
+    uint8_t data[2];
+
+    if (!converting) {
+      converting = i2cBusWrite(BH1750_ADDRESS, &command, 1);
+      started = now;
+      if (converting) return(false);
+      valid = false;
+      error = SENSOR_ERROR_BUS;
+      return(true);
+    }
+    if ((now - started) < BH1750_CONVERSION_TIME) return(false);
+    converting = false;
+    // A count is 1/1.2 lux in high resolution mode.
+    if ((valid = i2cBusRead(BH1750_ADDRESS, data, sizeof(data)))) lux10 = (int32_t) (((((uint32_t) data[0] << 8) | data[1]) * 100UL) / 12UL); else error = SENSOR_ERROR_BUS;
+    return(true);
+  }
+
+  template <typename Sink>
+  static void collect(Sink &sink) {
+    sink.field(FIELDS[ILLUMINANCE], lux10, valid);
+  }
+};
+
+SENSOR_FIELD BH1750_SENSOR::FIELDS[BH1750_SENSOR::FIELD_COUNT] = {
+  // name, unit, scale, decimals, { deadband }
+  { "illuminance", "lx", 10, 0, { 50 } }
+};
+
+boolean BH1750_SENSOR::converting = false;
+unsigned long BH1750_SENSOR::started = 0UL;
+boolean BH1750_SENSOR::valid = false;
+SENSOR_ERROR BH1750_SENSOR::error = SENSOR_ERROR_NONE;
+int32_t BH1750_SENSOR::lux10 = 0;
+
+#endif
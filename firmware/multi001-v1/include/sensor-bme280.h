@@ -0,0 +1,198 @@
+/*********************************************************************
+ * NAME
+ *   sensor-bme280.h - BME280 pressure/humidity/temperature driver.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Sensor registry driver (see sensor-registry.h) for a Bosch BME280
+ *   at I2C address 0x76 or 0x77, found by the boot scan (see
+ *   i2c-bus.h) and confirmed by its chip id.
+ *
+ *   The device sleeps between samples. Each sample is a forced mode
+ *   measurement with x1 oversampling: the first poll starts the
+ *   measurement and a later poll, once the conversion time has passed,
+ *   reads the result. Readings are compensated with the integer
+ *   formulae from the Bosch datasheet.
+ */
+
+#ifndef SENSOR_BME280_H
+#define SENSOR_BME280_H
+
+#include <Arduino.h>
+#include "i2c-bus.h"
+#include "sensor-registry.h"
+
+#define BME280_INTERVAL 5000              // Milliseconds
+#define BME280_CONVERSION_TIME 12         // Milliseconds
+#define BME280_CHIP_ID 0x60
+
+#define BME280_REG_CALIBRATION_0 0x88     // 26 bytes
+#define BME280_REG_CHIP_ID 0xD0
+#define BME280_REG_CALIBRATION_1 0xE1     // 7 bytes
+#define BME280_REG_CTRL_HUM 0xF2
+#define BME280_REG_CTRL_MEAS 0xF4
+#define BME280_REG_DATA 0xF7              // 8 bytes
+#define BME280_CTRL_HUM_X1 0x01
+#define BME280_CTRL_MEAS_FORCED_X1 0x25
+
+struct BME280_CALIBRATION {
+  uint16_t t1; int16_t t2, t3;
+  uint16_t p1; int16_t p2, p3, p4, p5, p6, p7, p8, p9;
+  uint8_t h1; int16_t h2; uint8_t h3; int16_t h4, h5; int8_t h6;
+};
+
+struct BME280_SENSOR {
+  enum { TEMPERATURE, HUMIDITY, PRESSURE };
+
+  static constexpr const char *NAME = "BME280";
+  static constexpr unsigned long INTERVAL = BME280_INTERVAL;
+  static constexpr int FIELD_COUNT = 3;
+  static SENSOR_FIELD FIELDS[FIELD_COUNT];
+
+  static uint8_t address;
+  static BME280_CALIBRATION cal;
+  static boolean calibrated;      // cal read and ctrl_hum set
+  static boolean converting;
+  static unsigned long started;
+  static boolean valid;
+  static SENSOR_ERROR error;
+  static int32_t t100;            // Hundredths of a degree
+  static int32_t rh100;           // Hundredths of a percent
+  static int32_t pressure;        // Pascals
+
+  static boolean discover() {
+    uint8_t id;
+    const uint8_t candidates[] = { 0x76, 0x77 };
+
+    for (unsigned int i = 0; i < sizeof(candidates); i++) {
+      if ((i2cBusPresent(candidates[i])) && (i2cBusReadRegisters(candidates[i], BME280_REG_CHIP_ID, &id, 1)) && (id == BME280_CHIP_ID)) {
+        address = candidates[i];
+        return(true);
+      }
+    }
+    return(false);
+  }
+
+  static int16_t le16(const uint8_t *p) {
+    return((int16_t) (p[0] | ((uint16_t) p[1] << 8)));
+  }
+
+  static void start() {
+    uint8_t c[26], e[7];
+
+    converting = false;
+    valid = false;
+    calibrated = false;
+    if ((!i2cBusReadRegisters(address, BME280_REG_CALIBRATION_0, c, sizeof(c))) || (!i2cBusReadRegisters(address, BME280_REG_CALIBRATION_1, e, sizeof(e)))) return;
+    cal.t1 = (uint16_t) le16(c); cal.t2 = le16(c + 2); cal.t3 = le16(c + 4);
+    cal.p1 = (uint16_t) le16(c + 6); cal.p2 = le16(c + 8); cal.p3 = le16(c + 10);
+    cal.p4 = le16(c + 12); cal.p5 = le16(c + 14); cal.p6 = le16(c + 16);
+    cal.p7 = le16(c + 18); cal.p8 = le16(c + 20); cal.p9 = le16(c + 22);
+    cal.h1 = c[25];
+    cal.h2 = le16(e); cal.h3 = e[2];
+    cal.h4 = (int16_t) (((int16_t) (int8_t) e[3] << 4) | (e[4] & 0x0F));
+    cal.h5 = (int16_t) (((int16_t) (int8_t) e[5] << 4) | (e[4] >> 4));
+    cal.h6 = (int8_t) e[6];
+    calibrated = i2cBusWriteRegister(address, BME280_REG_CTRL_HUM, BME280_CTRL_HUM_X1);
+  }
+
+  static boolean poll(unsigned long now) {
+    uint8_t d[8];
+
+    // Nothing can be computed without calibration, which is retried on
+    // each sample until it succeeds.
+    if (!calibrated) start();
+    if (!calibrated) {
+      valid = false;
+      error = SENSOR_ERROR_BUS;
+      return(true);
+    }
+    if (!converting) {
+      // Writing ctrl_meas also latches ctrl_hum.
+      converting = i2cBusWriteRegister(address, BME280_REG_CTRL_MEAS, BME280_CTRL_MEAS_FORCED_X1);
+      started = now;
+      if (converting) return(false);
+      valid = false;
+      error = SENSOR_ERROR_BUS;
+      return(true);
+    }
+    if ((now - started) < BME280_CONVERSION_TIME) return(false);
+    converting = false;
+    if (!(valid = i2cBusReadRegisters(address, BME280_REG_DATA, d, sizeof(d)))) {
+      error = SENSOR_ERROR_BUS;
+      return(true);
+    }
+
+    int32_t adcP = ((int32_t) d[0] << 12) | ((int32_t) d[1] << 4) | (d[2] >> 4);
+    int32_t adcT = ((int32_t) d[3] << 12) | ((int32_t) d[4] << 4) | (d[5] >> 4);
+    int32_t adcH = ((int32_t) d[6] << 8) | d[7];
+    int32_t tFine = compensateTemperature(adcT);
+    t100 = ((tFine * 5) + 128) >> 8;
+    pressure = (int32_t) (compensatePressure(adcP, tFine) >> 8);
+    rh100 = (int32_t) (((compensateHumidity(adcH, tFine) * 100) >> 10));
+    return(true);
+  }
+
+  static int32_t compensateTemperature(int32_t adcT) {
+    int32_t var1 = ((((adcT >> 3) - ((int32_t) cal.t1 << 1))) * ((int32_t) cal.t2)) >> 11;
+    int32_t var2 = (((((adcT >> 4) - ((int32_t) cal.t1)) * ((adcT >> 4) - ((int32_t) cal.t1))) >> 12) * ((int32_t) cal.t3)) >> 14;
+    return(var1 + var2);
+  }
+
+  // Pascals in Q24.8.
+  static uint32_t compensatePressure(int32_t adcP, int32_t tFine) {
+    int64_t var1 = ((int64_t) tFine) - 128000;
+    int64_t var2 = var1 * var1 * (int64_t) cal.p6;
+    int64_t p;
+
+    var2 = var2 + ((var1 * (int64_t) cal.p5) << 17);
+    var2 = var2 + (((int64_t) cal.p4) << 35);
+    var1 = ((var1 * var1 * (int64_t) cal.p3) >> 8) + ((var1 * (int64_t) cal.p2) << 12);
+    var1 = (((((int64_t) 1) << 47) + var1)) * ((int64_t) cal.p1) >> 33;
+    if (var1 == 0) return(0);
+    p = 1048576 - adcP;
+    p = (((p << 31) - var2) * 3125) / var1;
+    var1 = (((int64_t) cal.p9) * (p >> 13) * (p >> 13)) >> 25;
+    var2 = (((int64_t) cal.p8) * p) >> 19;
+    p = ((p + var1 + var2) >> 8) + (((int64_t) cal.p7) << 4);
+    return((uint32_t) p);
+  }
+
+  // Percent in Q22.10.
+  static uint32_t compensateHumidity(int32_t adcH, int32_t tFine) {
+    int32_t v = (tFine - ((int32_t) 76800));
+
+    v = (((((adcH << 14) - (((int32_t) cal.h4) << 20) - (((int32_t) cal.h5) * v)) + ((int32_t) 16384)) >> 15) * (((((((v * ((int32_t) cal.h6)) >> 10) * (((v * ((int32_t) cal.h3)) >> 11) + ((int32_t) 32768))) >> 10) + ((int32_t) 2097152)) * ((int32_t) cal.h2) + 8192) >> 14));
+    v = (v - (((((v >> 15) * (v >> 15)) >> 7) * ((int32_t) cal.h1)) >> 4));
+    v = (v < 0)?0:v;
+    v = (v > 419430400)?419430400:v;
+    return((uint32_t) (v >> 12));
+  }
+
+  template <typename Sink>
+  static void collect(Sink &sink) {
+    sink.field(FIELDS[TEMPERATURE], t100, valid);
+    sink.field(FIELDS[HUMIDITY], rh100, valid);
+    sink.field(FIELDS[PRESSURE], pressure, valid);
+  }
+};
+
+SENSOR_FIELD BME280_SENSOR::FIELDS[BME280_SENSOR::FIELD_COUNT] = {
+  // name, unit, scale, decimals, { deadband }
+  { "bme280-temperature", "C", 100, 1, { 10 } },
+  { "bme280-humidity", "%", 100, 1, { 50 } },
+  { "bme280-pressure", "hPa", 100, 1, { 10 } }
+};
+
+uint8_t BME280_SENSOR::address = 0x76;
+BME280_CALIBRATION BME280_SENSOR::cal;
+boolean BME280_SENSOR::calibrated = false;
+boolean BME280_SENSOR::converting = false;
+unsigned long BME280_SENSOR::started = 0UL;
+boolean BME280_SENSOR::valid = false;
+SENSOR_ERROR BME280_SENSOR::error = SENSOR_ERROR_NONE;
+int32_t BME280_SENSOR::t100 = 0;
+int32_t BME280_SENSOR::rh100 = 0;
+int32_t BME280_SENSOR::pressure = 0;
+
+#endif
@@ -0,0 +1,110 @@
+/*********************************************************************
+ * NAME
+ *   sensor-health.h - per-sensor health record and circuit breaker.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Tracks the health of a single sensor from the outcome of each of
+ *   its samples: the number of consecutive failures, when it last gave
+ *   a good reading and the class of its most recent error.
+ *
+ *   A sensor is OK while its samples succeed and DEGRADED after a
+ *   failure. After SENSOR_HEALTH_TRIP_FAILURES consecutive failures it
+ *   is FAILED and its circuit breaker opens: the sensor is not sampled
+ *   again until a backoff period has passed, which starts at the
+ *   sensor's sample interval and doubles with each further failure up
+ *   to SENSOR_HEALTH_MAX_BACKOFF. The sample made when the backoff
+ *   expires is a trial; success closes the breaker, so a sensor which
+ *   is reconnected returns to service by itself, while a dead sensor
+ *   costs one attempt per backoff period rather than one per interval.
+ */
+
+#ifndef SENSOR_HEALTH_H
+#define SENSOR_HEALTH_H
+
+#include <Arduino.h>
+
+#define SENSOR_HEALTH_TRIP_FAILURES 3     // Consecutive failures opening breaker
+#define SENSOR_HEALTH_MAX_BACKOFF 300000UL // Milliseconds
+
+enum SENSOR_ERROR { SENSOR_ERROR_NONE, SENSOR_ERROR_BUS, SENSOR_ERROR_CRC, SENSOR_ERROR_RANGE, SENSOR_ERROR_RESET };
+enum SENSOR_STATE { SENSOR_STATE_OK, SENSOR_STATE_DEGRADED, SENSOR_STATE_FAILED };
+
+const char *SENSOR_ERROR_NAMES[] = { "none", "bus", "crc", "range", "reset" };
+const char *SENSOR_STATE_NAMES[] = { "ok", "degraded", "failed" };
+
+/**********************************************************************
+ * Structure describing the health of a sensor. All members are
+ * maintained by the module.
+ */
+struct SENSOR_HEALTH {
+  uint16_t failures;              // Consecutive failed samples
+  unsigned long lastGood;         // Millis of last good sample
+  SENSOR_ERROR error;             // Class of most recent failure
+  unsigned long retryAt;          // Millis at which an open breaker allows a trial
+  boolean changed;                // Changed since last collection
+};
+
+void sensorHealthBegin(SENSOR_HEALTH &health) {
+  health.failures = 0;
+  health.lastGood = 0UL;
+  health.error = SENSOR_ERROR_NONE;
+  health.retryAt = 0UL;
+  health.changed = false;
+}
+
+SENSOR_STATE sensorHealthState(SENSOR_HEALTH &health) {
+  if (health.failures == 0) return(SENSOR_STATE_OK);
+  return((health.failures < SENSOR_HEALTH_TRIP_FAILURES)?SENSOR_STATE_DEGRADED:SENSOR_STATE_FAILED);
+}
+
+/**********************************************************************
+ * Return true if the sensor may be sampled at <now>, i.e. unless its
+ * breaker is open and the backoff has not expired.
+ */
+boolean sensorHealthAllow(SENSOR_HEALTH &health, unsigned long now) {
+  return((health.failures < SENSOR_HEALTH_TRIP_FAILURES) || ((long) (now - health.retryAt) >= 0));
+}
+
+void sensorHealthSuccess(SENSOR_HEALTH &health, unsigned long now) {
+  if (health.failures) health.changed = true;
+  health.failures = 0;
+  health.error = SENSOR_ERROR_NONE;
+  health.lastGood = now;
+}
+
+/**********************************************************************
+ * Record a failed sample of class <error> at <now> for a sensor
+ * normally sampled every <interval> milliseconds.
+ */
+void sensorHealthFailure(SENSOR_HEALTH &health, SENSOR_ERROR error, unsigned long now, unsigned long interval) {
+  unsigned long backoff = interval;
+
+  if (health.failures < 0xFFFF) health.failures++;
+  health.error = error;
+  health.changed = true;
+  if (health.failures >= SENSOR_HEALTH_TRIP_FAILURES) {
+    for (uint16_t i = SENSOR_HEALTH_TRIP_FAILURES; (i < health.failures) && (backoff < SENSOR_HEALTH_MAX_BACKOFF); i++) backoff <<= 1;
+    health.retryAt = (now + min(backoff, SENSOR_HEALTH_MAX_BACKOFF));
+  }
+}
+
+/**********************************************************************
+ * Return true if <health> has changed since the last call and clear
+ * the flag.
+ */
+boolean sensorHealthCollect(SENSOR_HEALTH &health) {
+  boolean retval = health.changed;
+  health.changed = false;
+  return(retval);
+}
+
+const char *sensorHealthStateName(SENSOR_HEALTH &health) {
+  return(SENSOR_STATE_NAMES[sensorHealthState(health)]);
+}
+
+const char *sensorHealthErrorName(SENSOR_HEALTH &health) {
+  return(SENSOR_ERROR_NAMES[health.error]);
+}
+
+#endif
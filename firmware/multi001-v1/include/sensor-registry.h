@@ -0,0 +1,175 @@
+/*********************************************************************
+ * NAME
+ *   sensor-registry.h - compile-time registry of sensor drivers.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Gives sensors with a fixed set of fields a common driver interface
+ *   and collects the drivers built into the firmware into a registry
+ *   whose every operation is expanded at compile time, so there is no
+ *   virtual call, function pointer or heap allocation involved.
+ *
+ *   A driver is a struct with only static members:
+ *
+ *     NAME        Device name (const char *).
+ *     INTERVAL    Milliseconds between samples (unsigned long).
+ *     FIELDS      Array of SENSOR_FIELD declaring the fields the
+ *                 driver reports, their units and scaling.
+ *     FIELD_COUNT Number of entries in FIELDS.
+ *     discover()  Probe for the device and return true if present.
+ *     start()     Prepare a discovered device for sampling.
+ *     poll(now)   Progress a sample without blocking and return true
+ *                 when one has completed (successfully or not). This
+ *                 is called on every pass once INTERVAL has elapsed
+ *                 since the last completed sample.
+ *     collect(s)  Pass the fields of the completed sample to the sink
+ *                 <s> by calling s.field(field, value, valid) once for
+ *                 each field, where value is fixed-point.
+ *     valid       True if the last completed sample succeeded.
+ *     error       SENSOR_ERROR class of the last failed sample.
+ *
+ *   SENSOR_REGISTRY<Drivers...> then provides begin(), which discovers
+ *   and starts every driver, and service(), which polls every present
+ *   driver that is due and hands completed samples to a sink. The
+ *   registry keeps a health record for every driver (see
+ *   sensor-health.h) whose circuit breaker postpones the sampling of a
+ *   failed sensor, and calls s.health(name, health) on the sink when
+ *   a driver's health changes. A new
+ *   sensor is added by writing its driver and adding it to the list of
+ *   drivers; the main loop need not change.
+ *
+ *   Field values are fixed-point integers in units of 1/scale of the
+ *   reported unit. Each field carries a deadband (see deadband.h) which
+ *   sinks can use for change detection.
+ */
+
+#ifndef SENSOR_REGISTRY_H
+#define SENSOR_REGISTRY_H
+
+#include <Arduino.h>
+#include "deadband.h"
+#include "sensor-health.h"
+
+/**********************************************************************
+ * Structure describing a sensor field. The first five members are
+ * driver configuration; the remainder is maintained by the sink.
+ */
+struct SENSOR_FIELD {
+  const char *name;               // Property name in output message
+  const char *unit;               // Reported unit
+  int scale;                      // Fixed-point units per reported unit
+  int decimals;                   // Decimal places in reported value
+  DEADBAND deadband;              // Change detection (deadband only)
+};
+
+/**********************************************************************
+ * Per-driver state maintained by the registry.
+ */
+template <typename Driver>
+struct SENSOR_SLOT {
+  static boolean present;         // Driver discovered its device
+  static unsigned long deadline;  // Millis at which next sample is due
+  static SENSOR_HEALTH health;
+};
+
+template <typename Driver> boolean SENSOR_SLOT<Driver>::present = false;
+template <typename Driver> unsigned long SENSOR_SLOT<Driver>::deadline = 0UL;
+template <typename Driver> SENSOR_HEALTH SENSOR_SLOT<Driver>::health = { 0, 0UL, SENSOR_ERROR_NONE, 0UL, false };
+
+/**********************************************************************
+ * Driver which never discovers a device. Use it to terminate a driver
+ * list whose other entries are conditional.
+ */
+struct SENSOR_NONE {
+  static constexpr const char *NAME = "none";
+  static constexpr unsigned long INTERVAL = 0UL;
+  static constexpr int FIELD_COUNT = 0;
+  static SENSOR_FIELD *FIELDS;
+  static constexpr boolean valid = false;
+  static constexpr SENSOR_ERROR error = SENSOR_ERROR_NONE;
+  static boolean discover() { return(false); }
+  static void start() { }
+  static boolean poll(unsigned long now) { return(false); }
+  template <typename Sink> static void collect(Sink &sink) { }
+};
+
+SENSOR_FIELD *SENSOR_NONE::FIELDS = 0;
+
+/**********************************************************************
+ * Return the reported value of fixed-point <value> of <field>.
+ */
+double sensorFieldValue(SENSOR_FIELD &field, int32_t value) {
+  double factor = 1.0;
+  for (int i = 0; i < field.decimals; i++) factor *= 10.0;
+  return(round(((double) value * factor) / field.scale) / factor);
+}
+
+/**********************************************************************
+ * Print a one line description of <Driver> (name, fields with units
+ * and sample interval) to <out>.
+ */
+template <typename Driver>
+void sensorDriverDescribe(Print &out) {
+  out.print(Driver::NAME);
+  out.print("(");
+  for (int i = 0; i < Driver::FIELD_COUNT; i++) {
+    if (i) out.print(", ");
+    out.print(Driver::FIELDS[i].name);
+    out.print("/");
+    out.print(Driver::FIELDS[i].unit);
+  }
+  out.print(" every ");
+  out.print(Driver::INTERVAL);
+  out.print("ms) ");
+}
+
+template <typename Driver>
+boolean sensorDriverBegin(Print &out) {
+  if ((SENSOR_SLOT<Driver>::present = Driver::discover())) {
+    Driver::start();
+    sensorDriverDescribe<Driver>(out);
+  }
+  return(SENSOR_SLOT<Driver>::present);
+}
+
+template <typename Driver, typename Sink>
+boolean sensorDriverService(unsigned long now, Sink &sink) {
+  SENSOR_HEALTH &health = SENSOR_SLOT<Driver>::health;
+
+  if (!SENSOR_SLOT<Driver>::present) return(false);
+  if ((long) (now - SENSOR_SLOT<Driver>::deadline) < 0) return(false);
+  if (!Driver::poll(now)) return(false);
+  if (Driver::valid) sensorHealthSuccess(health, now); else sensorHealthFailure(health, Driver::error, now, Driver::INTERVAL);
+  SENSOR_SLOT<Driver>::deadline = (sensorHealthAllow(health, now + Driver::INTERVAL))?(now + Driver::INTERVAL):health.retryAt;
+  Driver::collect(sink);
+  if (sensorHealthCollect(health)) sink.health(Driver::NAME, health);
+  return(true);
+}
+
+template <typename... Drivers>
+struct SENSOR_REGISTRY {
+
+  /********************************************************************
+   * Discover and start every driver, describing those present on
+   * <out>. Returns the number of drivers present.
+   */
+  static int begin(Print &out) {
+    return((0 + ... + (int) sensorDriverBegin<Drivers>(out)));
+  }
+
+  /********************************************************************
+   * Poll every present driver which is due at <now> and pass completed
+   * samples to <sink>. Returns true if any sample completed.
+   */
+  template <typename Sink>
+  static boolean service(unsigned long now, Sink &sink) {
+    return((false | ... | sensorDriverService<Drivers>(now, sink)));
+  }
+
+  template <typename Driver>
+  static boolean present() {
+    return(SENSOR_SLOT<Driver>::present);
+  }
+};
+
+#endif
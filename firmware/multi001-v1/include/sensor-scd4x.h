@@ -0,0 +1,133 @@
+/*********************************************************************
+ * NAME
+ *   sensor-scd4x.h - SCD40/SCD41 CO2 sensor driver.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Sensor registry driver (see sensor-registry.h) for a Sensirion
+ *   SCD40 or SCD41 at I2C address 0x62, found by the boot scan (see
+ *   i2c-bus.h).
+ *
+ *   The device runs in periodic measurement mode and produces a sample
+ *   every five seconds by itself. A poll asks whether a sample is
+ *   ready and, if it is, fetches it; each command and the read of its
+ *   response are made on separate polls so that the bus is never held
+ *   for the command execution time. The device is stopped and restarted
+ *   on boot because a warm boot may leave it already measuring, in
+ *   which state it ignores the start command.
+ */
+
+#ifndef SENSOR_SCD4X_H
+#define SENSOR_SCD4X_H
+
+#include <Arduino.h>
+#include "i2c-bus.h"
+#include "sensor-registry.h"
+
+#define SCD4X_ADDRESS 0x62
+#define SCD4X_INTERVAL 5000               // Milliseconds
+#define SCD4X_STOP_TIME 500               // Milliseconds
+#define SCD4X_COMMAND_TIME 2              // Milliseconds
+#define SCD4X_RETRY_INTERVAL 250          // Milliseconds between ready checks
+
+#define SCD4X_START_PERIODIC 0x21B1
+#define SCD4X_READ_MEASUREMENT 0xEC05
+#define SCD4X_STOP_PERIODIC 0x3F86
+#define SCD4X_GET_DATA_READY 0xE4B8
+
+struct SCD4X_SENSOR {
+  enum { CO2, TEMPERATURE, HUMIDITY };
+  enum { IDLE, READY_REQUESTED, MEASUREMENT_REQUESTED };
+
+  static constexpr const char *NAME = "SCD4x";
+  static constexpr unsigned long INTERVAL = SCD4X_INTERVAL;
+  static constexpr int FIELD_COUNT = 3;
+  static SENSOR_FIELD FIELDS[FIELD_COUNT];
+
+  static int state;
+  static unsigned long started;   // Millis of last command
+  static boolean valid;
+  static SENSOR_ERROR error;
+  static int32_t co2;             // Parts per million
+  static int32_t t100;            // Hundredths of a degree
+  static int32_t rh100;           // Hundredths of a percent
+
+  static boolean discover() {
+    return(i2cBusPresent(SCD4X_ADDRESS));
+  }
+
+  static void start() {
+    i2cBusCommand(SCD4X_ADDRESS, SCD4X_STOP_PERIODIC);
+    delay(SCD4X_STOP_TIME);
+    i2cBusCommand(SCD4X_ADDRESS, SCD4X_START_PERIODIC);
+    state = IDLE;
+    started = millis();
+  }
+
+  static boolean poll(unsigned long now) {
+    uint8_t data[9];
+    uint16_t word, rawT, rawRH;
+
+    switch (state) {
+      case IDLE:
+        if ((now - started) < SCD4X_RETRY_INTERVAL) return(false);
+        if (!i2cBusCommand(SCD4X_ADDRESS, SCD4X_GET_DATA_READY)) break;
+        state = READY_REQUESTED;
+        started = now;
+        return(false);
+      case READY_REQUESTED:
+        if ((now - started) < SCD4X_COMMAND_TIME) return(false);
+        if (!i2cBusRead(SCD4X_ADDRESS, data, 3)) break;
+        state = IDLE;
+        started = now;
+        if ((!i2cBusSensirionWord(data, word)) || ((word & 0x07FF) == 0)) return(false);
+        if (!i2cBusCommand(SCD4X_ADDRESS, SCD4X_READ_MEASUREMENT)) break;
+        state = MEASUREMENT_REQUESTED;
+        return(false);
+      case MEASUREMENT_REQUESTED:
+        if ((now - started) < SCD4X_COMMAND_TIME) return(false);
+        state = IDLE;
+        started = now;
+        valid = false;
+        if (!i2cBusRead(SCD4X_ADDRESS, data, sizeof(data))) error = SENSOR_ERROR_BUS;
+        else if ((!i2cBusSensirionWord(data, word)) || (!i2cBusSensirionWord(data + 3, rawT)) || (!i2cBusSensirionWord(data + 6, rawRH))) error = SENSOR_ERROR_CRC;
+        else valid = true;
+        if (valid) {
+          co2 = (int32_t) word;
+          t100 = (int32_t) (((17500L * (int32_t) rawT) / 65535L) - 4500L);
+          rh100 = (int32_t) ((10000L * (int32_t) rawRH) / 65535L);
+        }
+        return(true);
+    }
+    // A failed transfer ends the sample.
+    state = IDLE;
+    started = now;
+    valid = false;
+    error = SENSOR_ERROR_BUS;
+    return(true);
+  }
+
+  template <typename Sink>
+  static void collect(Sink &sink) {
+    sink.field(FIELDS[CO2], co2, valid);
+    sink.field(FIELDS[TEMPERATURE], t100, valid);
+    sink.field(FIELDS[HUMIDITY], rh100, valid);
+  }
+};
+
+SENSOR_FIELD SCD4X_SENSOR::FIELDS[SCD4X_SENSOR::FIELD_COUNT] = {
+  // name, unit, scale, decimals, { deadband }
+  { "scd4x-co2", "ppm", 1, 0, { 20 } },
+  { "scd4x-temperature", "C", 100, 1, { 10 } },
+  { "scd4x-humidity", "%", 100, 1, { 50 } }
+};
+
+int SCD4X_SENSOR::state = SCD4X_SENSOR::IDLE;
+unsigned long SCD4X_SENSOR::started = 0UL;
+boolean SCD4X_SENSOR::valid = false;
+SENSOR_ERROR SCD4X_SENSOR::error = SENSOR_ERROR_NONE;
+int32_t SCD4X_SENSOR::co2 = 0;
+int32_t SCD4X_SENSOR::t100 = 0;
+int32_t SCD4X_SENSOR::rh100 = 0;
+
+#endif
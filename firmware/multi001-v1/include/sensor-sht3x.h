@@ -0,0 +1,99 @@
+/*********************************************************************
+ * NAME
+ *   sensor-sht3x.h - SHT3x humidity/temperature sensor driver.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Sensor registry driver (see sensor-registry.h) for a Sensirion
+ *   SHT30/31/35 at I2C address 0x44 or 0x45, found by the boot scan
+ *   (see i2c-bus.h).
+ *
+ *   Each sample is a high repeatability single shot measurement without
+ *   clock stretching: the first poll starts the measurement and a later
+ *   poll, once the conversion time has passed, reads the result, so the
+ *   bus is never held while the device converts.
+ */
+
+#ifndef SENSOR_SHT3X_H
+#define SENSOR_SHT3X_H
+
+#include <Arduino.h>
+#include "i2c-bus.h"
+#include "sensor-registry.h"
+
+#define SHT3X_INTERVAL 5000               // Milliseconds
+#define SHT3X_CONVERSION_TIME 16          // Milliseconds
+#define SHT3X_MEASURE_HIGH 0x2400         // Single shot, no clock stretching
+
+struct SHT3X_SENSOR {
+  enum { TEMPERATURE, HUMIDITY };
+
+  static constexpr const char *NAME = "SHT3x";
+  static constexpr unsigned long INTERVAL = SHT3X_INTERVAL;
+  static constexpr int FIELD_COUNT = 2;
+  static SENSOR_FIELD FIELDS[FIELD_COUNT];
+
+  static uint8_t address;
+  static boolean converting;      // Measurement started
+  static unsigned long started;   // Millis at which it started
+  static boolean valid;
+  static SENSOR_ERROR error;
+  static int32_t t100;            // Hundredths of a degree
+  static int32_t rh100;           // Hundredths of a percent
+
+  static boolean discover() {
+    if (i2cBusPresent(0x44)) address = 0x44; else if (i2cBusPresent(0x45)) address = 0x45; else return(false);
+    return(true);
+  }
+
+  static void start() {
+    converting = false;
+  }
+
+  static boolean poll(unsigned long now) {
+    uint8_t data[6];
+    uint16_t rawT, rawRH;
+
+    if (!converting) {
+      converting = i2cBusCommand(address, SHT3X_MEASURE_HIGH);
+      started = now;
+      if (converting) return(false);
+      valid = false;
+      error = SENSOR_ERROR_BUS;
+      return(true);
+    }
+    if ((now - started) < SHT3X_CONVERSION_TIME) return(false);
+    converting = false;
+    valid = false;
+    if (!i2cBusRead(address, data, sizeof(data))) error = SENSOR_ERROR_BUS;
+    else if ((!i2cBusSensirionWord(data, rawT)) || (!i2cBusSensirionWord(data + 3, rawRH))) error = SENSOR_ERROR_CRC;
+    else valid = true;
+    if (valid) {
+      t100 = (int32_t) (((17500L * (int32_t) rawT) / 65535L) - 4500L);
+      rh100 = (int32_t) ((10000L * (int32_t) rawRH) / 65535L);
+    }
+    return(true);
+  }
+
+  template <typename Sink>
+  static void collect(Sink &sink) {
+    sink.field(FIELDS[TEMPERATURE], t100, valid);
+    sink.field(FIELDS[HUMIDITY], rh100, valid);
+  }
+};
+
+SENSOR_FIELD SHT3X_SENSOR::FIELDS[SHT3X_SENSOR::FIELD_COUNT] = {
+  // name, unit, scale, decimals, { deadband }
+  { "sht3x-temperature", "C", 100, 1, { 10 } },
+  { "sht3x-humidity", "%", 100, 1, { 50 } }
+};
+
+uint8_t SHT3X_SENSOR::address = 0x44;
+boolean SHT3X_SENSOR::converting = false;
+unsigned long SHT3X_SENSOR::started = 0UL;
+boolean SHT3X_SENSOR::valid = false;
+SENSOR_ERROR SHT3X_SENSOR::error = SENSOR_ERROR_NONE;
+int32_t SHT3X_SENSOR::t100 = 0;
+int32_t SHT3X_SENSOR::rh100 = 0;
+
+#endif
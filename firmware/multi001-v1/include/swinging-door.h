@@ -0,0 +1,128 @@
+/*********************************************************************
+ * NAME
+ *   swinging-door.h - swinging door trend compression.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DESCRIPTION
+ *   Decides which samples of a slowly varying fixed-point field must be
+ *   published so that a consumer, joining published points with
+ *   straight lines, can rebuild the signal to within a fixed error
+ *   tolerance.
+ *
+ *   Starting from the last published (archived) point, two "doors" are
+ *   hinged at the archived point. Each new sample narrows the doors to
+ *   the tightest slopes that keep every sample since the archived point
+ *   within tolerance of a line from the archived point. When the line
+ *   from the archived point to a new sample falls outside the doors no
+ *   line to it can represent the intervening samples, so the previous
+ *   sample (whose line was inside the doors) is archived (published)
+ *   and the doors are re-hung from it. The reconstruction error is
+ *   therefore never more than the tolerance.
+ *
+ *   A point is also archived if maxSilence milliseconds have passed
+ *   since the last archived point, so that consumers can tell a flat
+ *   signal from a dead node.
+ *
+ *   Slopes are held as exact (change, interval) pairs and compared by
+ *   cross-multiplication, so no floating point is involved.
+ *
+ *   Because the archived point is usually the sample before the one
+ *   being processed, each archived point carries its own timestamp.
+ */
+
+#ifndef SWINGING_DOOR_H
+#define SWINGING_DOOR_H
+
+#include <Arduino.h>
+
+struct SWINGING_DOOR {
+  int32_t tolerance;              // Maximum reconstruction error
+  unsigned long maxSilence;       // Maximum milliseconds between points
+  boolean started;                // An archived point exists
+  boolean hung;                   // Doors have been hung from archived point
+  int32_t archivedValue;          // Last archived point
+  unsigned long archivedTime;
+  int32_t lastValue;              // Most recent sample
+  unsigned long lastTime;
+  int64_t upperChange;            // Upper door slope (change / interval)
+  int64_t upperInterval;
+  int64_t lowerChange;            // Lower door slope (change / interval)
+  int64_t lowerInterval;
+  int32_t outputValue;            // Point to publish after a true return
+  unsigned long outputTime;
+};
+
+/**********************************************************************
+ * Return true if slope a/b is less than slope c/d (b, d > 0).
+ */
+boolean swingingDoorLess(int64_t a, int64_t b, int64_t c, int64_t d) {
+  return((a * d) < (c * b));
+}
+
+/**********************************************************************
+ * Make the point <value> at <time> the archived point of <door>. The
+ * doors are hung again by the next sample.
+ */
+void swingingDoorArchive(SWINGING_DOOR &door, int32_t value, unsigned long time) {
+  door.archivedValue = door.outputValue = value;
+  door.archivedTime = door.outputTime = time;
+  door.hung = false;
+}
+
+/**********************************************************************
+ * Narrow the doors of <door> so that they admit the sample <value> at
+ * <time>, or hang them from the archived point if this is the first
+ * sample since it.
+ */
+void swingingDoorNarrow(SWINGING_DOOR &door, int32_t value, unsigned long time) {
+  int64_t interval = (int64_t) (time - door.archivedTime);
+  int64_t upper = ((int64_t) value + door.tolerance - door.archivedValue);
+  int64_t lower = ((int64_t) value - door.tolerance - door.archivedValue);
+
+  if ((!door.hung) || (swingingDoorLess(upper, interval, door.upperChange, door.upperInterval))) {
+    door.upperChange = upper;
+    door.upperInterval = interval;
+  }
+  if ((!door.hung) || (swingingDoorLess(door.lowerChange, door.lowerInterval, lower, interval))) {
+    door.lowerChange = lower;
+    door.lowerInterval = interval;
+  }
+  door.hung = true;
+}
+
+/**********************************************************************
+ * Process the sample <value> taken at <now>. Returns true if a point
+ * must be published, in which case it is available in outputValue and
+ * outputTime.
+ */
+boolean swingingDoorSample(SWINGING_DOOR &door, int32_t value, unsigned long now) {
+  boolean retval = false;
+
+  if (!door.started) {
+    door.started = true;
+    swingingDoorArchive(door, value, now);
+    retval = true;
+  } else if (now != door.archivedTime) {
+    int64_t interval = (int64_t) (now - door.archivedTime);
+    int64_t change = ((int64_t) value - door.archivedValue);
+
+    if ((door.hung) && ((swingingDoorLess(change, interval, door.lowerChange, door.lowerInterval)) || (swingingDoorLess(door.upperChange, door.upperInterval, change, interval)))) {
+      // A line to this sample would leave an earlier sample outside
+      // the tolerance: archive the previous sample, whose line did
+      // not, and hang the doors from it.
+      swingingDoorArchive(door, door.lastValue, door.lastTime);
+      swingingDoorNarrow(door, value, now);
+      retval = true;
+    } else if ((now - door.archivedTime) >= door.maxSilence) {
+      swingingDoorArchive(door, value, now);
+      retval = true;
+    } else {
+      swingingDoorNarrow(door, value, now);
+    }
+  }
+  door.lastValue = value;
+  door.lastTime = now;
+  return(retval);
+}
+
+#endif
@@ -0,0 +1,303 @@
+/*********************************************************************
+ * NAME
+ *   tilt.h - interrupt driven tilt and vibration event capture.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * DEVICES
+ *   ADXL345 accelerometer (I2C address 0x53 or 0x1D)
+ *   Tilt switch (fallback when no accelerometer responds)
+ * DESCRIPTION
+ *   Counts tilt and vibration events and tracks the orientation of
+ *   the module without polling. A single GPIO carries either the
+ *   accelerometer's INT1 output or a tilt switch and nothing happens
+ *   on the I2C bus until that line is asserted.
+ *
+ *   The ADXL345 runs at 100Hz with its activity detector (AC coupled,
+ *   all axes) mapped to INT1 and its FIFO in trigger mode, so that the
+ *   device itself keeps the samples leading up to and following the
+ *   activity. On an interrupt the FIFO is drained in one burst, the
+ *   peak acceleration magnitude of the samples is noted and the FIFO
+ *   is re-armed. Interrupts that follow each other within the quiet
+ *   period belong to the same event. When an event ends the FIFO is
+ *   bypassed until the next sample arrives, which gives the settled
+ *   orientation, and the event count, peak and orientation are
+ *   published.
+ *
+ *   Orientation is reported as the axis pointing up ("x+", "x-", "y+",
+ *   "y-", "z+" or "z-"). The reported axis only changes when another
+ *   axis carries at least TILT_ORIENTATION_THRESHOLD of gravity, which
+ *   gives hysteresis around the diagonals.
+ *
+ *   The line is active-low (the ADXL345 is set to invert INT1) so that
+ *   it idles high and may share a GPIO which must be high at boot, such
+ *   as GPIO2. The activity interrupt stays latched until it is read, so
+ *   tiltQuiet() should be called before any software restart to stop
+ *   the accelerometer holding the line low through the reset.
+ *
+ *   A tilt switch must connect the line to GND when closed and, for
+ *   the same reason, should be open when the module is level. Each
+ *   debounced change is an event and the orientation is reported as
+ *   "level" or "tilted".
+ */
+
+#ifndef TILT_H
+#define TILT_H
+
+#include <Arduino.h>
+#include "i2c-bus.h"
+
+#define TILT_EVENT_QUIET 1000             // Milliseconds of no activity ending an event
+#define TILT_DEBOUNCE_INTERVAL 50         // Milliseconds tilt switch must be stable
+#define TILT_ACTIVITY_THRESHOLD 8         // 62.5mg units (0.5g)
+#define TILT_ORIENTATION_THRESHOLD 205    // 4mg units (0.8g)
+#define TILT_FIFO_PRETRIGGER 16           // Samples kept from before an event
+#define TILT_SAMPLE_TIME 11               // Milliseconds for a fresh sample at 100Hz
+
+#define ADXL345_DEVID 0xE5
+#define ADXL345_REG_DEVID 0x00
+#define ADXL345_REG_THRESH_ACT 0x24
+#define ADXL345_REG_ACT_INACT_CTL 0x27
+#define ADXL345_REG_BW_RATE 0x2C
+#define ADXL345_REG_POWER_CTL 0x2D
+#define ADXL345_REG_INT_ENABLE 0x2E
+#define ADXL345_REG_INT_MAP 0x2F
+#define ADXL345_REG_INT_SOURCE 0x30
+#define ADXL345_REG_DATA_FORMAT 0x31
+#define ADXL345_REG_DATAX0 0x32           // 6 bytes
+#define ADXL345_REG_FIFO_CTL 0x38
+#define ADXL345_REG_FIFO_STATUS 0x39
+#define ADXL345_BW_RATE_100HZ 0x0A
+#define ADXL345_POWER_CTL_MEASURE 0x08
+#define ADXL345_INT_ACTIVITY 0x10
+#define ADXL345_DATA_FORMAT_FULL_16G 0x2B // Full resolution (4mg/LSB), INT active low
+#define ADXL345_ACT_AC_XYZ 0xF0
+#define ADXL345_FIFO_BYPASS 0x00
+#define ADXL345_FIFO_TRIGGER 0xC0         // Trigger mode, trigger on INT1
+
+#define TILT_ASSERTED LOW                 // Level of the line on activity
+
+enum TILT_DEVICE { TILT_NONE, TILT_ADXL345, TILT_SWITCH };
+enum TILT_ORIENTATION { TILT_UNKNOWN, TILT_X_UP, TILT_X_DOWN, TILT_Y_UP, TILT_Y_DOWN, TILT_Z_UP, TILT_Z_DOWN, TILT_LEVEL, TILT_TILTED };
+
+const char *TILT_ORIENTATION_NAMES[] = { "unknown", "x+", "x-", "y+", "y-", "z+", "z-", "level", "tilted" };
+
+/**********************************************************************
+ * Structure describing the tilt sensor. All members are maintained by
+ * the module.
+ */
+struct TILT {
+  TILT_DEVICE device;
+  uint8_t address;                // ADXL345 I2C address
+  int gpio;                       // INT1 or tilt switch
+  uint32_t events;                // Events since boot
+  uint16_t peak;                  // Peak magnitude of last event (mg)
+  TILT_ORIENTATION orientation;
+  boolean active;                 // Event in progress
+  unsigned long lastActivity;     // Millis of last interrupt in event
+  uint32_t eventPeak;             // Squared peak of event in progress
+  boolean settling;               // Waiting for sample or debounce
+  unsigned long settleStart;      // Millis at which wait started
+  int level;                      // Debounced tilt switch reading
+};
+
+volatile boolean tiltInterrupt = false;
+
+void IRAM_ATTR tiltIsr() {
+  tiltInterrupt = true;
+}
+
+/**********************************************************************
+ * Return the orientation given by the acceleration <x>, <y>, <z> or
+ * <current> if no axis is clearly pointing up.
+ */
+TILT_ORIENTATION tiltOrientation(int16_t x, int16_t y, int16_t z, TILT_ORIENTATION current) {
+  if (x >= TILT_ORIENTATION_THRESHOLD) return(TILT_X_UP);
+  if (x <= -TILT_ORIENTATION_THRESHOLD) return(TILT_X_DOWN);
+  if (y >= TILT_ORIENTATION_THRESHOLD) return(TILT_Y_UP);
+  if (y <= -TILT_ORIENTATION_THRESHOLD) return(TILT_Y_DOWN);
+  if (z >= TILT_ORIENTATION_THRESHOLD) return(TILT_Z_UP);
+  if (z <= -TILT_ORIENTATION_THRESHOLD) return(TILT_Z_DOWN);
+  return(current);
+}
+
+/**********************************************************************
+ * Read the sample at the head of the ADXL345 output FIFO into <x>,
+ * <y> and <z> (4mg units). All six data registers must be read in one
+ * transfer for the FIFO to advance.
+ */
+boolean tiltReadSample(TILT &tilt, int16_t &x, int16_t &y, int16_t &z) {
+  uint8_t data[6];
+
+  if (!i2cBusReadRegisters(tilt.address, ADXL345_REG_DATAX0, data, sizeof(data))) return(false);
+  x = (int16_t) (data[0] | ((uint16_t) data[1] << 8));
+  y = (int16_t) (data[2] | ((uint16_t) data[3] << 8));
+  z = (int16_t) (data[4] | ((uint16_t) data[5] << 8));
+  return(true);
+}
+
+boolean tiltArmFifo(TILT &tilt) {
+  return((i2cBusWriteRegister(tilt.address, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS)) && (i2cBusWriteRegister(tilt.address, ADXL345_REG_FIFO_CTL, (ADXL345_FIFO_TRIGGER | TILT_FIFO_PRETRIGGER))));
+}
+
+boolean tiltConfigureAdxl345(TILT &tilt) {
+  const uint8_t settings[][2] = {
+    { ADXL345_REG_POWER_CTL, 0x00 },
+    { ADXL345_REG_BW_RATE, ADXL345_BW_RATE_100HZ },
+    { ADXL345_REG_DATA_FORMAT, ADXL345_DATA_FORMAT_FULL_16G },
+    { ADXL345_REG_THRESH_ACT, TILT_ACTIVITY_THRESHOLD },
+    { ADXL345_REG_ACT_INACT_CTL, ADXL345_ACT_AC_XYZ },
+    { ADXL345_REG_INT_MAP, 0x00 },
+    { ADXL345_REG_INT_ENABLE, ADXL345_INT_ACTIVITY },
+    { ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS },
+    { ADXL345_REG_POWER_CTL, ADXL345_POWER_CTL_MEASURE }
+  };
+
+  for (unsigned int i = 0; i < (sizeof(settings) / sizeof(settings[0])); i++) {
+    if (!i2cBusWriteRegister(tilt.address, settings[i][0], settings[i][1])) return(false);
+  }
+  return(true);
+}
+
+/**********************************************************************
+ * Disable and clear the activity interrupt of any ADXL345 on the bus,
+ * which is left configured across a software restart. Wire must
+ * already have been started.
+ */
+void tiltQuiet() {
+  const uint8_t candidates[] = { 0x53, 0x1D };
+  uint8_t source;
+
+  for (unsigned int i = 0; i < sizeof(candidates); i++) {
+    if (i2cBusWriteRegister(candidates[i], ADXL345_REG_INT_ENABLE, 0x00)) {
+      i2cBusReadRegisters(candidates[i], ADXL345_REG_INT_SOURCE, &source, 1);
+    }
+  }
+}
+
+/**********************************************************************
+ * Look for an ADXL345 and, if there is none, use a tilt switch on
+ * <gpio>. Wire must already have been started. Returns the device in
+ * use.
+ */
+TILT_DEVICE tiltBegin(TILT &tilt, int gpio) {
+  const uint8_t candidates[] = { 0x53, 0x1D };
+  uint8_t id;
+  int16_t x, y, z;
+  uint8_t source;
+
+  tilt.device = TILT_SWITCH;
+  tilt.gpio = gpio;
+  tilt.events = 0;
+  tilt.peak = 0;
+  tilt.orientation = TILT_UNKNOWN;
+  tilt.active = false;
+  tilt.eventPeak = 0;
+  tilt.settling = false;
+  for (unsigned int i = 0; i < sizeof(candidates); i++) {
+    if ((i2cBusReadRegisters(candidates[i], ADXL345_REG_DEVID, &id, 1)) && (id == ADXL345_DEVID)) {
+      tilt.address = candidates[i];
+      if (tiltConfigureAdxl345(tilt)) tilt.device = TILT_ADXL345;
+      break;
+    }
+  }
+
+  pinMode(gpio, INPUT_PULLUP);
+  if (tilt.device == TILT_ADXL345) {
+    delay(TILT_SAMPLE_TIME);
+    if (tiltReadSample(tilt, x, y, z)) tilt.orientation = tiltOrientation(x, y, z, TILT_UNKNOWN);
+    tiltArmFifo(tilt);
+    i2cBusReadRegisters(tilt.address, ADXL345_REG_INT_SOURCE, &source, 1);
+    attachInterrupt(digitalPinToInterrupt(gpio), tiltIsr, FALLING);
+    // INT1 is level: pick up activity latched before we attached.
+    if (digitalRead(gpio) == TILT_ASSERTED) tiltInterrupt = true;
+  } else {
+    tilt.level = digitalRead(gpio);
+    tilt.orientation = (tilt.level == TILT_ASSERTED)?TILT_TILTED:TILT_LEVEL;
+    attachInterrupt(digitalPinToInterrupt(gpio), tiltIsr, CHANGE);
+  }
+  return(tilt.device);
+}
+
+/**********************************************************************
+ * Handle an ADXL345 interrupt by clearing it and draining the FIFO,
+ * folding the samples into the event in progress.
+ */
+void tiltDrainFifo(TILT &tilt, unsigned long now) {
+  uint8_t source, status;
+  int16_t x, y, z;
+  uint32_t magnitude;
+
+  tiltInterrupt = false;
+  if (!i2cBusReadRegisters(tilt.address, ADXL345_REG_INT_SOURCE, &source, 1)) return;
+  if (!i2cBusReadRegisters(tilt.address, ADXL345_REG_FIFO_STATUS, &status, 1)) return;
+  if (!tilt.active) {
+    tilt.active = true;
+    tilt.events++;
+    tilt.eventPeak = 0;
+  }
+  tilt.lastActivity = now;
+  for (int entries = (status & 0x3F); entries > 0; entries--) {
+    if (!tiltReadSample(tilt, x, y, z)) break;
+    magnitude = (uint32_t) (((int32_t) x * x) + ((int32_t) y * y) + ((int32_t) z * z));
+    if (magnitude > tilt.eventPeak) tilt.eventPeak = magnitude;
+  }
+  tiltArmFifo(tilt);
+  if (digitalRead(tilt.gpio) == TILT_ASSERTED) tiltInterrupt = true;
+}
+
+/**********************************************************************
+ * Called on every pass of loop(). I2C traffic is only generated when
+ * the interrupt line has been asserted or an event ends. Returns true
+ * when an event has ended (ADXL345) or the switch has changed, i.e.
+ * when the event count, peak or orientation should be published.
+ */
+boolean tiltService(TILT &tilt, unsigned long now) {
+  int16_t x, y, z;
+  int level;
+
+  switch (tilt.device) {
+    case TILT_ADXL345:
+      if (tilt.settling) {
+        if ((now - tilt.settleStart) < TILT_SAMPLE_TIME) break;
+        tilt.settling = false;
+        tilt.peak = (uint16_t) (sqrt((double) tilt.eventPeak) * 4);
+        if (tiltReadSample(tilt, x, y, z)) tilt.orientation = tiltOrientation(x, y, z, tilt.orientation);
+        tiltArmFifo(tilt);
+        if (digitalRead(tilt.gpio) == TILT_ASSERTED) tiltInterrupt = true;
+        return(true);
+      }
+      if (tiltInterrupt) tiltDrainFifo(tilt, now);
+      if ((tilt.active) && ((now - tilt.lastActivity) >= TILT_EVENT_QUIET)) {
+        // Bypass the FIFO so that the data registers give a current sample.
+        tilt.active = false;
+        tilt.settling = i2cBusWriteRegister(tilt.address, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS);
+        tilt.settleStart = now;
+      }
+      break;
+    case TILT_SWITCH:
+      if (tiltInterrupt) {
+        tiltInterrupt = false;
+        tilt.settling = true;
+        tilt.settleStart = now;
+      }
+      if ((tilt.settling) && ((now - tilt.settleStart) >= TILT_DEBOUNCE_INTERVAL)) {
+        tilt.settling = false;
+        if ((level = digitalRead(tilt.gpio)) != tilt.level) {
+          tilt.level = level;
+          tilt.events++;
+          tilt.orientation = (level == TILT_ASSERTED)?TILT_TILTED:TILT_LEVEL;
+          return(true);
+        }
+      }
+      break;
+    default:
+      break;
+  }
+  return(false);
+}
+
+const char *tiltOrientationName(TILT &tilt) {
+  return(TILT_ORIENTATION_NAMES[tilt.orientation]);
+}
+
+#endif
@@ -0,0 +1,1791 @@
+/*********************************************************************
+ * NAME
+ *   multi001-v1.cpp - multi-sensor wireless MQTT node.
+ * PLATFORM
+ *   ESP8266/Wemos MINI-D1
+ * SENSORS
+ *   AM2320 (I2C humidity and temperature)
+ *   DS18B20 (one-wire temperature)
+ *   SPST switches (x4)
+ *   MCP23017/PCF8574 (I2C GPIO expander inputs)
+ *   luxControl SmartDim Sensor 2 (motion and lux)
+ * OUTPUTS
+ *   Subminiature signal relay
+ * DESCRIPTION
+ *   This firmware implements an IoT MQTT client which reports sensor
+ *   data from SPST switches and a range of devices connected to the
+ *   host microcontroller over I2C or one-wire busses.
+ *
+ *   The firmware supports more than one hardware variant. The variant
+ *   and the sensors and outputs it carries are selected at compile time
+ *   by build flags set for each environment in platformio.ini:
+ *
+ *      FLAG                     HARDWARE
+ *      HARDWARE_MULTI001        MULTI001 (one-wire bus on GPIO4(D2),
+ *                               SmartDim on GPIO16(D0) and A0, four
+ *                               switches)
+ *      HARDWARE_MULTI001_HTT    MULTI001 humidity-temperature-tilt
+ *                               (I2C bus, one-wire bus, relay,
+ *                               two switches)
+ *
+ *      FLAG                     FEATURE
+ *      FEATURE_AM2320           AM2320 humidity and temperature (2)
+ *      FEATURE_DS18B20          DS18B20 temperature sensors (3)
+ *      FEATURE_GPIO_EXPANDER    MCP23017/PCF8574 inputs (4)
+ *      FEATURE_OCCUPANCY        SmartDim motion, lux and occupancy (5)
+ *      FEATURE_RELAY            Relay and local rules (6)
+ *      FEATURE_I2C_SENSORS      SHT3x, BME280, BH1750 and SCD4x (7)
+ *      FEATURE_TILT             ADXL345 or tilt switch events (8)
+ *      FEATURE_FLASH_LOG        Time-series log on flash
+ *
+ *   Code and libraries for features which are not selected are left
+ *   out of the firmware image altogether.
+ * 
+ *   The generated MQTT message is a JSON object with properties
+ *   reflecting data harvested from one or more of the following
+ *   sensors.
+ * 
+ *   1. SPST switches
+ *      Up to two active-low SPST switches can be connected to
+ *      GPIO14(D5) and GPIO12(D6). The following two properties are
+ *      always included in the output message (note that the reported
+ *      property names can be overriden during module configuration).
+ * 
+ *      PROPERTY            VALUE
+ *      sw0 (or alias)      Integer boolean 0 or 1 (OFF or ON) 
+ *      sw1 (or alias)      Integer boolean 0 or 1 (OFF or ON)
+ *
+ *      MULTI001 hardware has two further switches on GPIO13(D7) and
+ *      GPIO15(D8) which are reported as sw2 and sw3.
+ *
+ *      Either switch input can instead be configured as a pulse
+ *      counter for the open-collector output of an energy or flow
+ *      meter (see CONFIGURATION below), in which case the switch adds
+ *      the following properties to the output message. Pulses are
+ *      counted by an interrupt service routine and the count survives
+ *      a module reset.
+ *
+ *      PROPERTY            VALUE
+ *      sw0 (or alias)      Integer pulse count (32-bit, wrapping)
+ *      sw0-rate            Pulses per minute over the last pulse
+ *                          interval
+ *
+ *      Counters update the output message once every pulse interval
+ *      if their count or rate has changed.
+ * 
+ *   2. AM2320 humidity & temperature
+ *      
+ *      A single sensor of this type can be connected to the I2C bus
+ *      on GPIO5(D1/SCL) and GPIO4(D2/SDA). The sensor is automatically
+ *      detected and no user configuration is required. Presence of the
+ *      sensor adds the following properties to the output message.
+ *      
+ *      PROPERTY            VALUE
+ *      humidity            Integer percent in the range 0..100
+ *                          (deadband 0.5)
+ *      temperature         Integer Celsius in the range -40..80
+ *                          (deadband 0.5)
+ *
+ *      The following derived properties are also included unless
+ *      PSYCHROMETRIC_FIELDS is overridden by a build flag (see
+ *      sensor-am2320.h). They are calculated on the module in
+ *      fixed-point.
+ *
+ *      PROPERTY            VALUE
+ *      dewpoint            Celsius to 0.1 (deadband 0.5)
+ *      absolutehumidity    Grams per cubic metre to 0.01 (deadband 0.2)
+ *      humidex             Celsius to 0.1 (deadband 0.5)
+ * 
+ *   3. DS18B20 temperature sensors
+ * 
+ *      An arbitrary number of sensors of this type can be connected to
+ *      the one-wire bus on GPIO13(D7) (on MULTI001 hardware, GPIO4(D2)).
+ *      Further buses can be configured in the oneWireBuses[] table,
+ *      each with its own resolution and conversion interval, on any
+ *      free GPIO other than GPIO0, GPIO2 and GPIO15, which are sampled
+ *      at boot. Splitting probes across
+ *      buses keeps cable runs short and stops a single shorted probe
+ *      from taking out every sensor. Conversions on all buses run in
+ *      parallel.
+ *
+ *      Sensors are automatically detected and no user configuration is
+ *      required. Each detected sensor adds a property of the following
+ *      form to the output message.
+ * 
+ *      PROPERTY             VALUE
+ *      DS-address           Integer Celsius in the range -40..120
+ *
+ *      On MULTI001 hardware the first sensor found is also reported,
+ *      as the original MULTI001 firmware reported it, in the property
+ *      "temperature" as Celsius to 0.01.
+ *
+ *      Readings are CRC checked, retried within the conversion
+ *      schedule if they fail and median filtered to remove spikes
+ *      (see onewire-buses.h).
+ *
+ *   4. MCP23017/PCF8574 GPIO expanders
+ *
+ *      Up to 32 additional active-low SPST switches can be connected
+ *      through GPIO expanders on the I2C bus. The interrupt outputs of
+ *      all expanders are wired to GPIO3(RX) and the expanders are only
+ *      read when this line is asserted. The line is not one of the
+ *      pins sampled at boot, so an expander still holding its interrupt
+ *      asserted across a reset cannot stop the module from starting.
+ *      Debug output uses TX only. Expanders are configured in the
+ *      gpioExpanders[] table and each one that is detected adds a
+ *      property of the following form to the output message.
+ *
+ *      PROPERTY             VALUE
+ *      IO-address           Integer bitmap of input states (port B in
+ *                           the high byte; 0 says switch closed)
+ *
+ *      A debounced change on any expander input causes an immediate
+ *      update.
+ *
+ *   5. luxControl SmartDim Sensor 2
+ *
+ *      The motion output of the sensor is connected to GPIO16(D0) and
+ *      its lux output to A0. Both are sampled every 250 milliseconds
+ *      and fed to an occupancy state machine which also takes account
+ *      of an optional door switch (see occupancy.h and the OCCUPANCY_
+ *      settings below). The sensor adds the following properties to
+ *      the output message.
+ *
+ *      PROPERTY             VALUE
+ *      motion               Integer boolean 0 or 1 (no motion or motion)
+ *      lux                  Integer in the range 0..1023
+ *      occupancy            One of "vacant", "occupied" or "hold"
+ *
+ *      A change in occupancy causes an immediate update.
+ *
+ *      The motion output is also sampled every 50 milliseconds by a
+ *      timer and summarised over each PIR_METRICS_WINDOW (one minute)
+ *      as the following occupancy intensity properties (see
+ *      pir-metrics.h), which are updated when each window closes.
+ *
+ *      PROPERTY             VALUE
+ *      motion-active        Percentage of the window with motion to 0.1
+ *      motion-triggers      Integer number of times motion started
+ *      motion-idle          Longest period without motion in the
+ *                           window in seconds to 0.1
+ *
+ *   6. Relay
+ *
+ *      The on-board relay on GPIO16(D0) can be switched by local
+ *      rules (see CONFIGURATION below) which are evaluated on the
+ *      module every time round the main loop, so that the relay
+ *      responds to its inputs within milliseconds and continues to do
+ *      so when the network or MQTT server is unavailable. Rules may
+ *      refer to the following signals of the features built into the
+ *      firmware, using the same units as the output message.
+ *
+ *         SIGNAL              VALUE
+ *         sw0, sw1            0 (switch closed) or 1 (switch open)
+ *         temperature         AM2320 temperature (Celsius)
+ *         humidity            AM2320 humidity (percent)
+ *         dewpoint            Dew point (Celsius)
+ *         motion              SmartDim motion (0 or 1)
+ *         lux                 SmartDim lux level (0..1023)
+ *
+ *      The state of the relay is included in the output message and a
+ *      change causes an immediate update.
+ *
+ *         PROPERTY             VALUE
+ *         relay                Integer boolean 0 or 1 (OFF or ON)
+ *
+ *      The relay can also be commanded by publishing to the topic
+ *      "<topic>/set/relay" either a plain state (0, 1, on, off, true
+ *      or false) or a JSON object of the form:
+ *
+ *        { "seq": n, "value": v }
+ *
+ *      where <n> is an optional sequence number. A sequenced command
+ *      is rejected as stale if its sequence number is not later than
+ *      that of the last sequenced command applied. A command overrides
+ *      any running rule timer; rules take control again at their next
+ *      transition. Every command is acknowledged on the topic
+ *      "<topic>/ack/relay" with a JSON object of the form:
+ *
+ *        { "seq": n, "value": v, "result": r, "latency": l }
+ *
+ *      where <r> is one of "ok", "stale" or "invalid" and <l> is the
+ *      number of microseconds between the module starting to read the
+ *      command and the relay being driven (<n> is 0 for an unsequenced
+ *      command).
+ *
+ *   7. Additional I2C sensors
+ *
+ *      Any of the following sensors can be connected to the I2C bus.
+ *      The bus is scanned once at boot (see i2c-bus.h) and each sensor
+ *      that answers at one of its addresses is used, so a sensor can
+ *      be added to a module without changing its firmware. The scan
+ *      result is kept over a warm boot, so power cycle the module (or
+ *      press its reset button) after fitting a sensor.
+ *
+ *      SENSOR     ADDRESS     PROPERTIES
+ *      SHT3x      0x44, 0x45  sht3x-temperature (C), sht3x-humidity (%)
+ *      BME280     0x76, 0x77  bme280-temperature (C), bme280-humidity
+ *                             (%), bme280-pressure (hPa)
+ *      BH1750     0x23        illuminance (lx)
+ *      SCD4x      0x62        scd4x-co2 (ppm), scd4x-temperature (C),
+ *                             scd4x-humidity (%)
+ *
+ *      Every sensor is read without blocking the main loop while it
+ *      converts.
+ *
+ *   8. Tilt and vibration
+ *
+ *      An ADXL345 accelerometer on the I2C bus with its INT1 output
+ *      connected to GPIO2(D4) or, if no accelerometer is found, a tilt
+ *      switch between GPIO2(D4) and GND reports tilt and vibration
+ *      events (see tilt.h). The accelerometer's own activity detector
+ *      and FIFO capture each event, so the module does no work between
+ *      events. The following properties are included in the output
+ *      message and the end of an event causes an immediate update.
+ *
+ *      PROPERTY             VALUE
+ *      tilt-events          Integer count of events since boot
+ *      tilt-peak            Peak acceleration of the last event in g
+ *                           to 0.01 (accelerometer only)
+ *      tilt-orientation     Axis pointing up ("x+", "x-", "y+", "y-",
+ *                           "z+" or "z-") or, for a tilt switch,
+ *                           "level" or "tilted"
+ *
+ *   The AM2320 and any other sensor with a fixed set of properties is
+ *   handled by a driver in the SENSORS registry (see
+ *   sensor-registry.h). A registered property only causes an update
+ *   when it changes by at least its deadband.
+ *
+ *   A JSON object containing properties relating to detected and/or
+ *   configured sensors are published to a user defined topic on a user
+ *   configured MQTT server (see CONFIGURATION below).
+ *
+ *   Alarm rules in the alarmRules[] table can watch AM2320 and DS18B20
+ *   fields for high and low limits and for an excessive rate of change.
+ *   Rules are evaluated every time their field is sampled and a change
+ *   in alarm condition is immediately published (retained) to the
+ *   topic "<topic>/alarm/<field>" as a JSON object of the form:
+ *
+ *     { "condition": c, "value": v, "rate": r }
+ *
+ *   where <c> is one of "normal", "high", "low" or "rate" and <r> is
+ *   the rate of change per minute. For five minutes after an alarm is
+ *   raised every sample of the alarmed field updates the output
+ *   message, whatever its deadband or trend compression.
+ *
+ *   Slowly varying AM2320 and DS18B20 fields can be trend compressed
+ *   by adding them to the trendFields[] table, which is empty as
+ *   shipped so that every field keeps its usual cadence. A compressed
+ *   field no longer causes an update of the output message when it
+ *   changes (although it is still included in the message). Instead, a
+ *   swinging door compressor selects just the points needed to rebuild
+ *   the field by straight line interpolation to within the field's
+ *   error tolerance and these are published to the topic
+ *   "<topic>/trend/<field>" as a JSON object of the form:
+ *
+ *     { "value": v, "age": a }
+ *
+ *   where <a> is the number of milliseconds between the sample being
+ *   taken and being published. A point is published at least once
+ *   every maximum silence period.
+ *
+ *   Fields listed in the historyFields[] table (by default the AM2320
+ *   temperature and humidity; a DS18B20 can be added by name) have a
+ *   history held in RAM, by default 24 hours at one minute steps (see
+ *   history.h). A consumer requests part of a history by publishing to
+ *   "<topic>/history/req" a JSON object of the form:
+ *
+ *     { "id": i, "field": f, "from": a, "to": b }
+ *
+ *   where <a> and <b> are the ages in seconds of the oldest and newest
+ *   samples wanted (by default the whole history). The reply is
+ *   published to "<topic>/history/resp" as a series of chunks, each
+ *   carrying up to 32 consecutive values in fixed-point form, the last
+ *   of which has "more" set false. A new request abandons any reply
+ *   still in progress.
+ *
+ *   With FEATURE_FLASH_LOG, fields listed in the logFields[] table are
+ *   also logged once a minute to a compressed log on the flash
+ *   filesystem, which survives restarts and holds several days of
+ *   samples (see flash-log.h). Samples are time stamped in seconds,
+ *   in UTC if the module has been able to reach an SNTP server. A
+ *   consumer reads the log by publishing to "<topic>/log/req" a JSON
+ *   object of the form:
+ *
+ *     { "id": i, "field": f, "from": a, "to": b }
+ *
+ *   where <a> and <b> are the times of the oldest and newest samples
+ *   wanted (by default the whole log). The reply is published to
+ *   "<topic>/log/resp" as a series of chunks of the form:
+ *
+ *     { "id": i, "field": f, "scale": s, "now": n, "t": t, "d": [...], "v": [...], "more": m }
+ *
+ *   where <n> is the module's time now, <t> the time of the first value
+ *   in "v" and "d" the intervals in seconds between successive values.
+ *
+ *   When the MQTT connection returns after an outage (or a restart) the
+ *   samples logged meanwhile are published to "<topic>/backfill" in
+ *   chunks of the same form, less "id", "now" and "more" (see
+ *   backfill.h). Backfill is limited to BACKFILL_RATE_LIMIT bytes per
+ *   second and slows down further if the broker is slow to take it.
+ *   Its progress is checkpointed on flash, so that it resumes where it
+ *   stopped if interrupted.
+ * 
+ *   Every registered sensor and DS18B20 has a health record (see
+ *   sensor-health.h). A sensor whose reading fails is left out of the
+ *   output message and instead gets an entry, named as the sensor
+ *   (e.g. "AM2320" or "DS-address"), in a "status" section of the
+ *   message of the form:
+ *
+ *     "status": { "AM2320": { "state": s, "failures": f, "error": e, "lastgood": t } }
+ *
+ *   where <s> is "degraded" after a failure or "failed" once the
+ *   sensor's failures have opened its circuit breaker, <f> is the
+ *   number of consecutive failures, <e> is the class of the last error
+ *   ("bus", "crc", "range" or "reset") and <t> is the module uptime in
+ *   seconds of the last good reading (0 if there has been none). A
+ *   failed sensor is sampled less and less often, up to once every
+ *   five minutes, until it recovers. The entry is removed when the
+ *   sensor recovers and the section is absent while every sensor is
+ *   healthy.
+ * 
+ *   The defined MQTT topic is updated whenever a sensor value changes
+ *   or once every 30 seconds. The maximum update rate is once every
+ *   three seconds.
+ *
+ *   The module measures its round trip time to the broker, at most
+ *   every 15 seconds and only alongside an update, by publishing a
+ *   sequence number to "<topic>/echo", which it also subscribes to
+ *   (see publish-rate.h). While the round trip
+ *   time is above PUBLISH_RATE_LATENCY_TARGET, or an echo is lost, the
+ *   30 second update is stretched, up to tenfold, and updates caused
+ *   by sensor changes are held off by a growing interval. Both recover
+ *   gradually once the broker responds quickly again. Events (relay,
+ *   occupancy, GPIO expander and tilt changes and alarms) are never
+ *   held off.
+ *
+ *   The MQTT client (see mqtt-async.h) is event driven: connecting and
+ *   publishing never wait on the network, and messages from the broker,
+ *   including relay commands, are handled as soon as they arrive. A
+ *   slow or unreachable broker therefore does not delay sensor sampling
+ *   or local relay rules; publications it cannot take are dropped.
+ *   Publications made within MQTT_COALESCE_WINDOW of each other are
+ *   gathered into a single TCP write, so that a burst of changes need
+ *   not take a TCP segment per message.
+ *
+ *   The client pings the broker only when nothing else has been sent
+ *   for a while, and learns how long that can be (see keepalive.h):
+ *   it tries longer and longer idle intervals, up to
+ *   MQTT_KEEPALIVE_MAXIMUM seconds, until one is not survived, and
+ *   keeps the longest that is in EEPROM across restarts.
+ *
+ *   While the WiFi signal is weak the module looks for a stronger
+ *   access point of the configured network, or of the networks in the
+ *   roamNetworks[] table, and moves to one that is clearly better (see
+ *   roaming.h). Each move is reported to "<topic>/roam" as:
+ *
+ *     { "from": b, "to": b, "ms": t, "before": r, "after": r }
+ *
+ *   giving the BSSIDs, the time taken and the signal strength in dBm
+ *   before and after ("after" is 0 if the move failed and the module
+ *   returned to the configured network).
+ *
+ *   The client uses MQTT 5 where the broker supports it. Topics are
+ *   then replaced by two byte aliases after their first use, and
+ *   messages which go stale carry an expiry interval: replies and
+ *   acknowledgements MQTT_REPLY_EXPIRY seconds, round trip probes the
+ *   probe timeout and the retained telemetry MQTT_TELEMETRY_EXPIRY hard
+ *   publication intervals (so it disappears should the module fall
+ *   silent). Alarms, trend points and backfill do not expire.
+ * 
+ * CONFIGURATION
+ * 
+ * On first use (and also when the device is unable to connect to a
+ * previously configured wireless network) the device will operate as
+ * an open wireless access point with the SSID "MULTISENSOR-xxxxxxxxxxxx",
+ * where "xxxxxxxxxxxx" is the MAC address of the host wireless
+ * interface.
+ * 
+ * Connection to this access point will open a captive portal that
+ * allows the user to configure the following properties:
+ * 
+ * network                 The SSID of the host network to which the
+ *                         device should connect.
+ * 
+ * password                The password (if any) required to connect to
+ *                         specified host network.
+ * 
+ * server name             The name or IP address of the MQTT server to
+ *                         which status updates should be sent.
+ * 
+ * server port             The port on which the server listens (default
+ *                         1886).
+ * 
+ * username                The login user name required for access to
+ *                         server name.
+ * 
+ * password                The login password for username.
+ * 
+ * topic                   The topic on which to publish data
+ *                         (defaults to "<module-id>/status" on MULTI001
+ *                         hardware and "multisensor/<module-id>" on
+ *                         MULTI001 HTT hardware).
+ * 
+ * sw0 alias               A JSON property name to be used instead of
+ *                         the default (sw0)
+ *
+ * sw1 alias               A JSON property name to be used instead of
+ *                         the default (sw1)
+ *
+ * sw0 mode                0 to operate sw0 as a switch (the default)
+ *                         or 1 to operate it as a pulse counter.
+ *
+ * sw1 mode                0 to operate sw1 as a switch (the default)
+ *                         or 1 to operate it as a pulse counter.
+ *
+ * pulse interval          Milliseconds between pulse counter updates
+ *                         (default 10000).
+ *
+ * rules                   Relay rules (default none; FEATURE_RELAY
+ *                         only). Rules are separated by ';' and each
+ *                         has the form:
+ *
+ *                           signal op value [& signal op value]... :
+ *                             relay=seconds
+ *
+ *                         where op is one of <, <=, >, >=, = or !=.
+ *                         The relay is switched on when every condition
+ *                         becomes true. If seconds is 0 it is switched
+ *                         off when the rule becomes false; otherwise it
+ *                         is switched off once the rule has been false
+ *                         for the given number of seconds. For example:
+ *
+ *                           sw0=0&temperature<18.5:relay=600
+ *
+ *                         A rule set containing an error is ignored.
+ * 
+ * When the configuration is saved the device will immediately reboot
+ * and attempt to enter production with the specified configuration.
+ */
+ 
+// Features built into the firmware. These are normally set for each
+// hardware variant by build_flags in platformio.ini.
+#ifndef FEATURE_AM2320
+#define FEATURE_AM2320 0
+#endif
+#ifndef FEATURE_DS18B20
+#define FEATURE_DS18B20 0
+#endif
+#ifndef FEATURE_GPIO_EXPANDER
+#define FEATURE_GPIO_EXPANDER 0
+#endif
+#ifndef FEATURE_OCCUPANCY
+#define FEATURE_OCCUPANCY 0
+#endif
+#ifndef FEATURE_RELAY
+#define FEATURE_RELAY 0
+#endif
+#ifndef FEATURE_I2C_SENSORS
+#define FEATURE_I2C_SENSORS 0
+#endif
+#ifndef FEATURE_TILT
+#define FEATURE_TILT 0
+#endif
+#ifndef FEATURE_FLASH_LOG
+#define FEATURE_FLASH_LOG 0
+#endif
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiManager.h>
+#include <EEPROM.h>
+#include <ArduinoJson.h>
+#if (FEATURE_AM2320 || FEATURE_GPIO_EXPANDER || FEATURE_I2C_SENSORS || FEATURE_TILT)
+#include <Wire.h>
+#endif
+#include "mqtt-async.h"
+#include "keepalive.h"
+#include "roaming.h"
+#include "sensor-registry.h"
+#if FEATURE_AM2320
+#include "sensor-am2320.h"
+#endif
+#if FEATURE_I2C_SENSORS
+#include "i2c-bus.h"
+#include "sensor-sht3x.h"
+#include "sensor-bme280.h"
+#include "sensor-bh1750.h"
+#include "sensor-scd4x.h"
+#endif
+#if FEATURE_DS18B20
+#include "onewire-buses.h"
+#endif
+#if FEATURE_GPIO_EXPANDER
+#include "gpio-expander.h"
+#endif
+#if FEATURE_OCCUPANCY
+#include "occupancy.h"
+#include "pir-metrics.h"
+#endif
+#if FEATURE_TILT
+#include "tilt.h"
+#endif
+#if FEATURE_RELAY
+#include "outputs.h"
+#include "rules.h"
+#endif
+#include "pulse-counter.h"
+#include "alarms.h"
+#include "swinging-door.h"
+#include "publish-rate.h"
+#include "history.h"
+#if FEATURE_FLASH_LOG
+#include "flash-log.h"
+#include "backfill.h"
+#endif
+
+#define DEBUG_SERIAL                      // Enable debug messages
+#define DEBUG_SERIAL_START_DELAY 2000     // Milliseconds wait before output
+
+#if defined(HARDWARE_MULTI001)
+#define GPIO_ONE_WIRE_BUS_0 4             // For Dallas temperature sensors
+#define GPIO_SW0 14                       // SPST switch
+#define GPIO_SW1 12                       // SPST switch
+#define GPIO_SW2 13                       // SPST switch
+#define GPIO_SW3 15                       // SPST switch
+#define GPIO_PIR_SENSOR 16                // SmartDim motion output
+#define GPIO_LUX_SENSOR A0                // SmartDim lux output
+#define DS18B20_LEGACY_PROPERTY "temperature" // First sensor, as in the original firmware
+#elif defined(HARDWARE_MULTI001_HTT)
+#define GPIO_SCL 5                        // I2C SCL
+#define GPIO_SDA 4                        // I2C SDA
+#define GPIO_ONE_WIRE_BUS_0 13            // For Dallas temperature sensors
+#define GPIO_SW0 14                       // SPST switch
+#define GPIO_SW1 12                       // SPST switch
+#define GPIO_EXPANDER_INT 3               // Shared GPIO expander interrupt (RX)
+#define GPIO_RELAY 16                     // On-board signal relay
+#define GPIO_TILT_INT 2                   // ADXL345 INT1 or tilt switch (active-low)
+#else
+#error "No hardware variant selected (see platformio.ini)"
+#endif
+
+#if (FEATURE_OCCUPANCY && FEATURE_RELAY && (GPIO_PIR_SENSOR == GPIO_RELAY))
+#error "FEATURE_OCCUPANCY and FEATURE_RELAY share a GPIO on this hardware"
+#endif
+
+#if ((FEATURE_AM2320 || FEATURE_GPIO_EXPANDER || FEATURE_I2C_SENSORS || FEATURE_TILT) && !defined(GPIO_SDA))
+#error "I2C features selected for hardware without an I2C bus"
+#endif
+
+#if (FEATURE_TILT && !defined(GPIO_TILT_INT))
+#error "FEATURE_TILT selected for hardware without a tilt interrupt line"
+#endif
+
+#define MODULE_ID_FORMAT "MULTISENSOR-%02x%02x%02x%02x%02x%02x"
+
+// User configuration access-point settings
+#define AP_PORTAL_SERVICE_PORT 80               
+#define AP_PORTAL_TIMEOUT 180
+
+// User configuration property settings and defaults
+#if defined(HARDWARE_MULTI001)
+#define CF_DEFAULT_MQTT_TOPIC_FORMAT "%s/status"
+#else
+#define CF_DEFAULT_MQTT_TOPIC_FORMAT "multisensor/%s"
+#endif
+#define CF_DEFAULT_MQTT_SERVICE_PORT 1886
+#define CF_DEFAULT_PROPERTY_NAME_FOR_SW0 "sw0"
+#define CF_DEFAULT_PROPERTY_NAME_FOR_SW1 "sw1"
+#define CF_DEFAULT_MQTT_PUBLISH_SOFT_INTERVAL 3000
+#define CF_DEFAULT_MQTT_PUBLISH_HARD_INTERVAL 30000
+#define CF_DEFAULT_SW_MODE SW_MODE_SWITCH
+#define CF_DEFAULT_PULSE_PUBLISH_INTERVAL 10000
+#define CF_DEFAULT_RULES ""
+
+// Persistent storage addresses and default values
+#define PS_IS_CONFIGURED_TOKEN_STORAGE_ADDRESS 0
+#define PS_IS_CONFIGURED_TOKEN_VALUE 0xB0
+#define PS_IS_CONFIGURED_TOKEN_VALUE_ORIGINAL 0xAE  // Record without switch modes
+#define PS_IS_CONFIGURED_TOKEN_VALUE_SWITCH_MODES 0xAF  // Record without rules
+#define PS_IS_CONFIGURED_TOKEN_VALUE_RULES 0xB0
+#define PS_USER_CONFIGURATION_STORAGE_ADDRESS 1
+#define PS_KEEPALIVE_STORAGE_ADDRESS 448
+
+// Miscellaneous sensor configuration settings 
+#define LUX_FACTOR 2.7
+#define OCCUPANCY_SAMPLE_INTERVAL 250     // Milliseconds between PIR/lux samples
+#define OCCUPANCY_HOLD_TIME 300000        // Milliseconds occupied after last motion
+#define OCCUPANCY_RETRIGGER_WINDOW 60000  // Milliseconds in hold before vacant
+#define OCCUPANCY_DOOR_GPIO -1            // Door switch (e.g. GPIO_SW0) or -1
+#define OCCUPANCY_LUX_THRESHOLD -1        // Lights-on lux level (0..1023) or -1
+#define PIR_METRICS_WINDOW 60000          // Milliseconds per PIR metrics window
+#define DS18B20_NAME_FORMAT "DS-%02x%02x%02x%02x%02x%02x%02x%02x"
+#define DS18B20_RESOLUTION 12
+#define DS18B20_CONVERSION_INTERVAL 10000
+#define GPIO_EXPANDER_NAME_FORMAT "IO-%02x"
+#define PULSE_RATE_NAME_FORMAT "%s-rate"
+#define ALARM_TOPIC_FORMAT "%s/alarm/%s"
+#define ALARM_MESSAGE_FORMAT "{ \"condition\": \"%s\", \"value\": %.2f, \"rate\": %.2f }"
+#define TREND_TOPIC_FORMAT "%s/trend/%s"
+#define TREND_MESSAGE_FORMAT "{ \"value\": %.2f, \"age\": %lu }"
+#define TREND_BACKLOG 8                   // Points held per field until published
+#define ROAM_TOPIC_FORMAT "%s/roam"
+#define ROAM_MESSAGE_FORMAT "{ \"from\": \"%s\", \"to\": \"%s\", \"ms\": %lu, \"before\": %ld, \"after\": %ld }"
+#define HISTORY_REQUEST_TOPIC_FORMAT "%s/history/req"
+#define HISTORY_REQUEST_TOPIC_SUFFIX "/history/req"
+#define HISTORY_RESPONSE_TOPIC_FORMAT "%s/history/resp"
+#define HISTORY_CHUNK_INTERVAL 50         // Milliseconds between reply chunks
+#define HISTORY_CHUNK_SIZE 200            // Bytes (within the MQTT packet limit)
+#define LOG_REQUEST_TOPIC_FORMAT "%s/log/req"
+#define LOG_REQUEST_TOPIC_SUFFIX "/log/req"
+#define LOG_RESPONSE_TOPIC_FORMAT "%s/log/resp"
+#define LOG_NTP_SERVER "pool.ntp.org"
+#define BACKFILL_TOPIC_FORMAT "%s/backfill"
+#define BACKFILL_RATE_LIMIT 512           // Bytes per second of backfill
+
+// MQTT connection settings
+#define MQTT_RECONNECT_INTERVAL 5000
+#define MQTT_COALESCE_WINDOW 10           // Milliseconds to gather publications
+#define MQTT_KEEPALIVE_MINIMUM 15         // Seconds idle before a ping, at least
+#define MQTT_KEEPALIVE_MAXIMUM 900        // Seconds idle before a ping, at most
+#define MQTT_REPLY_EXPIRY 60              // Seconds an undelivered reply is kept
+#define MQTT_TELEMETRY_EXPIRY 20          // Hard intervals telemetry is kept
+
+// Broker round trip probes
+#define ECHO_TOPIC_FORMAT "%s/echo"
+#define ECHO_TOPIC_SUFFIX "/echo"
+#define ECHO_MESSAGE_FORMAT "%lu"
+#define PUBLISH_RATE_LATENCY_TARGET 250   // Milliseconds of round trip
+
+// Output command topics
+#define OUTPUT_COMMAND_TOPIC_FORMAT "%s/set/+"
+#define OUTPUT_COMMAND_TOPIC_SUFFIX "/set/"
+#define OUTPUT_ACK_TOPIC_FORMAT "%s/ack/%s"
+#define OUTPUT_ACK_MESSAGE_FORMAT "{ \"seq\": %lu, \"value\": %d, \"result\": \"%s\", \"latency\": %lu }"
+
+// Switch input operating modes
+#define SW_MODE_SWITCH 0
+#define SW_MODE_COUNTER 1
+
+// The output message is sized for the worst case: MULTI001 HTT with
+// every sensor present, 16 DS18B20 probes and every sensor failing,
+// which comes to 146 JSON slots and 742 bytes of copied names in the
+// document and about 3000 characters serialized.
+#define JSON_BUFFER_SIZE 3584
+#define MQTT_STATUS_MESSAGE_SIZE 3200
+#define STATUS_SECTION "status"
+
+/**********************************************************************
+ * Structure to store user configuration. Note that the host network
+ * settings are managed and persisted by the module itself.
+ */
+struct USER_CONFIGURATION { 
+  char servername[40];            // MQTT server Hostname or IP address
+  int  serverport;                // MQTT service port (normally 1883)
+  char username[20];              // Name of user who can publish to the server
+  char password[20];              // Password of named user
+  char topic[60];                 // MQTT topic on which to publish
+  int softpublicationinterval;    // Soft publication interval
+  int hardpublicationinterval;    // Hard publication interval
+  char sw0propertyname[20];       // Property name to use for first SPST switch
+  char sw1propertyname[20];       // Property name to use for second SPST switch
+  int sw0mode;                    // Operating mode of first SPST switch input
+  int sw1mode;                    // Operating mode of second SPST switch input
+  int pulsepublicationinterval;   // Pulse counter publication interval
+  char rules[120];                // Relay rule set
+};
+
+/**********************************************************************
+ * Structure associating a swinging door compressor with a field. The
+ * first three members are user configuration; the remainder hold the
+ * points selected by the compressor until they are published.
+ */
+struct TREND_POINT {
+  int32_t value;
+  unsigned long time;             // Millis
+};
+
+struct TREND_FIELD {
+  const char *field;              // Name of the compressed field
+  int scale;                      // Fixed-point units per field unit
+  SWINGING_DOOR door;             // Compressor (tolerance, max silence)
+  TREND_POINT backlog[TREND_BACKLOG];
+  int backlogCount;
+};
+
+/**********************************************************************
+ * Globals representing WiFi and MQTT entities.
+ */
+WiFiServer wifiServer(AP_PORTAL_SERVICE_PORT);
+
+/**********************************************************************
+ * Globals representing sensor entities. Sensors with a fixed set of
+ * fields are handled by the drivers in the sensors registry.
+ */
+typedef SENSOR_REGISTRY<
+#if FEATURE_AM2320
+  AM2320_SENSOR,
+#endif
+#if FEATURE_I2C_SENSORS
+  SHT3X_SENSOR,
+  BME280_SENSOR,
+  BH1750_SENSOR,
+  SCD4X_SENSOR,
+#endif
+  SENSOR_NONE
+> SENSORS;
+
+#if FEATURE_OCCUPANCY
+OCCUPANCY occupancy;              // SmartDim motion/lux
+PIR_METRICS pirMetrics;           // SmartDim motion intensity
+#endif
+
+#if FEATURE_TILT
+TILT tilt;                        // ADXL345 or tilt switch
+#endif
+
+/**********************************************************************
+ * Alarm rules. Values are in tenths of the reported units and rates
+ * are per minute.
+ */
+ALARM_RULE alarmRules[] = {
+  // field, scale, high, low, rate, window, hysteresis
+  { "temperature", 10, 450, 0, 30, 300000, 10 },
+  { "humidity", 10, 900, ALARM_DISABLED, ALARM_DISABLED, 0, 20 }
+};
+
+/**********************************************************************
+ * Trend compressed fields. Tolerances are in tenths of the reported
+ * units. The table ends at an entry with a null field.
+ */
+TREND_FIELD trendFields[] = {
+  // field, scale, { tolerance, max silence }, e.g.
+  // { "temperature", 10, { 2, 900000 } },
+  // { "humidity", 10, { 10, 900000 } },
+  { 0, 0, { 0, 0 } }
+};
+
+/**********************************************************************
+ * Fields with an in-RAM history. Resolutions are in tenths of the
+ * reported units.
+ */
+HISTORY_FIELD historyFields[] = {
+  // field, scale, resolution, step
+  { "temperature", 10, 1, 60000 },
+  { "humidity", 10, 5, 60000 }
+};
+
+/**********************************************************************
+ * Networks to roam to besides the one configured through the portal
+ * (any of whose access points may be used). An all zero BSSID allows
+ * any access point of the network.
+ */
+ROAM_NETWORK roamNetworks[] = {
+  // ssid, password, bssid, e.g.
+  // { "site-ops", "secret", { 0x24, 0xA4, 0x3C, 0x01, 0x02, 0x03 } },
+  { 0, 0, { 0 } }
+};
+
+/**********************************************************************
+ * Fields logged to flash.
+ */
+#if FEATURE_FLASH_LOG
+FLASH_LOG_FIELD logFields[] = {
+  // field, scale, interval
+  { "temperature", 10, 60000 },
+  { "humidity", 10, 60000 }
+};
+#endif
+
+/**********************************************************************
+ * One-wire buses for DS18B20 temperature sensors.
+ */
+#if FEATURE_DS18B20
+ONE_WIRE_BUS oneWireBuses[] = {
+  // gpio, resolution, conversion interval
+  { GPIO_ONE_WIRE_BUS_0, DS18B20_RESOLUTION, DS18B20_CONVERSION_INTERVAL },
+  // A further bus must not be on a GPIO sampled at boot, e.g.
+  // { GPIO_ONE_WIRE_BUS_1, DS18B20_RESOLUTION, DS18B20_CONVERSION_INTERVAL },
+};
+#endif
+
+/**********************************************************************
+ * GPIO expanders which may be present on the I2C bus. Devices which
+ * do not respond at startup are ignored.
+ */
+#if FEATURE_GPIO_EXPANDER
+GPIO_EXPANDER gpioExpanders[] = {
+  { GPIO_EXPANDER_MCP23017, 0x20, 0xFFFF },
+  { GPIO_EXPANDER_MCP23017, 0x21, 0xFFFF }
+};
+#endif
+
+/**********************************************************************
+ * Outputs which can be switched by local rules.
+ */
+#if FEATURE_RELAY
+OUTPUT_CHANNEL outputs[] = {
+  // name, gpio, active level
+  { "relay", GPIO_RELAY, HIGH }
+};
+
+/**********************************************************************
+ * Signals which local rules can test. Values are in tenths of the
+ * reported units for sensor fields.
+ */
+RULE_SIGNAL ruleSignals[] = {
+  // name, scale
+  { "sw0", 1 },
+  { "sw1", 1 },
+#if FEATURE_AM2320
+  { "temperature", 10 },
+  { "humidity", 10 },
+  { "dewpoint", 10 },
+#endif
+#if FEATURE_OCCUPANCY
+  { "motion", 1 },
+  { "lux", 1 },
+#endif
+};
+#endif
+
+/**********************************************************************
+ * Used by loop() to automatically reconnect to the MQTT server set by
+ * mqttAsyncBegin() if the connection fails for any reason. Starts a
+ * single connection attempt and returns at once, true if the attempt
+ * is under way; loop() sees the outcome in mqttAsyncState(), so that it
+ * carries on with local work while the server is slow or unavailable.
+ */
+boolean connect_to_mqtt(const char* username, const char* password, const char* clientid) {
+  #ifdef DEBUG_SERIAL
+    Serial.print("Trying to connect to MQTT server ");
+    Serial.print(mqttAsync.host); Serial.print(":"); Serial.print(mqttAsync.port);
+    Serial.print(" as ");
+    Serial.print(username); Serial.print("("); Serial.print(password); Serial.print(")");
+    Serial.print(" with client id ");
+    Serial.println(clientid);
+  #endif
+
+  if (mqttAsyncConnect(clientid, username, password)) return(true);
+  #ifdef DEBUG_SERIAL
+    Serial.println("failed. Will try again in 5 seconds.");
+  #endif
+  return(false);
+}
+
+/**********************************************************************
+ * Debug dump the content of the specified configuration object.
+ */
+void dumpConfig(USER_CONFIGURATION &config) {
+  #ifdef DEBUG_SERIAL
+  Serial.print("MQTT server name: "); Serial.println(config.servername);
+  Serial.print("MQTT server port: "); Serial.println(config.serverport);
+  Serial.print("MQTT username: "); Serial.println(config.username);
+  Serial.print("MQTT password: "); Serial.println(config.password);
+  Serial.print("MQTT topic: "); Serial.println(config.topic);
+  Serial.print("MQTT SW0 property name: "); Serial.println(config.sw0propertyname);
+  Serial.print("MQTT SW1 property name: "); Serial.println(config.sw1propertyname);
+  Serial.print("MQTT soft publication interval: "); Serial.println(config.softpublicationinterval);
+  Serial.print("MQTT hard publication interval: "); Serial.println(config.hardpublicationinterval);
+  Serial.print("MQTT SW0 mode: "); Serial.println(config.sw0mode);
+  Serial.print("MQTT SW1 mode: "); Serial.println(config.sw1mode);
+  Serial.print("MQTT pulse publication interval: "); Serial.println(config.pulsepublicationinterval);
+  Serial.print("Relay rules: "); Serial.println(config.rules);
+  #endif
+}
+
+/**********************************************************************
+ * Load the specified configuration object with data from EEPROM.
+ * Members have only ever been appended to USER_CONFIGURATION, so a
+ * record saved by earlier firmware is read as is and the members it
+ * lacks are given their defaults.
+ */
+boolean loadConfig(USER_CONFIGURATION &config) {
+  #ifdef DEBUG_SERIAL
+  Serial.println("Loading module configuration from EEPROM");
+  #endif
+  boolean retval = false;
+  EEPROM.begin(512);
+  uint8_t token = EEPROM.read(PS_IS_CONFIGURED_TOKEN_STORAGE_ADDRESS);
+  if ((token >= PS_IS_CONFIGURED_TOKEN_VALUE_ORIGINAL) && (token <= PS_IS_CONFIGURED_TOKEN_VALUE)) {
+    EEPROM.get(PS_USER_CONFIGURATION_STORAGE_ADDRESS, config);
+    #if defined(HARDWARE_MULTI001)
+    // The original MULTI001 firmware saved only the server settings.
+    if (token < PS_IS_CONFIGURED_TOKEN_VALUE_SWITCH_MODES) {
+      config.softpublicationinterval = CF_DEFAULT_MQTT_PUBLISH_SOFT_INTERVAL;
+      config.hardpublicationinterval = CF_DEFAULT_MQTT_PUBLISH_HARD_INTERVAL;
+      strcpy(config.sw0propertyname, CF_DEFAULT_PROPERTY_NAME_FOR_SW0);
+      strcpy(config.sw1propertyname, CF_DEFAULT_PROPERTY_NAME_FOR_SW1);
+    }
+    #endif
+    if (token < PS_IS_CONFIGURED_TOKEN_VALUE_SWITCH_MODES) {
+      config.sw0mode = CF_DEFAULT_SW_MODE;
+      config.sw1mode = CF_DEFAULT_SW_MODE;
+      config.pulsepublicationinterval = CF_DEFAULT_PULSE_PUBLISH_INTERVAL;
+    }
+    if (token < PS_IS_CONFIGURED_TOKEN_VALUE_RULES) {
+      strcpy(config.rules, CF_DEFAULT_RULES);
+    }
+    retval = true;
+  }
+  EEPROM.end();
+  #ifdef DEBUG_SERIAL
+  dumpConfig(config);
+  #endif
+  return(retval);
+}
+
+/**********************************************************************
+ * Save the specified configuration object to EEPROM.
+ */
+void saveConfig(USER_CONFIGURATION &config) {
+  #ifdef DEBUG_SERIAL
+  Serial.println("Saving module configuration to EEPROM");
+  dumpConfig(config);
+  #endif
+  EEPROM.begin(512);
+  EEPROM.write(PS_IS_CONFIGURED_TOKEN_STORAGE_ADDRESS, PS_IS_CONFIGURED_TOKEN_VALUE);
+  EEPROM.put(PS_USER_CONFIGURATION_STORAGE_ADDRESS, config);
+  EEPROM.commit();
+  EEPROM.end();
+}
+ 
+/**********************************************************************
+ * Load the specified keepalive record with the values learned before
+ * the last restart. The record is left invalid if there are none.
+ */
+void loadKeepalive(KEEPALIVE_RECORD &record) {
+  EEPROM.begin(512);
+  EEPROM.get(PS_KEEPALIVE_STORAGE_ADDRESS, record);
+  EEPROM.end();
+}
+
+/**********************************************************************
+ * Save the specified keepalive record to EEPROM.
+ */
+void saveKeepalive(KEEPALIVE_RECORD &record) {
+  #ifdef DEBUG_SERIAL
+  Serial.print("Saving keepalive interval "); Serial.print(record.interval);
+  Serial.print("s (ceiling "); Serial.print(record.ceiling); Serial.println("s)");
+  #endif
+  EEPROM.begin(512);
+  EEPROM.put(PS_KEEPALIVE_STORAGE_ADDRESS, record);
+  EEPROM.commit();
+  EEPROM.end();
+}
+
+/**********************************************************************
+ * Method called when the user updates the module configuration through
+ * the captive portal and a global variable which is used to flag this
+ * fact for subsequent action.
+ */
+
+bool shouldSaveConfig = false;
+
+void saveConfigCallback() {
+  shouldSaveConfig = true; 
+}
+
+byte macAddress[6];
+char moduleId[40];
+USER_CONFIGURATION mqttConfig;
+boolean userConfigurationLoaded = false;
+StaticJsonDocument<JSON_BUFFER_SIZE> jsonBuffer;
+#if FEATURE_FLASH_LOG
+uint16_t backfillToken = 0;
+size_t backfillBytes = 0;
+#endif
+
+/**********************************************************************
+ * Publish the current condition of <rule> to its alarm topic. Returns
+ * false if the publication could not be queued.
+ */
+boolean publishAlarm(ALARM_RULE &rule) {
+  char topic[100];
+  char payload[80];
+
+  snprintf(topic, sizeof(topic), ALARM_TOPIC_FORMAT, mqttConfig.topic, rule.field);
+  sprintf(payload, ALARM_MESSAGE_FORMAT, alarmConditionName(rule), ((double) rule.value / rule.scale), ((double) rule.currentRate / rule.scale));
+  if (!mqttAsyncPublish(topic, payload, true)) return(false);
+
+  #ifdef DEBUG_SERIAL
+    Serial.print("Publishing ");
+    Serial.print(payload);
+    Serial.print(" to ");
+    Serial.println(topic);
+  #endif
+  return(true);
+}
+
+/**********************************************************************
+ * Handle a message on one of our subscribed topics. This is called from
+ * the TCP stack as soon as the message arrives, so work here is kept to
+ * a minimum: commands are parsed in place and applied at once, and
+ * acknowledgements and history replies are published later by loop().
+ */
+void mqttCallback(char *topic, byte *payload, unsigned int length) {
+  size_t prefix = strlen(mqttConfig.topic);
+
+  if (strncmp(topic, mqttConfig.topic, prefix) != 0) return;
+  if (strcmp(topic + prefix, ECHO_TOPIC_SUFFIX) == 0) {
+    publishRateEcho((const char *) payload, length, millis());
+    return;
+  }
+  if (strcmp(topic + prefix, HISTORY_REQUEST_TOPIC_SUFFIX) == 0) {
+    historyRequest((const char *) payload, length);
+    return;
+  }
+  #if FEATURE_FLASH_LOG
+  if (strcmp(topic + prefix, LOG_REQUEST_TOPIC_SUFFIX) == 0) {
+    flashLogRequest((const char *) payload, length);
+    return;
+  }
+  #endif
+  #if FEATURE_RELAY
+  int output;
+  if (strncmp(topic + prefix, OUTPUT_COMMAND_TOPIC_SUFFIX, strlen(OUTPUT_COMMAND_TOPIC_SUFFIX)) != 0) return;
+  if ((output = outputFind(topic + prefix + strlen(OUTPUT_COMMAND_TOPIC_SUFFIX))) < 0) return;
+  if (outputCommand(output, (const char *) payload, length, micros())) ruleCancelTimers(output);
+  #endif
+}
+
+/**********************************************************************
+ * Called with the outcome of each ping. A ping lost because our own
+ * WiFi link is down says nothing about the path to the broker.
+ */
+void mqttPinged(unsigned long idle, boolean answered) {
+  if ((answered) || (WiFi.status() == WL_CONNECTED)) keepaliveResult(idle, answered);
+  mqttAsyncPingInterval(keepaliveInterval());
+}
+
+/**********************************************************************
+ * Publish the record of the last roam. Returns false if the
+ * publication could not be queued.
+ */
+boolean publishRoam(ROAM_EVENT &event) {
+  char topic[100];
+  char payload[140];
+  char from[18], to[18];
+
+  snprintf(from, sizeof(from), "%02x:%02x:%02x:%02x:%02x:%02x", event.from[0], event.from[1], event.from[2], event.from[3], event.from[4], event.from[5]);
+  snprintf(to, sizeof(to), "%02x:%02x:%02x:%02x:%02x:%02x", event.to[0], event.to[1], event.to[2], event.to[3], event.to[4], event.to[5]);
+  snprintf(topic, sizeof(topic), ROAM_TOPIC_FORMAT, mqttConfig.topic);
+  snprintf(payload, sizeof(payload), ROAM_MESSAGE_FORMAT, from, to, event.duration, (long) event.rssiBefore, (long) event.rssiAfter);
+  if (!mqttAsyncPublish(topic, payload)) return(false);
+
+  #ifdef DEBUG_SERIAL
+    Serial.print("Publishing ");
+    Serial.print(payload);
+    Serial.print(" to ");
+    Serial.println(topic);
+  #endif
+  return(true);
+}
+
+#if FEATURE_FLASH_LOG
+/**********************************************************************
+ * Called when a publication completes or fails. The outcome of a
+ * backfill chunk, and the time the broker took to take it, steer the
+ * backfill rate.
+ */
+void mqttSent(uint16_t token, boolean ok, unsigned long latency) {
+  if ((backfillToken) && (token == backfillToken)) {
+    backfillToken = 0;
+    backfillResult(ok, latency, backfillBytes, millis());
+  }
+}
+#endif
+
+#if FEATURE_RELAY
+
+/**********************************************************************
+ * Publish the acknowledgement of the last command to <output>. Returns
+ * false if the publication could not be queued.
+ */
+boolean publishOutputAck(OUTPUT_CHANNEL &output) {
+  char topic[100];
+  char payload[100];
+
+  snprintf(topic, sizeof(topic), OUTPUT_ACK_TOPIC_FORMAT, mqttConfig.topic, output.name);
+  snprintf(payload, sizeof(payload), OUTPUT_ACK_MESSAGE_FORMAT, (unsigned long) output.ackSequence, (int) output.state, outputAckResultName(output), output.ackLatency);
+  if (!mqttAsyncPublish(topic, payload, false, MQTT_REPLY_EXPIRY)) return(false);
+
+  #ifdef DEBUG_SERIAL
+    Serial.print("Publishing ");
+    Serial.print(payload);
+    Serial.print(" to ");
+    Serial.println(topic);
+  #endif
+  return(true);
+}
+#endif
+
+/**********************************************************************
+ * Publish the points held for <trend>, oldest first, for as long as
+ * they can be queued.
+ */
+void trendPublish(TREND_FIELD &trend, unsigned long now) {
+  char topic[100];
+  char payload[60];
+
+  while (trend.backlogCount) {
+    TREND_POINT &point = trend.backlog[0];
+    snprintf(topic, sizeof(topic), TREND_TOPIC_FORMAT, mqttConfig.topic, trend.field);
+    sprintf(payload, TREND_MESSAGE_FORMAT, ((double) point.value / trend.scale), (now - point.time));
+    if (!mqttAsyncPublish(topic, payload)) break;
+    memmove(trend.backlog, trend.backlog + 1, (--trend.backlogCount * sizeof(TREND_POINT)));
+  }
+}
+
+/**********************************************************************
+ * Feed <value> of <field>, sampled at <now>, to the field's trend
+ * compressor and publish any point that results. A point which cannot
+ * be published yet is held (the oldest being dropped once TREND_BACKLOG
+ * are held) and sent by trendService(). Returns false if the field is
+ * not trend compressed.
+ */
+boolean trendSample(const char *field, int32_t value, unsigned long now) {
+  for (unsigned int i = 0; trendFields[i].field; i++) {
+    TREND_FIELD &trend = trendFields[i];
+    if (strcmp(trend.field, field) == 0) {
+      if (swingingDoorSample(trend.door, value, now)) {
+        if (trend.backlogCount == TREND_BACKLOG) memmove(trend.backlog, trend.backlog + 1, (--trend.backlogCount * sizeof(TREND_POINT)));
+        trend.backlog[trend.backlogCount++] = { trend.door.outputValue, trend.door.outputTime };
+        trendPublish(trend, now);
+      }
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/**********************************************************************
+ * Called on every pass of loop() to publish held trend points.
+ */
+void trendService(unsigned long now) {
+  for (unsigned int i = 0; trendFields[i].field; i++) {
+    if (trendFields[i].backlogCount) trendPublish(trendFields[i], now);
+  }
+}
+
+/**********************************************************************
+ * Reflect the <health> of the sensor called <name> in the status
+ * section of the output message.
+ */
+void statusUpdate(const char *name, SENSOR_HEALTH &health) {
+  if (sensorHealthState(health) == SENSOR_STATE_OK) {
+    jsonBuffer[STATUS_SECTION].remove(name);
+    if (jsonBuffer[STATUS_SECTION].size() == 0) jsonBuffer.remove(STATUS_SECTION);
+  } else {
+    jsonBuffer[STATUS_SECTION][name]["state"] = sensorHealthStateName(health);
+    jsonBuffer[STATUS_SECTION][name]["failures"] = health.failures;
+    jsonBuffer[STATUS_SECTION][name]["error"] = sensorHealthErrorName(health);
+    jsonBuffer[STATUS_SECTION][name]["lastgood"] = (health.lastGood / 1000);
+  }
+}
+
+/**********************************************************************
+ * Sink for registered sensor fields. Every valid sample is checked
+ * against alarm rules, passed to local rules and trend compression and,
+ * if it moves outside its deadband or its alarm is boosting it, updates
+ * the output message. Fields
+ * of a failed sample are removed from the output message and changes
+ * in sensor health update its status section.
+ */
+struct STATUS_SINK {
+  unsigned long now;
+  boolean dirty;                  // Output message needs publishing
+
+  void field(SENSOR_FIELD &field, int32_t value, boolean valid) {
+    if (valid) {
+      alarmSample(field.name, value, now);
+      #if FEATURE_RELAY
+      ruleSignalSet(field.name, value);
+      #endif
+      historySample(field.name, value);
+      #if FEATURE_FLASH_LOG
+      flashLogSample(field.name, value);
+      #endif
+      boolean trended = trendSample(field.name, value, now);
+      boolean boosted = alarmBoosted(field.name, now);
+      if ((deadbandExceeded(field.deadband, value)) || (boosted)) {
+        if (field.decimals) jsonBuffer[field.name] = sensorFieldValue(field, value); else jsonBuffer[field.name] = (int) sensorFieldValue(field, value);
+        if ((!trended) || (boosted)) dirty = true;
+      }
+    } else {
+      #if FEATURE_RELAY
+      ruleSignalInvalidate(field.name);
+      #endif
+      if (!jsonBuffer[field.name].isNull()) {
+        jsonBuffer.remove(field.name);
+        deadbandReset(field.deadband);
+        dirty = true;
+      }
+    }
+  }
+
+  void health(const char *name, SENSOR_HEALTH &health) {
+    statusUpdate(name, health);
+    dirty = true;
+  }
+};
+
+void setup() {
+  
+  #ifdef DEBUG_SERIAL
+  // Nothing is read from the serial port, which leaves RX free for use
+  // as an input.
+  Serial.begin(57600, SERIAL_8N1, SERIAL_TX_ONLY);
+  delay(DEBUG_SERIAL_START_DELAY);
+  #endif
+
+  #if FEATURE_RELAY
+  // Make sure outputs are off whilst we configure ourselves.
+  outputBegin(outputs, (sizeof(outputs) / sizeof(OUTPUT_CHANNEL)));
+  #endif
+
+  // Recover device MAC address and make from it a module identifier
+  // that will be used as access point name, MQTT client id and a
+  // component of the topic path (unless overriden by the user).
+  WiFi.macAddress(macAddress);
+  sprintf(moduleId, MODULE_ID_FORMAT, macAddress[0], macAddress[1], macAddress[2], macAddress[3], macAddress[4], macAddress[5]);
+  char defaultTopic[60];
+  char buffer[10];
+  sprintf(defaultTopic, CF_DEFAULT_MQTT_TOPIC_FORMAT, moduleId);
+
+  // Try to load user configuration
+  userConfigurationLoaded = loadConfig(mqttConfig);
+
+  // Initialise the WiFi portal with either the just loaded data or
+  // with some anaemic defaults.
+  WiFiManager wifiManager;
+  if (!userConfigurationLoaded) wifiManager.resetSettings();
+  WiFiManagerParameter custom_mqtt_servername("server", "mqtt server", (userConfigurationLoaded)?mqttConfig.servername:"", 40);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.serverport:CF_DEFAULT_MQTT_SERVICE_PORT);
+  WiFiManagerParameter custom_mqtt_serverport("port", "mqtt port", buffer, 6);
+  WiFiManagerParameter custom_mqtt_username("user", "mqtt user", (userConfigurationLoaded)?mqttConfig.username:"", 20);
+  WiFiManagerParameter custom_mqtt_password("pass", "mqtt pass", (userConfigurationLoaded)?mqttConfig.password:"", 20);
+  WiFiManagerParameter custom_mqtt_topic("topic", "mqtt topic", (userConfigurationLoaded)?mqttConfig.topic:defaultTopic, 40);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.softpublicationinterval:CF_DEFAULT_MQTT_PUBLISH_SOFT_INTERVAL);
+  WiFiManagerParameter custom_mqtt_softinterval("softinterval", "mqtt soft interval", buffer, 6);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.hardpublicationinterval:CF_DEFAULT_MQTT_PUBLISH_HARD_INTERVAL);
+  WiFiManagerParameter custom_mqtt_hardinterval("hardinterval", "mqtt hard interval", buffer, 6);
+  WiFiManagerParameter custom_mqtt_sw0_alias("sw0alias", "alias for sw0", (userConfigurationLoaded)?mqttConfig.sw0propertyname:CF_DEFAULT_PROPERTY_NAME_FOR_SW0, 20);
+  WiFiManagerParameter custom_mqtt_sw1_alias("sw1alias", "alias for sw1", (userConfigurationLoaded)?mqttConfig.sw1propertyname:CF_DEFAULT_PROPERTY_NAME_FOR_SW1, 20);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.sw0mode:CF_DEFAULT_SW_MODE);
+  WiFiManagerParameter custom_mqtt_sw0_mode("sw0mode", "sw0 mode (0=switch, 1=counter)", buffer, 2);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.sw1mode:CF_DEFAULT_SW_MODE);
+  WiFiManagerParameter custom_mqtt_sw1_mode("sw1mode", "sw1 mode (0=switch, 1=counter)", buffer, 2);
+  sprintf(buffer, "%d", (userConfigurationLoaded)?mqttConfig.pulsepublicationinterval:CF_DEFAULT_PULSE_PUBLISH_INTERVAL);
+  WiFiManagerParameter custom_mqtt_pulseinterval("pulseinterval", "pulse counter interval", buffer, 6);
+  #if FEATURE_RELAY
+  WiFiManagerParameter custom_mqtt_rules("rules", "relay rules", (userConfigurationLoaded)?mqttConfig.rules:CF_DEFAULT_RULES, (sizeof(mqttConfig.rules) - 1));
+  #endif
+  
+  // Create a WiFiManager instance and configure it.
+  wifiManager.setConfigPortalTimeout(AP_PORTAL_TIMEOUT);
+  wifiManager.setSaveConfigCallback(saveConfigCallback);
+  wifiManager.setBreakAfterConfig(true);
+  wifiManager.addParameter(&custom_mqtt_servername);
+  wifiManager.addParameter(&custom_mqtt_serverport);
+  wifiManager.addParameter(&custom_mqtt_username);
+  wifiManager.addParameter(&custom_mqtt_password);
+  wifiManager.addParameter(&custom_mqtt_topic);
+  wifiManager.addParameter(&custom_mqtt_softinterval);
+  wifiManager.addParameter(&custom_mqtt_hardinterval);
+  wifiManager.addParameter(&custom_mqtt_sw0_alias);
+  wifiManager.addParameter(&custom_mqtt_sw1_alias);
+  wifiManager.addParameter(&custom_mqtt_sw0_mode);
+  wifiManager.addParameter(&custom_mqtt_sw1_mode);
+  wifiManager.addParameter(&custom_mqtt_pulseinterval);
+  #if FEATURE_RELAY
+  wifiManager.addParameter(&custom_mqtt_rules);
+  #endif
+  
+  // Finally, start the WiFi manager. 
+  bool res = wifiManager.autoConnect(moduleId);
+
+  // When we reach this point, the WiFi manager may have connected to
+  // its host network or not as indicated by the value of res.
+  //
+  // In either case, it may have been in configuration mode and had its
+  // configuration settings changed (as indicated by shouldSaveConfig)
+  // and we need in this case to make sure we preserve our user
+  // configuration.
+  
+  if (shouldSaveConfig) {
+    strcpy(mqttConfig.servername, custom_mqtt_servername.getValue());
+    mqttConfig.serverport = atoi(custom_mqtt_serverport.getValue());
+    strcpy(mqttConfig.username, custom_mqtt_username.getValue());
+    strcpy(mqttConfig.password, custom_mqtt_password.getValue());
+    strcpy(mqttConfig.topic, custom_mqtt_topic.getValue());
+    mqttConfig.softpublicationinterval = atoi(custom_mqtt_softinterval.getValue());
+    mqttConfig.hardpublicationinterval = atoi(custom_mqtt_hardinterval.getValue());
+    strcpy(mqttConfig.sw0propertyname, custom_mqtt_sw0_alias.getValue());
+    strcpy(mqttConfig.sw1propertyname, custom_mqtt_sw1_alias.getValue());
+    mqttConfig.sw0mode = atoi(custom_mqtt_sw0_mode.getValue());
+    mqttConfig.sw1mode = atoi(custom_mqtt_sw1_mode.getValue());
+    mqttConfig.pulsepublicationinterval = atoi(custom_mqtt_pulseinterval.getValue());
+    #if FEATURE_RELAY
+    strlcpy(mqttConfig.rules, custom_mqtt_rules.getValue(), sizeof(mqttConfig.rules));
+    #endif
+    saveConfig(mqttConfig);
+  }
+
+  // If we are connected to our host network, then we can continue into
+  // production; if not, then let's reboot and go around again.
+  if (!res) {
+    #ifdef DEBUG_SERIAL
+      Serial.println("WiFi configuration or connection failure: restarting system.");
+    #endif
+    #if FEATURE_TILT
+    Wire.begin(GPIO_SDA, GPIO_SCL);
+    tiltQuiet();
+    #endif
+    ESP.restart();
+  } else {
+    #ifdef DEBUG_SERIAL
+      Serial.print("Connected to wireless network '");
+      Serial.print(WiFi.SSID());
+      Serial.println("'");
+    #endif
+
+    // We have a WiFi connection, so configure the MQTT connection. 
+    // We'll leave actually registering with the MQTT server until we
+    // are in the loop().
+    roamBegin(roamNetworks, millis());
+    mqttAsyncBegin(mqttConfig.servername, mqttConfig.serverport, mqttCallback, MQTT_COALESCE_WINDOW);
+    KEEPALIVE_RECORD keepaliveSaved;
+    loadKeepalive(keepaliveSaved);
+    keepaliveBegin(MQTT_KEEPALIVE_MINIMUM, MQTT_KEEPALIVE_MAXIMUM, keepaliveSaved);
+    mqttAsyncKeepalive(MQTT_KEEPALIVE_MAXIMUM);
+    mqttAsyncPingInterval(keepaliveInterval());
+    mqttAsyncOnPing(mqttPinged);
+    #if FEATURE_FLASH_LOG
+    mqttAsyncOnSent(mqttSent);
+    #endif
+
+    #if FEATURE_FLASH_LOG
+    // The flash log clock steps to UTC once SNTP has set the time.
+    configTime(0, 0, LOG_NTP_SERVER);
+    #endif
+
+    // Time now to detect, set-up and initialise any connected sensors.
+
+    Serial.print("Detected sensors: ");
+
+    #if (FEATURE_DS18B20 || FEATURE_GPIO_EXPANDER)
+    char deviceName[20];
+    #endif
+
+    #if FEATURE_DS18B20
+    // Dallas one-wire temperature sensors
+    if (oneWireBusBegin(oneWireBuses, (sizeof(oneWireBuses) / sizeof(ONE_WIRE_BUS)))) {
+      for (unsigned int b = 0; b < (sizeof(oneWireBuses) / sizeof(ONE_WIRE_BUS)); b++) {
+        for (int i = 0; i < oneWireBuses[b].deviceCount; i++) {
+          uint8_t *deviceAddress = oneWireBuses[b].addresses[i];
+          sprintf(deviceName, DS18B20_NAME_FORMAT, deviceAddress[0], deviceAddress[1], deviceAddress[2], deviceAddress[3], deviceAddress[4], deviceAddress[5], deviceAddress[6], deviceAddress[7]);
+          Serial.print(deviceName);
+          Serial.print(" ");
+        }
+      }
+    }
+    #endif
+
+    #if (FEATURE_AM2320 || FEATURE_GPIO_EXPANDER || FEATURE_I2C_SENSORS || FEATURE_TILT)
+    Wire.begin(GPIO_SDA, GPIO_SCL);
+    #endif
+
+    #if FEATURE_I2C_SENSORS
+    // Find I2C sensors (cached over a warm boot)
+    if (i2cBusScan()) Serial.print("(cached I2C scan) ");
+    #endif
+
+    #if FEATURE_GPIO_EXPANDER
+    // GPIO expander initialisation
+    if (gpioExpanderBegin(gpioExpanders, (sizeof(gpioExpanders) / sizeof(GPIO_EXPANDER)), GPIO_EXPANDER_INT)) {
+      for (unsigned int i = 0; i < (sizeof(gpioExpanders) / sizeof(GPIO_EXPANDER)); i++) {
+        if (gpioExpanders[i].present) {
+          sprintf(deviceName, GPIO_EXPANDER_NAME_FORMAT, gpioExpanders[i].address);
+          jsonBuffer[deviceName] = gpioExpanders[i].state;
+          Serial.print(deviceName);
+          Serial.print(" ");
+        }
+      }
+    }
+    #endif
+
+    // Registered sensor drivers
+    SENSORS::begin(Serial);
+
+    #if FEATURE_TILT
+    // Tilt and vibration
+    Serial.print((tiltBegin(tilt, GPIO_TILT_INT) == TILT_ADXL345)?"ADXL345 ":"tilt-switch ");
+    jsonBuffer["tilt-events"] = tilt.events;
+    jsonBuffer["tilt-orientation"] = tiltOrientationName(tilt);
+    #endif
+
+    #if FEATURE_OCCUPANCY
+    // SmartDim motion and lux
+    Serial.print("SmartDim ");
+    pinMode(GPIO_PIR_SENSOR, INPUT);
+    occupancyBegin(occupancy, { OCCUPANCY_HOLD_TIME, OCCUPANCY_RETRIGGER_WINDOW, OCCUPANCY_DOOR_GPIO, OCCUPANCY_LUX_THRESHOLD });
+    pirMetricsBegin(GPIO_PIR_SENSOR, millis());
+    #endif
+
+    // SW0
+    Serial.print(mqttConfig.sw0propertyname);
+    Serial.print(" ");
+    if (mqttConfig.sw0mode == SW_MODE_COUNTER) {
+      pulseCounterBegin(0, GPIO_SW0);
+    } else {
+      pinMode(GPIO_SW0, INPUT_PULLUP);
+    }
+
+    // SW1
+    Serial.print(mqttConfig.sw1propertyname);
+    Serial.print(" ");
+    if (mqttConfig.sw1mode == SW_MODE_COUNTER) {
+      pulseCounterBegin(1, GPIO_SW1);
+    } else {
+      pinMode(GPIO_SW1, INPUT_PULLUP);
+    }
+
+    #ifdef GPIO_SW2
+    // SW2 and SW3
+    Serial.print("sw2 sw3 ");
+    pinMode(GPIO_SW2, INPUT_PULLUP);
+    pinMode(GPIO_SW3, INPUT_PULLUP);
+    #endif
+
+    Serial.println();
+    // End of sensor detection
+
+    alarmBegin(alarmRules, (sizeof(alarmRules) / sizeof(ALARM_RULE)));
+    historyBegin(historyFields, (sizeof(historyFields) / sizeof(HISTORY_FIELD)), millis());
+    publishRateBegin(PUBLISH_RATE_LATENCY_TARGET, millis());
+    #if FEATURE_FLASH_LOG
+    if (!flashLogBegin(logFields, (sizeof(logFields) / sizeof(FLASH_LOG_FIELD)), millis())) {
+      #ifdef DEBUG_SERIAL
+        Serial.println("Flash log unavailable");
+      #endif
+    }
+    backfillBegin(BACKFILL_RATE_LIMIT, millis());
+    #endif
+
+    #if FEATURE_RELAY
+    // Local relay rules
+    ruleBegin(ruleSignals, (sizeof(ruleSignals) / sizeof(RULE_SIGNAL)));
+    int compiled = ruleCompile(mqttConfig.rules);
+    #ifdef DEBUG_SERIAL
+      Serial.print("Relay rules: ");
+      if (compiled < 0) Serial.println("error (ignored)"); else Serial.println(compiled);
+    #endif
+    jsonBuffer["relay"] = (int) outputState(0);
+    #endif
+    
+  }
+}
+
+/**********************************************************************
+ * Begin by sampling the switch inputs and evaluating the relay rules,
+ * so that local control does not wait on the network. Then check that
+ * we have an active MQTT connection and, if not, try to make one no
+ * more than once every MQTT_RECONNECT_INTERVAL milliseconds.
+ * 
+ * Once every CF_DEFAULT_MQTT_PUBLISH_SOFT_INTERVAL miliseconds read the sensors.
+ * If the sensor values have changed from those most recently published
+ * or CF_DEFAULT_MQTT_PUBLISH_HARD_INTERVAL has elapsed then update the configured
+ * topic on the connected MQTT server.
+ *
+ * GPIO expander inputs are serviced on every pass and a debounced
+ * change results in an immediate update. SmartDim motion and lux are
+ * sampled every OCCUPANCY_SAMPLE_INTERVAL milliseconds and a change in
+ * occupancy results in an immediate update. The end of a tilt event
+ * results in an immediate update.
+ *
+ * Such events, relay changes and alarms are urgent and always published
+ * at once. Other changes are telemetry, which is held off while the
+ * broker round trip time is high.
+ */
+void loop() {
+  static long mqttPublishSoftDeadline = 0L;
+  static long mqttPublishHardDeadline = 0L;
+  static long mqttReconnectDeadline = 0L;
+  static boolean mqttWasConnected = false;
+  static long historyChunkDeadline = 0L;
+  static char replyChunk[HISTORY_CHUNK_SIZE];
+  static const char *replyTopicFormat = 0; // Of a chunk not yet queued
+  static long telemetryDeadline = 0L;
+  static boolean telemetryPending = false;
+  #if FEATURE_OCCUPANCY
+  static long occupancySampleDeadline = 0L;
+  #endif
+  static char mqttStatusMessage[MQTT_STATUS_MESSAGE_SIZE];
+  char deviceName[28];
+  long now = millis();
+  int dirty = false;
+  int urgent = false;
+
+  #if FEATURE_RELAY
+  // Local rules see switch changes on every pass.
+  if (!pulseCounterEnabled(0)) ruleSignalSet("sw0", digitalRead(GPIO_SW0));
+  if (!pulseCounterEnabled(1)) ruleSignalSet("sw1", digitalRead(GPIO_SW1));
+  ruleService(now);
+  if (outputCollect(0)) { jsonBuffer["relay"] = (int) outputState(0); urgent = true; }
+  #endif
+
+  // A poor WiFi link is replaced by a better access point, if one is
+  // known and in range. The roam is reported once we are back online
+  // and stays pending until the report has been queued.
+  roamService(now);
+  if ((mqttAsyncConnected()) && (roamPending()) && (publishRoam(roaming.roamLast))) roamCollect();
+
+  // If we aren't connected to the MQTT server then start a connection
+  // attempt now. The attempt proceeds in the background and failed
+  // attempts are retried on later passes, so that local work carries
+  // on while the server is unavailable. Doing this in the loop
+  // eliminates issues with transient server connection errors.
+  if ((mqttAsyncState() == MQTT_ASYNC_DISCONNECTED) && (now > mqttReconnectDeadline)) {
+    connect_to_mqtt(mqttConfig.username, mqttConfig.password, moduleId);
+    mqttReconnectDeadline = (now + MQTT_RECONNECT_INTERVAL);
+  }
+
+  // Subscribe once the broker has accepted the connection.
+  if (mqttAsyncConnected() != mqttWasConnected) {
+    mqttWasConnected = mqttAsyncConnected();
+    #ifdef DEBUG_SERIAL
+      Serial.print((mqttWasConnected)?"MQTT connected":"MQTT disconnected");
+      Serial.print(" ("); Serial.print(mqttAsync.packets); Serial.print(" packets in ");
+      Serial.print(mqttAsync.writes); Serial.println(" writes)");
+    #endif
+    if (mqttWasConnected) {
+      char topic[100];
+      snprintf(topic, sizeof(topic), ECHO_TOPIC_FORMAT, mqttConfig.topic);
+      mqttAsyncSubscribe(topic);
+      publishRateReset(now);
+      snprintf(topic, sizeof(topic), HISTORY_REQUEST_TOPIC_FORMAT, mqttConfig.topic);
+      mqttAsyncSubscribe(topic);
+      #if FEATURE_FLASH_LOG
+      snprintf(topic, sizeof(topic), LOG_REQUEST_TOPIC_FORMAT, mqttConfig.topic);
+      mqttAsyncSubscribe(topic);
+      #endif
+      #if FEATURE_RELAY
+      snprintf(topic, sizeof(topic), OUTPUT_COMMAND_TOPIC_FORMAT, mqttConfig.topic);
+      mqttAsyncSubscribe(topic);
+      #endif
+    }
+  }
+  
+  // Perform some mandatory connection houskeeping. Incoming messages
+  // are handled as they arrive, not from in here.
+  mqttAsyncService(now);
+  if (keepaliveChanged()) saveKeepalive(keepalive.learned);
+  #if FEATURE_RELAY
+  for (unsigned int i = 0; i < (sizeof(outputs) / sizeof(OUTPUT_CHANNEL)); i++) {
+    if ((outputAckPending(i)) && (publishOutputAck(outputs[i]))) outputAckCollect(i);
+  }
+  #endif
+
+  // History and log replies are paced so that a long reply does not
+  // flood the connection. A chunk which cannot be queued is held and
+  // tried again, so that a reply never has a hole in it.
+  if ((now > historyChunkDeadline) && (mqttAsyncConnected())) {
+    char topic[100];
+    if ((!replyTopicFormat) && (historyNextChunk(replyChunk, sizeof(replyChunk)))) replyTopicFormat = HISTORY_RESPONSE_TOPIC_FORMAT;
+    #if FEATURE_FLASH_LOG
+    if ((!replyTopicFormat) && (flashLogNextChunk(replyChunk, sizeof(replyChunk), now))) replyTopicFormat = LOG_RESPONSE_TOPIC_FORMAT;
+    #endif
+    if (replyTopicFormat) {
+      snprintf(topic, sizeof(topic), replyTopicFormat, mqttConfig.topic);
+      if (mqttAsyncPublish(topic, replyChunk, false, MQTT_REPLY_EXPIRY)) replyTopicFormat = 0;
+    }
+    historyChunkDeadline = (now + HISTORY_CHUNK_INTERVAL);
+  }
+
+  #if FEATURE_OCCUPANCY
+  // Motion and lux drive the occupancy state machine.
+  if (now > occupancySampleDeadline) {
+    int motion = digitalRead(GPIO_PIR_SENSOR);
+    int lux = (int) (analogRead(GPIO_LUX_SENSOR) * LUX_FACTOR);
+    lux = (lux > 1023)?1023:lux;
+    #if FEATURE_RELAY
+    ruleSignalSet("motion", motion);
+    ruleSignalSet("lux", lux);
+    #endif
+    jsonBuffer["motion"] = motion;
+    jsonBuffer["lux"] = lux;
+    if (occupancyUpdate(occupancy, now, motion, lux)) urgent = true;
+    jsonBuffer["occupancy"] = occupancyStateName(occupancy);
+    occupancySampleDeadline = (now + OCCUPANCY_SAMPLE_INTERVAL);
+  }
+
+  // Motion intensity is summarised once per window.
+  if (pirMetricsService(now, PIR_METRICS_WINDOW, pirMetrics)) {
+    jsonBuffer["motion-active"] = pirMetrics.activePermille / 10.0;
+    jsonBuffer["motion-triggers"] = pirMetrics.triggers;
+    jsonBuffer["motion-idle"] = round(pirMetrics.longestIdle / 100.0) / 10.0;
+    dirty = true;
+  }
+  #endif
+
+  #if FEATURE_GPIO_EXPANDER
+  // Service the expander input bank. This only touches the I2C bus if
+  // an expander has raised an interrupt.
+  if (gpioExpanderService(now)) {
+    for (unsigned int i = 0; i < (sizeof(gpioExpanders) / sizeof(GPIO_EXPANDER)); i++) {
+      if (gpioExpanderCollect(i)) {
+        sprintf(deviceName, GPIO_EXPANDER_NAME_FORMAT, gpioExpanders[i].address);
+        jsonBuffer[deviceName] = gpioExpanders[i].state;
+        urgent = true;
+      }
+    }
+  }
+  #endif
+
+  #if FEATURE_TILT
+  // Tilt events are interrupt driven; this only touches the I2C bus if
+  // the accelerometer has raised an interrupt or an event is ending.
+  if (tiltService(tilt, now)) {
+    jsonBuffer["tilt-events"] = tilt.events;
+    if (tilt.device == TILT_ADXL345) jsonBuffer["tilt-peak"] = round(tilt.peak / 10.0) / 100.0;
+    jsonBuffer["tilt-orientation"] = tiltOrientationName(tilt);
+    urgent = true;
+  }
+  #endif
+
+  // Pulse counters update at their own rate.
+  if (pulseCounterService(now, mqttConfig.pulsepublicationinterval)) {
+    if (pulseCounterEnabled(0)) {
+      jsonBuffer[mqttConfig.sw0propertyname] = pulseCounterCount(0);
+      sprintf(deviceName, PULSE_RATE_NAME_FORMAT, mqttConfig.sw0propertyname);
+      jsonBuffer[deviceName] = round(pulseCounterRate(0) * 100) / 100.0;
+    }
+    if (pulseCounterEnabled(1)) {
+      jsonBuffer[mqttConfig.sw1propertyname] = pulseCounterCount(1);
+      sprintf(deviceName, PULSE_RATE_NAME_FORMAT, mqttConfig.sw1propertyname);
+      jsonBuffer[deviceName] = round(pulseCounterRate(1) * 100) / 100.0;
+    }
+    dirty = true;
+  }
+
+  #if FEATURE_DS18B20
+  // DS18B20 sensors convert and are read back on their own schedule.
+  if (oneWireBusService(now)) {
+    for (unsigned int b = 0; b < (sizeof(oneWireBuses) / sizeof(ONE_WIRE_BUS)); b++) {
+      if (oneWireBusCollect(b)) {
+        for (int i = 0; i < oneWireBuses[b].deviceCount; i++) {
+          uint8_t *deviceAddress = oneWireBuses[b].addresses[i];
+          sprintf(deviceName, DS18B20_NAME_FORMAT, deviceAddress[0], deviceAddress[1], deviceAddress[2], deviceAddress[3], deviceAddress[4], deviceAddress[5], deviceAddress[6], deviceAddress[7]);
+          if (oneWireBuses[b].valid[i]) {
+            int temperature = (int) round(oneWireBuses[b].temperatures[i]);
+            alarmSample(deviceName, (int) round(oneWireBuses[b].temperatures[i] * 10), now);
+            historySample(deviceName, (int) round(oneWireBuses[b].temperatures[i] * 10));
+            #if FEATURE_FLASH_LOG
+            flashLogSample(deviceName, (int) round(oneWireBuses[b].temperatures[i] * 10));
+            #endif
+            boolean trended = trendSample(deviceName, (int) round(oneWireBuses[b].temperatures[i] * 10), now);
+            boolean boosted = alarmBoosted(deviceName, now);
+            if ((jsonBuffer[deviceName].isNull()) || ((int) jsonBuffer[deviceName] != temperature) || (boosted)) { jsonBuffer[deviceName] = temperature; if ((!trended) || (boosted)) dirty = true; }
+            #ifdef DS18B20_LEGACY_PROPERTY
+            if ((b == 0) && (i == 0)) jsonBuffer[DS18B20_LEGACY_PROPERTY] = round(oneWireBuses[b].temperatures[i] * 100) / 100.0;
+            #endif
+          } else if (!jsonBuffer[deviceName].isNull()) {
+            jsonBuffer.remove(deviceName);
+            #ifdef DS18B20_LEGACY_PROPERTY
+            if ((b == 0) && (i == 0)) jsonBuffer.remove(DS18B20_LEGACY_PROPERTY);
+            #endif
+            dirty = true;
+          }
+          if (sensorHealthCollect(oneWireBuses[b].health[i])) { statusUpdate(deviceName, oneWireBuses[b].health[i]); dirty = true; }
+        }
+      }
+    }
+  }
+  #endif
+
+  // Registered sensors sample on their own schedule.
+  STATUS_SINK sink = { (unsigned long) now, false };
+  SENSORS::service(now, sink);
+  if (sink.dirty) dirty = true;
+  historyService(now);
+  #if FEATURE_FLASH_LOG
+  flashLogService(now);
+  #endif
+
+  // Check if our time has come to read the switches
+  if (now > mqttPublishSoftDeadline) {
+
+    if (!pulseCounterEnabled(0)) {
+      if (jsonBuffer[mqttConfig.sw0propertyname] != digitalRead(GPIO_SW0)) { jsonBuffer[mqttConfig.sw0propertyname] = digitalRead(GPIO_SW0); dirty = true; };
+    }
+    if (!pulseCounterEnabled(1)) {
+      if (jsonBuffer[mqttConfig.sw1propertyname] != digitalRead(GPIO_SW1)) { jsonBuffer[mqttConfig.sw1propertyname] = digitalRead(GPIO_SW1); dirty = true; };
+    }
+    #ifdef GPIO_SW2
+    if (jsonBuffer["sw2"] != digitalRead(GPIO_SW2)) { jsonBuffer["sw2"] = digitalRead(GPIO_SW2); dirty = true; };
+    if (jsonBuffer["sw3"] != digitalRead(GPIO_SW3)) { jsonBuffer["sw3"] = digitalRead(GPIO_SW3); dirty = true; };
+    #endif
+
+    mqttPublishSoftDeadline = (now + mqttConfig.softpublicationinterval);
+  }
+
+  // Alarm condition changes are published before anything else. Each
+  // stays pending until it can be queued.
+  for (unsigned int i = 0; i < (sizeof(alarmRules) / sizeof(ALARM_RULE)); i++) {
+    if ((alarmPending(i)) && (publishAlarm(alarmRules[i]))) alarmCollect(i);
+  }
+  trendService(now);
+
+  // Check if we should actually publish this data. Telemetry waits out
+  // any hold off imposed by a slow broker; events do not.
+  if (dirty) telemetryPending = true;
+  if (urgent || (telemetryPending && (now >= telemetryDeadline)) || (now > mqttPublishHardDeadline)) {
+    // The retained message expires should the module fall silent.
+    // A truncated or incomplete message is never published.
+    size_t length = serializeJson(jsonBuffer, mqttStatusMessage, sizeof(mqttStatusMessage));
+    if ((jsonBuffer.overflowed()) || (length >= (sizeof(mqttStatusMessage) - 1))) {
+      #ifdef DEBUG_SERIAL
+        Serial.println("Output message too large: not published");
+      #endif
+    } else {
+      mqttAsyncPublish(mqttConfig.topic, mqttStatusMessage, true, ((mqttConfig.hardpublicationinterval / 1000) * MQTT_TELEMETRY_EXPIRY));
+
+      // The round trip probe goes in the same write as the telemetry.
+      uint32_t probe;
+      if ((mqttAsyncConnected()) && (publishRateProbe(now, probe))) {
+        char topic[100];
+        char payload[12];
+        snprintf(topic, sizeof(topic), ECHO_TOPIC_FORMAT, mqttConfig.topic);
+        snprintf(payload, sizeof(payload), ECHO_MESSAGE_FORMAT, (unsigned long) probe);
+        mqttAsyncPublish(topic, payload, false, (PUBLISH_RATE_PROBE_TIMEOUT / 1000));
+      }
+
+      #ifdef DEBUG_SERIAL
+        Serial.print("Publishing ");
+        Serial.print(mqttStatusMessage);
+        Serial.print(" to ");
+        Serial.println(mqttConfig.topic);
+      #endif
+    }
+
+    mqttPublishHardDeadline = (now + publishRateStretch(mqttConfig.hardpublicationinterval));
+    telemetryDeadline = (now + publishRateHoldoff(mqttConfig.softpublicationinterval));
+    telemetryPending = false;
+  }
+
+  #if FEATURE_FLASH_LOG
+  // Samples logged during an outage are backfilled after live data, at
+  // a rate that adapts to how quickly the broker is taking them.
+  backfillService(mqttAsyncConnected(), now);
+  char backfillMessage[HISTORY_CHUNK_SIZE];
+  if (backfillNextChunk(backfillMessage, sizeof(backfillMessage), now)) {
+    char topic[100];
+    snprintf(topic, sizeof(topic), BACKFILL_TOPIC_FORMAT, mqttConfig.topic);
+    backfillBytes = strlen(backfillMessage);
+    // The outcome is reported by mqttSent() once the broker has the
+    // chunk, unless it cannot even be queued.
+    if ((backfillToken = mqttAsyncPublish(topic, backfillMessage)) == 0) backfillResult(false, 0UL, backfillBytes, now);
+  }
+  #endif
+}